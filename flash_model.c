@@ -0,0 +1,210 @@
+/*
+ * flash_model.c
+ *
+ * Model of a serial NOR flash for building the flash log in flashlog.h on a
+ * PC, so the log format and its recovery after a power failure can be tried
+ * out without the hardware.
+ *
+ * It behaves like the W25Q parts the log is used with:
+ *  - erase sets a whole 4K sector to 0xFF
+ *  - programming can only change bits from 1 to 0
+ *  - a program that runs past the end of a page wraps round to its start
+ *  - programs and erases stay busy for a number of polls
+ *
+ * FlashModel_CutPower makes the flash stop after a given number of bytes
+ * have been programmed, as if the power had failed. The byte it stops on is
+ * only partly programmed. Calling FlashLog_Init again afterwards is the same
+ * as the device restarting.
+ *
+ * FlashModel_Fail makes every operation return false, as the SPI flash
+ * driver does when the flash stops answering.
+ *
+ * A PC program uses it along these lines:
+ *
+ *   #include <stdint.h>
+ *   #include <stdbool.h>
+ *   #include <stddef.h>
+ *   #include "flashlog.h"
+ *   #include "flash_model.c"
+ *
+ *   FlashModel_Init();
+ *   FlashLog_Init(&flog, &flash_model_media, 0, FLASH_MODEL_SIZE);
+ *
+ * MIT License
+ *
+ * Copyright (c) 2018 Jon Axtell
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define FLASH_MODEL_SECTORS         16
+#define FLASH_MODEL_SIZE            (FLASH_MODEL_SECTORS * FLASH_LOG_SECTOR_SIZE)
+#define FLASH_MODEL_PROGRAM_POLLS   3
+#define FLASH_MODEL_ERASE_POLLS     20
+#define FLASH_MODEL_STUCK_POLLS     100         // Busy polls while failed before it's stuck
+#define FLASH_MODEL_NO_CUT          0xFFFFFFFFUL
+
+uint8_t flash_model[FLASH_MODEL_SIZE];
+uint32_t flash_model_busy;          // Polls until the current operation is done
+uint32_t flash_model_cut;           // Bytes that can be programmed before power fails
+uint32_t flash_model_programs;      // Bytes programmed, for seeing where to cut
+uint32_t flash_model_erases;        // Sectors erased
+bool flash_model_failed;            // Not answering
+uint32_t flash_model_stuck;         // Busy polls since it failed
+
+//-----------------------------------------------------------------------------
+// Start with the flash erased and the power on
+//
+void FlashModel_Init(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < FLASH_MODEL_SIZE; ++i)
+    {
+        flash_model[i] = 0xFF;
+    }
+    flash_model_busy = 0;
+    flash_model_cut = FLASH_MODEL_NO_CUT;
+    flash_model_programs = 0;
+    flash_model_erases = 0;
+    flash_model_failed = false;
+    flash_model_stuck = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Fail the power after some more bytes have been programmed
+//
+// Erases stop too. FlashModel_RestorePower brings it back, leaving the
+// contents as they were when it failed.
+//
+void FlashModel_CutPower(uint32_t bytes)
+{
+    flash_model_cut = bytes;
+}
+
+void FlashModel_RestorePower(void)
+{
+    flash_model_cut = FLASH_MODEL_NO_CUT;
+    flash_model_busy = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Stop, or start, answering
+//
+// Like a real flash that's stopped answering, whose status reads as all ones,
+// it's busy while failed, and stuck after FLASH_MODEL_STUCK_POLLS.
+//
+void FlashModel_Fail(bool failed)
+{
+    flash_model_failed = failed;
+    flash_model_stuck = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Media functions for the flash log
+//
+static bool FlashModel_Read(uint32_t address, uint8_t *data, uint16_t length)
+{
+    if (flash_model_failed)
+    {
+        return false;
+    }
+    while (length--)
+    {
+        *data++ = flash_model[address++ % FLASH_MODEL_SIZE];
+    }
+    return true;
+}
+
+static bool FlashModel_Program(uint32_t address, const uint8_t *data, uint16_t length)
+{
+    uint32_t page = address & ~(uint32_t)(FLASH_LOG_PAGE_SIZE - 1);
+    uint32_t offset = address & (FLASH_LOG_PAGE_SIZE - 1);
+
+    if (flash_model_failed)
+    {
+        return false;
+    }
+    while (length--)
+    {
+        if (flash_model_cut == 0)
+        {
+            return true;
+        }
+        if (--flash_model_cut == 0)
+        {
+            // Power fails part way through this byte
+            flash_model[(page + offset) % FLASH_MODEL_SIZE] &= *data | 0xF0;
+            return true;
+        }
+        flash_model[(page + offset) % FLASH_MODEL_SIZE] &= *data++;
+        offset = (offset + 1) & (FLASH_LOG_PAGE_SIZE - 1);
+        ++flash_model_programs;
+    }
+    flash_model_busy = FLASH_MODEL_PROGRAM_POLLS;
+    return true;
+}
+
+static bool FlashModel_EraseSector(uint32_t address)
+{
+    uint32_t sector = (address % FLASH_MODEL_SIZE) & ~(uint32_t)(FLASH_LOG_SECTOR_SIZE - 1);
+    uint32_t i;
+
+    if (flash_model_failed)
+    {
+        return false;
+    }
+    if (flash_model_cut == 0)
+    {
+        return true;
+    }
+    for (i = 0; i < FLASH_LOG_SECTOR_SIZE; ++i)
+    {
+        flash_model[sector + i] = 0xFF;
+    }
+    ++flash_model_erases;
+    flash_model_busy = FLASH_MODEL_ERASE_POLLS;
+    return true;
+}
+
+static flash_log_media_busy_t FlashModel_Busy(void)
+{
+    if (flash_model_failed)
+    {
+        if (flash_model_stuck < FLASH_MODEL_STUCK_POLLS)
+        {
+            ++flash_model_stuck;
+            return FLASH_LOG_MEDIA_BUSY;
+        }
+        return FLASH_LOG_MEDIA_STUCK;
+    }
+    if (flash_model_busy)
+    {
+        --flash_model_busy;
+        return FLASH_LOG_MEDIA_BUSY;
+    }
+    return FLASH_LOG_MEDIA_READY;
+}
+
+const flash_log_media_t flash_model_media =
+{
+    FlashModel_Read,
+    FlashModel_Program,
+    FlashModel_EraseSector,
+    FlashModel_Busy
+};
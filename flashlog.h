@@ -0,0 +1,492 @@
+/*
+ * flashlog.h
+ *
+ * Append only log of records in NOR flash that survives power failing at any
+ * point during a write.
+ *
+ * Only depends on the flash through flash_log_media_t so that it can be built
+ * on a PC against the model of a NOR flash in flash_model.c as well as on the
+ * STM8 against the SPI flash driver. It expects the includer to have defined
+ * bool, NULL and the uintN_t types, and is included by exactly one source file.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2018 Jon Axtell
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+//=============================================================================
+// Flash log
+//
+// Each record is an 8 byte header followed by its data:
+//
+//  0   commit      0xFF while being written, FLASH_LOG_COMMITTED when complete
+//  1   reserved    0xFF
+//  2   length      Data length, little endian
+//  4   ~length     Complement of the length, so a half written length shows up
+//  6   crc         CRC-16/CCITT of the data, little endian
+//
+// NOR flash bits can only be programmed from 1 to 0, so a record is written
+// with the commit byte left erased and the commit byte is programmed on its
+// own once everything else is in flash. Power failing before that leaves a
+// record that has a good length but isn't committed, which is skipped.
+// Power failing while the length is being written leaves a header that
+// doesn't check, and then the rest of that sector is abandoned.
+//
+// Records don't cross sectors. If one doesn't fit in what's left of a sector
+// the rest is left erased and it goes at the start of the next one. Because
+// the log only grows, an erased header followed by an erased sector is the
+// end of the log.
+//
+// Erasing goes from the last sector back to the first, so if that's
+// interrupted what's left is still a log, just a shorter one.
+//
+// Writes and erases are started from FlashLog_Poll, which never waits for
+// the flash, so the caller carries on with other work while a page programs.
+//
+// The media functions return false if the flash didn't respond, and busy
+// reports FLASH_LOG_MEDIA_STUCK once a program or erase has gone on for
+// longer than the flash could take, as a flash that's stopped answering
+// looks busy for ever. The log then stops being written, as where it ends is
+// no longer known, until it's opened again with FlashLog_Init.
+//
+
+#define FLASH_LOG_SECTOR_SIZE       4096
+#define FLASH_LOG_PAGE_SIZE         256
+#define FLASH_LOG_HEADER_SIZE       8
+#define FLASH_LOG_RECORD_MAX        56          // Header and data fit in 64 bytes
+#define FLASH_LOG_COMMITTED         0x00
+
+typedef enum
+{
+    FLASH_LOG_MEDIA_READY,
+    FLASH_LOG_MEDIA_BUSY,
+    FLASH_LOG_MEDIA_STUCK           // Busy for longer than a program or erase takes
+} flash_log_media_busy_t;
+
+typedef struct
+{
+    bool (*read)(uint32_t address, uint8_t *data, uint16_t length);
+    bool (*program)(uint32_t address, const uint8_t *data, uint16_t length);   // Within one page
+    bool (*erase)(uint32_t address);                                            // One sector
+    flash_log_media_busy_t (*busy)(void);
+} flash_log_media_t;
+
+typedef enum
+{
+    FLASH_LOG_IDLE,
+    FLASH_LOG_PROGRAM,              // Writing the header and data
+    FLASH_LOG_COMMIT,               // Writing the commit byte
+    FLASH_LOG_ERASE,                // Erasing sectors, last first
+    FLASH_LOG_FAILED                // The flash didn't respond
+} flash_log_state_t;
+
+typedef enum
+{
+    FLASH_LOG_SCAN_END,
+    FLASH_LOG_SCAN_RECORD,
+    FLASH_LOG_SCAN_SKIP,
+    FLASH_LOG_SCAN_FAILED
+} flash_log_scan_t;
+
+#define FLASH_LOG_READ_END          (-1)
+#define FLASH_LOG_READ_FAILED       (-2)
+
+typedef struct
+{
+    const flash_log_media_t *media;
+    uint32_t start;                 // Sector aligned
+    uint32_t end;
+    uint32_t head;                  // Where the next record goes
+    flash_log_state_t state;
+    uint32_t address;               // Record being written, or sector being erased
+    uint16_t length;                // Header and data
+    uint16_t done;                  // Bytes of it programmed
+    uint8_t buffer[FLASH_LOG_HEADER_SIZE + FLASH_LOG_RECORD_MAX];
+} flash_log_t;
+
+//-----------------------------------------------------------------------------
+// CRC-16/CCITT, polynomial 0x1021
+//
+// A faster version can be used by defining FLASH_LOG_CRC before including
+// this, e.g. CRC16_Update in main.c.
+//
+#if !defined FLASH_LOG_CRC
+#define FLASH_LOG_CRC               FlashLog_CRC
+
+static uint16_t FlashLog_CRC(uint16_t crc, const uint8_t *data, uint16_t length)
+{
+    uint8_t bit;
+
+    while (length--)
+    {
+        crc ^= (uint16_t)*data++ << 8;
+        for (bit = 0; bit < 8; ++bit)
+        {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+#endif // FLASH_LOG_CRC
+
+//-----------------------------------------------------------------------------
+// Address of the start of the sector after the one an address is in
+//
+static uint32_t FlashLog_NextSector(uint32_t address)
+{
+    return (address | (FLASH_LOG_SECTOR_SIZE - 1)) + 1;
+}
+
+//-----------------------------------------------------------------------------
+// Check if a header is erased
+//
+static bool FlashLog_Erased(const uint8_t *header)
+{
+    uint8_t i;
+
+    for (i = 0; i < FLASH_LOG_HEADER_SIZE; ++i)
+    {
+        if (header[i] != 0xFF)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Look at what's at a position in the log
+//
+// For a committed record its data length and CRC are returned and the
+// position is left at the record. Anything else that isn't the end of the
+// log moves the position on past it.
+//
+static flash_log_scan_t FlashLog_Scan(flash_log_t *flog, uint32_t *position, uint16_t *length, uint16_t *crc)
+{
+    uint8_t header[FLASH_LOG_HEADER_SIZE];
+    uint32_t next = FlashLog_NextSector(*position);
+    uint16_t check;
+
+    if (*position >= flog->end)
+    {
+        return FLASH_LOG_SCAN_END;
+    }
+
+    if ((next - *position) < FLASH_LOG_HEADER_SIZE)
+    {
+        *position = next;
+        return FLASH_LOG_SCAN_SKIP;
+    }
+
+    if (!flog->media->read(*position, header, FLASH_LOG_HEADER_SIZE))
+    {
+        return FLASH_LOG_SCAN_FAILED;
+    }
+    if (FlashLog_Erased(header))
+    {
+        // Either the end or padding before the next sector
+        if (next >= flog->end)
+        {
+            return FLASH_LOG_SCAN_END;
+        }
+        if (!flog->media->read(next, header, FLASH_LOG_HEADER_SIZE))
+        {
+            return FLASH_LOG_SCAN_FAILED;
+        }
+        if (FlashLog_Erased(header))
+        {
+            return FLASH_LOG_SCAN_END;
+        }
+        *position = next;
+        return FLASH_LOG_SCAN_SKIP;
+    }
+
+    *length = header[2] | ((uint16_t)header[3] << 8);
+    check = header[4] | ((uint16_t)header[5] << 8);
+    *crc = header[6] | ((uint16_t)header[7] << 8);
+    if (((*length ^ check) != 0xFFFF) || (*length > FLASH_LOG_RECORD_MAX) ||
+        ((*position + FLASH_LOG_HEADER_SIZE + *length) > next))
+    {
+        // Can't tell where the next record is so give up on the sector
+        *position = next;
+        return FLASH_LOG_SCAN_SKIP;
+    }
+
+    if (header[0] != FLASH_LOG_COMMITTED)
+    {
+        *position += FLASH_LOG_HEADER_SIZE + *length;
+        return FLASH_LOG_SCAN_SKIP;
+    }
+    return FLASH_LOG_SCAN_RECORD;
+}
+
+//-----------------------------------------------------------------------------
+// Open a log in a range of sectors and find where it ends
+//
+// Reads through the whole log so can take a while on a large one. Returns
+// false if the flash couldn't be read, in which case the log can't be
+// written.
+//
+bool FlashLog_Init(flash_log_t *flog, const flash_log_media_t *media, uint32_t start, uint32_t size)
+{
+    uint32_t position = start;
+    uint16_t length;
+    uint16_t crc;
+    flash_log_scan_t scan;
+
+    flog->media = media;
+    flog->start = start;
+    flog->end = start + size;
+    flog->state = FLASH_LOG_IDLE;
+
+    while ((scan = FlashLog_Scan(flog, &position, &length, &crc)) != FLASH_LOG_SCAN_END)
+    {
+        if (scan == FLASH_LOG_SCAN_FAILED)
+        {
+            flog->state = FLASH_LOG_FAILED;
+            break;
+        }
+        if (scan == FLASH_LOG_SCAN_RECORD)
+        {
+            position += FLASH_LOG_HEADER_SIZE + length;
+        }
+    }
+    flog->head = position;
+    return flog->state != FLASH_LOG_FAILED;
+}
+
+//-----------------------------------------------------------------------------
+// Check if a write or erase is still going on
+//
+bool FlashLog_Busy(flash_log_t *flog)
+{
+    return (flog->state != FLASH_LOG_IDLE) && (flog->state != FLASH_LOG_FAILED);
+}
+
+//-----------------------------------------------------------------------------
+// Check if the flash stopped responding
+//
+bool FlashLog_Failed(flash_log_t *flog)
+{
+    return flog->state == FLASH_LOG_FAILED;
+}
+
+//-----------------------------------------------------------------------------
+// Carry on with a write or erase
+//
+// Call regularly, e.g. from the main loop. Each call starts at most one
+// program or erase and returns straight away if the flash is busy. Returns
+// false if the flash has failed or got stuck busy, which abandons the write
+// or erase.
+//
+bool FlashLog_Poll(flash_log_t *flog)
+{
+    uint16_t chunk;
+    uint16_t page_left;
+    bool ok = true;
+
+    if (!FlashLog_Busy(flog))
+    {
+        return flog->state != FLASH_LOG_FAILED;
+    }
+    switch (flog->media->busy())
+    {
+        case FLASH_LOG_MEDIA_BUSY:
+        {
+            return true;
+        }
+        case FLASH_LOG_MEDIA_STUCK:
+        {
+            flog->state = FLASH_LOG_FAILED;
+            return false;
+        }
+        default:
+        {
+            break;
+        }
+    }
+
+    switch (flog->state)
+    {
+        case FLASH_LOG_PROGRAM:
+        {
+            if (flog->done < flog->length)
+            {
+                // The commit byte is left erased
+                chunk = flog->length - flog->done;
+                page_left = FLASH_LOG_PAGE_SIZE - ((flog->address + flog->done) & (FLASH_LOG_PAGE_SIZE - 1));
+                if (chunk > page_left)
+                {
+                    chunk = page_left;
+                }
+                ok = flog->media->program(flog->address + flog->done, &flog->buffer[flog->done], chunk);
+                flog->done += chunk;
+            }
+            else
+            {
+                flog->state = FLASH_LOG_COMMIT;
+            }
+            break;
+        }
+        case FLASH_LOG_COMMIT:
+        {
+            flog->buffer[0] = FLASH_LOG_COMMITTED;
+            ok = flog->media->program(flog->address, flog->buffer, 1);
+            flog->state = FLASH_LOG_IDLE;
+            break;
+        }
+        case FLASH_LOG_ERASE:
+        {
+            ok = flog->media->erase(flog->address);
+            if (flog->address == flog->start)
+            {
+                flog->head = flog->start;
+                flog->state = FLASH_LOG_IDLE;
+            }
+            else
+            {
+                flog->address -= FLASH_LOG_SECTOR_SIZE;
+            }
+            break;
+        }
+        default:
+        {
+            break;
+        }
+    }
+
+    if (!ok)
+    {
+        flog->state = FLASH_LOG_FAILED;
+    }
+    return ok;
+}
+
+//-----------------------------------------------------------------------------
+// Add a record to the end of the log
+//
+// The data is copied so the caller's buffer is free straight away. The write
+// is carried out by FlashLog_Poll. Returns false if a write or erase is
+// already going on, the record is too long, the log is full or it has failed.
+//
+bool FlashLog_Append(flash_log_t *flog, const uint8_t *data, uint16_t length)
+{
+    uint16_t crc;
+    uint16_t i;
+
+    if ((flog->state != FLASH_LOG_IDLE) || (length > FLASH_LOG_RECORD_MAX))
+    {
+        return false;
+    }
+
+    if ((FlashLog_NextSector(flog->head) - flog->head) < (uint32_t)(FLASH_LOG_HEADER_SIZE + length))
+    {
+        flog->head = FlashLog_NextSector(flog->head);
+    }
+    if ((flog->head + FLASH_LOG_HEADER_SIZE + length) > flog->end)
+    {
+        return false;
+    }
+
+    crc = FLASH_LOG_CRC(0xFFFF, data, length);
+    flog->buffer[0] = 0xFF;
+    flog->buffer[1] = 0xFF;
+    flog->buffer[2] = (uint8_t)(length >> 0);
+    flog->buffer[3] = (uint8_t)(length >> 8);
+    flog->buffer[4] = (uint8_t)~(length >> 0);
+    flog->buffer[5] = (uint8_t)~(length >> 8);
+    flog->buffer[6] = (uint8_t)(crc >> 0);
+    flog->buffer[7] = (uint8_t)(crc >> 8);
+    for (i = 0; i < length; ++i)
+    {
+        flog->buffer[FLASH_LOG_HEADER_SIZE + i] = data[i];
+    }
+
+    flog->address = flog->head;
+    flog->length = FLASH_LOG_HEADER_SIZE + length;
+    flog->done = 1;
+    flog->head += flog->length;
+    flog->state = FLASH_LOG_PROGRAM;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Erase the whole log
+//
+// Carried out a sector at a time by FlashLog_Poll. Returns false if a write
+// or erase is already going on or the log has failed.
+//
+bool FlashLog_Erase(flash_log_t *flog)
+{
+    if (flog->state != FLASH_LOG_IDLE)
+    {
+        return false;
+    }
+    flog->address = flog->end - FLASH_LOG_SECTOR_SIZE;
+    flog->state = FLASH_LOG_ERASE;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Read the next good record
+//
+// Start with *position set to 0. Records that weren't committed or fail their
+// CRC are skipped. Data longer than the buffer is cut short. Returns the
+// length of the record's data, FLASH_LOG_READ_END at the end of the log or
+// FLASH_LOG_READ_FAILED if the flash couldn't be read.
+//
+int16_t FlashLog_Read(flash_log_t *flog, uint32_t *position, uint8_t *data, uint16_t size)
+{
+    uint16_t length;
+    uint16_t crc;
+    uint8_t record[FLASH_LOG_RECORD_MAX];
+    uint16_t i;
+    flash_log_scan_t scan;
+
+    if (*position < flog->start)
+    {
+        *position = flog->start;
+    }
+
+    while ((scan = FlashLog_Scan(flog, position, &length, &crc)) != FLASH_LOG_SCAN_END)
+    {
+        if (scan == FLASH_LOG_SCAN_FAILED)
+        {
+            return FLASH_LOG_READ_FAILED;
+        }
+        if (scan == FLASH_LOG_SCAN_RECORD)
+        {
+            if (!flog->media->read(*position + FLASH_LOG_HEADER_SIZE, record, length))
+            {
+                return FLASH_LOG_READ_FAILED;
+            }
+            *position += FLASH_LOG_HEADER_SIZE + length;
+            if (FLASH_LOG_CRC(0xFFFF, record, length) == crc)
+            {
+                for (i = 0; (i < length) && (i < size); ++i)
+                {
+                    data[i] = record[i];
+                }
+                return (int16_t)length;
+            }
+        }
+    }
+    return FLASH_LOG_READ_END;
+}
@@ -0,0 +1,260 @@
+/*
+ * flashlog_test.c
+ *
+ * Tests the flash log in flashlog.h on a PC against the NOR flash model in
+ * flash_model.c. Built and run by "make test".
+ *
+ * The main test cuts the power at every few bytes programmed while records
+ * are being appended, then reopens the log as the device would on restart
+ * and checks that:
+ *  - every record that was committed before the cut reads back intact and in
+ *    order, and at most the one being written when the power failed is lost
+ *  - nothing that wasn't appended is read back
+ *  - records can still be appended after the recovery
+ *
+ * It also checks erasing, records that don't fit in what's left of a sector,
+ * a full log, and a flash that stops answering, including one stuck busy.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2018 Jon Axtell
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "flashlog.h"
+#include "flash_model.c"
+
+#define TEST_RECORDS                300
+#define TEST_CUT_LAST               12000       // Past where the records end
+#define TEST_CUT_STEP               3
+
+flash_log_t flog;
+unsigned test_failures;
+
+//-----------------------------------------------------------------------------
+// Report a failed check
+//
+#define CHECK(cond, ...)                    \
+    if (!(cond))                            \
+    {                                       \
+        ++test_failures;                    \
+        printf("FAIL line %d: ", __LINE__); \
+        printf(__VA_ARGS__);                \
+        printf("\n");                       \
+    }
+
+//-----------------------------------------------------------------------------
+// The length and contents of the nth test record
+//
+static uint16_t Test_RecordLength(int n)
+{
+    return (uint16_t)((n * 7) % (FLASH_LOG_RECORD_MAX + 1));
+}
+
+static uint8_t Test_RecordByte(int n, int i)
+{
+    return (uint8_t)(n + i);
+}
+
+//-----------------------------------------------------------------------------
+// Append the nth test record and wait for it to be written
+//
+static bool Test_Append(int n)
+{
+    uint8_t record[FLASH_LOG_RECORD_MAX];
+    uint16_t length = Test_RecordLength(n);
+    uint16_t i;
+
+    for (i = 0; i < length; ++i)
+    {
+        record[i] = Test_RecordByte(n, i);
+    }
+    if (!FlashLog_Append(&flog, record, length))
+    {
+        return false;
+    }
+    while (FlashLog_Busy(&flog))
+    {
+        FlashLog_Poll(&flog);
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Read the log back, checking it holds test records 0 onwards
+//
+// Returns how many there are, or -1 if one is wrong.
+//
+static int Test_ReadBack(uint32_t cut)
+{
+    uint8_t data[FLASH_LOG_RECORD_MAX];
+    uint32_t position = 0;
+    int16_t length;
+    int n = 0;
+    int i;
+
+    while ((length = FlashLog_Read(&flog, &position, data, sizeof(data))) >= 0)
+    {
+        if (length != Test_RecordLength(n))
+        {
+            printf("FAIL cut %u: record %d is %d bytes, expected %u\n", cut, n, length, Test_RecordLength(n));
+            return -1;
+        }
+        for (i = 0; i < length; ++i)
+        {
+            if (data[i] != Test_RecordByte(n, i))
+            {
+                printf("FAIL cut %u: record %d byte %d is wrong\n", cut, n, i);
+                return -1;
+            }
+        }
+        ++n;
+    }
+    CHECK(length == FLASH_LOG_READ_END, "cut %u: read returned %d", cut, length);
+    return n;
+}
+
+//-----------------------------------------------------------------------------
+// Cut the power part way through appending and check the log recovers
+//
+static void Test_PowerCut(uint32_t cut)
+{
+    int committed = 0;
+    int found;
+    int n;
+
+    FlashModel_Init();
+    FlashLog_Init(&flog, &flash_model_media, 0, FLASH_MODEL_SIZE);
+    FlashModel_CutPower(cut);
+    for (n = 0; (n < TEST_RECORDS) && flash_model_cut; ++n)
+    {
+        if (!Test_Append(n))
+        {
+            break;
+        }
+        if (flash_model_cut)
+        {
+            committed = n + 1;
+        }
+    }
+
+    // Restart
+    FlashModel_RestorePower();
+    CHECK(FlashLog_Init(&flog, &flash_model_media, 0, FLASH_MODEL_SIZE), "cut %u: init failed", cut);
+    found = Test_ReadBack(cut);
+    if (found < 0)
+    {
+        ++test_failures;
+        return;
+    }
+
+    // The record the power failed in might or might not have made it
+    CHECK((found == committed) || (found == committed + 1), "cut %u: %d records, %d committed", cut, found, committed);
+
+    // Carry on logging
+    CHECK(Test_Append(found), "cut %u: append after restart failed", cut);
+    CHECK(Test_ReadBack(cut) == found + 1, "cut %u: record appended after restart missing", cut);
+}
+
+//-----------------------------------------------------------------------------
+// Fill the log, then erase it
+//
+static void Test_FullAndErase(void)
+{
+    int n = 0;
+    int found;
+
+    FlashModel_Init();
+    FlashLog_Init(&flog, &flash_model_media, 0, FLASH_MODEL_SIZE);
+    while (Test_Append(n))
+    {
+        ++n;
+    }
+    CHECK(n > TEST_RECORDS, "only %d records fit", n);
+
+    // Nothing crosses a sector, and it's all still there after a restart
+    FlashLog_Init(&flog, &flash_model_media, 0, FLASH_MODEL_SIZE);
+    found = Test_ReadBack(0);
+    CHECK(found == n, "%d records read back of %d", found, n);
+    CHECK(!Test_Append(n), "append to a full log worked");
+
+    CHECK(FlashLog_Erase(&flog), "erase refused");
+    while (FlashLog_Busy(&flog))
+    {
+        FlashLog_Poll(&flog);
+    }
+    CHECK(flash_model_erases == FLASH_MODEL_SECTORS, "%u sectors erased", flash_model_erases);
+    CHECK(Test_ReadBack(0) == 0, "records left after erase");
+    CHECK(Test_Append(0) && (Test_ReadBack(0) == 1), "append after erase failed");
+}
+
+//-----------------------------------------------------------------------------
+// The flash stops answering
+//
+static void Test_Failed(void)
+{
+    uint8_t data[FLASH_LOG_RECORD_MAX] = { 0 };
+    uint32_t position = 0;
+    int i;
+
+    FlashModel_Init();
+    FlashLog_Init(&flog, &flash_model_media, 0, FLASH_MODEL_SIZE);
+    Test_Append(0);
+
+    // While writing, stuck busy part way through
+    CHECK(FlashLog_Append(&flog, data, 4), "append refused");
+    CHECK(FlashLog_Poll(&flog), "program not started");
+    FlashModel_Fail(true);
+    for (i = 0; (i <= FLASH_MODEL_STUCK_POLLS) && FlashLog_Poll(&flog); ++i)
+    {
+        CHECK(FlashLog_Busy(&flog), "stuck flash not busy");
+    }
+    CHECK(i == FLASH_MODEL_STUCK_POLLS, "poll failed after %d polls", i);
+    CHECK(FlashLog_Failed(&flog) && !FlashLog_Busy(&flog), "not marked failed");
+    CHECK(!FlashLog_Append(&flog, data, 4), "append to a failed log worked");
+    CHECK(FlashLog_Read(&flog, &position, data, sizeof(data)) == FLASH_LOG_READ_FAILED, "read didn't fail");
+
+    // While opening
+    CHECK(!FlashLog_Init(&flog, &flash_model_media, 0, FLASH_MODEL_SIZE), "init didn't fail");
+    CHECK(!FlashLog_Erase(&flog), "erase of a failed log worked");
+
+    // And back again
+    FlashModel_Fail(false);
+    CHECK(FlashLog_Init(&flog, &flash_model_media, 0, FLASH_MODEL_SIZE), "init failed");
+    CHECK(Test_ReadBack(0) == 1, "record lost");
+}
+
+int main(void)
+{
+    uint32_t cut;
+
+    for (cut = 1; cut < TEST_CUT_LAST; cut += TEST_CUT_STEP)
+    {
+        Test_PowerCut(cut);
+    }
+    Test_FullAndErase();
+    Test_Failed();
+
+    printf("flashlog: %u power cuts, %u failures\n", (TEST_CUT_LAST - 1 + TEST_CUT_STEP - 1) / TEST_CUT_STEP, test_failures);
+    return test_failures ? 1 : 0;
+}
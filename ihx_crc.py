@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+#
+# ihx_crc.py
+#
+# Post-link step that adds the CRC checked by the flash check functions in
+# main.c to an Intel hex file from SDCC.
+#
+# The unused program flash is filled with 0x00, the same as erased flash, so
+# the whole of it is written when the device is programmed. The last 4 bytes
+# are set to the CRC-16/CCITT of the rest followed by its complement, both
+# big endian.
+#
+#   ihx_crc.py bin/main.ihx [output.ihx]
+#
+# The input is overwritten if no output is given. A file that's already had
+# its CRC added is done again.
+#
+# MIT License
+#
+# Copyright (c) 2018 Jon Axtell
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+# of the Software, and to permit persons to whom the Software is furnished to do
+# so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+# INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+# PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+# HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+# SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#
+
+import sys
+
+# Must match FLASH_PROGRAM_START and FLASH_PROGRAM_END in main.c
+FLASH_PROGRAM_START = 0x8000
+FLASH_PROGRAM_END = 0xBFFF
+TRAILER_SIZE = 4
+ERASED = 0x00
+RECORD_SIZE = 32
+
+
+def crc16(data, crc=0xFFFF):
+    """CRC-16/CCITT, polynomial 0x1021, the same as CRC16_Update"""
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def read_ihx(path):
+    """Return the data as {address: byte}"""
+    memory = {}
+    upper = 0
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            line = line.strip()
+            if not line:
+                continue
+            if not line.startswith(':'):
+                sys.exit('%s:%d: not an Intel hex record' % (path, number))
+            record = bytes.fromhex(line[1:])
+            if (len(record) < 5) or (len(record) != record[0] + 5) or (sum(record) & 0xFF):
+                sys.exit('%s:%d: bad record' % (path, number))
+            length, address, kind = record[0], (record[1] << 8) | record[2], record[3]
+            data = record[4:4 + length]
+            if kind == 0x00:
+                for offset, byte in enumerate(data):
+                    memory[upper + address + offset] = byte
+            elif kind == 0x01:
+                break
+            elif kind == 0x04:
+                upper = ((data[0] << 8) | data[1]) << 16
+            elif kind == 0x02:
+                upper = ((data[0] << 8) | data[1]) << 4
+    return memory
+
+
+def record(kind, address, data):
+    fields = bytes([len(data), (address >> 8) & 0xFF, address & 0xFF, kind]) + bytes(data)
+    return ':%s%02X' % (fields.hex().upper(), -sum(fields) & 0xFF)
+
+
+def write_ihx(path, memory):
+    lines = []
+    addresses = sorted(memory)
+    upper = 0
+    i = 0
+    while i < len(addresses):
+        start = addresses[i]
+        if (start >> 16) != upper:
+            upper = start >> 16
+            lines.append(record(0x04, 0, [(upper >> 8) & 0xFF, upper & 0xFF]))
+        data = [memory[start]]
+        i += 1
+        while ((i < len(addresses)) and (addresses[i] == start + len(data)) and
+               (len(data) < RECORD_SIZE) and ((addresses[i] >> 16) == upper)):
+            data.append(memory[addresses[i]])
+            i += 1
+        lines.append(record(0x00, start & 0xFFFF, data))
+    lines.append(record(0x01, 0, []))
+    with open(path, 'w') as f:
+        f.write('\n'.join(lines) + '\n')
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.exit('usage: %s input.ihx [output.ihx]' % sys.argv[0])
+
+    memory = read_ihx(sys.argv[1])
+    trailer = FLASH_PROGRAM_END + 1 - TRAILER_SIZE
+    used = [a for a in memory if trailer <= a <= FLASH_PROGRAM_END]
+    old = [memory.get(a, ERASED) for a in range(trailer, FLASH_PROGRAM_END + 1)]
+    patched = ((old[0] ^ old[2]) == 0xFF) and ((old[1] ^ old[3]) == 0xFF)
+    if used and not patched:
+        sys.exit('%s: program uses 0x%04X, which is needed for the CRC' % (sys.argv[1], min(used)))
+
+    image = [memory.get(a, ERASED) for a in range(FLASH_PROGRAM_START, trailer)]
+    crc = crc16(image)
+    image += [crc >> 8, crc & 0xFF, (crc >> 8) ^ 0xFF, (crc & 0xFF) ^ 0xFF]
+    for offset, byte in enumerate(image):
+        memory[FLASH_PROGRAM_START + offset] = byte
+
+    write_ihx(sys.argv[-1], memory)
+    print('%s: CRC 0x%04X over 0x%04X-0x%04X' % (sys.argv[-1], crc, FLASH_PROGRAM_START, trailer - 1))
+
+
+if __name__ == '__main__':
+    main()
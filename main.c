@@ -46,6 +46,46 @@
 #define SERIALIZER
 //#define BEEPER
 //#define SQUARER
+//#define I2CSLAVE
+#define FLASHCHECK              // Program flash CRC check at boot and in the background
+
+// Drivers that nothing above uses are only compiled in when wanted, as they
+// don't all fit in the 16K of flash and 2K of RAM together
+//#define EXTIDISPATCH          // Per pin external interrupt callbacks
+//#define TIMGP                 // TIM2 and TIM3 general purpose timers
+//#define ONEPULSE              // TIM1 one pulse mode
+//#define CAPTURE               // Input capture and PWM input measurement
+//#define ENCODER               // Quadrature encoder on TIM1
+//#define BAM                   // Bit angle modulation on GPIO pins
+//#define DEBOUNCE              // Debounced inputs sampled from the system tick
+//#define ADCSCAN               // ADC1 scan mode triggered from TIM1
+//#define PIPELINE              // ADC sampling pipeline, needs ADCSCAN
+//#define SPIMASTER             // SPI master and slave driver
+//#define NORFLASH              // SPI NOR flash and the flash log, needs SPIMASTER
+//#define FLASHPROG             // Flash and data EEPROM programming
+//#define EEQUEUE               // Data EEPROM write queue, needs FLASHPROG
+//#define KVSTORE               // Key-value store in data EEPROM, needs EEQUEUE
+//#define I2CDEVICE             // I2C devices with retries and statistics, and bus scan
+
+// Features that need others
+#if defined FLASHER || defined BAM || defined CAPTURE
+#define TIMGP
+#endif
+#if defined PIPELINE
+#define ADCSCAN
+#endif
+#if defined NORFLASH
+#define SPIMASTER
+#endif
+#if defined KVSTORE
+#define EEQUEUE
+#endif
+#if defined EEQUEUE
+#define FLASHPROG
+#endif
+#if defined SQUARER
+#define I2CDEVICE
+#endif
 
 // Some basic macros to make life easy when using different compilers
 #if defined __IAR_SYSTEMS_ICC__
@@ -685,6 +725,100 @@ typedef struct
 #define GPIO_CR2_7_OUTPUT_2MHZ          ((uint8_t)0x00)
 #define GPIO_CR2_7_OUTPUT_10MHZ         ((uint8_t)0x80)
 
+// Pin descriptors
+//
+// PIN(D,7) names a single pin as a (port, bit) pair known at compile time so
+// that the Pin_xxx operations below collapse to one read-modify-write of a
+// constant address with a constant single bit mask. SDCC lowers those to the
+// bit instructions: BSET for set, BRES for clear, BCPL for toggle and BTJT/BTJF
+// when a read is used as a condition. A descriptor can be given a name,
+// e.g. #define LED_PIN PIN(D,7), and passed around like PIN() itself.
+//
+// The extra level of macro is needed so the descriptor is expanded into its two
+// parts before the operation splits it.
+//
+#define PIN(port, bit)                  (GPIO##port), (bit)
+#define PIN_MASK(bit)                   ((uint8_t)(1 << (bit)))
+
+#define PIN_SET_(gpio, bit)             ((gpio)->ODR |= PIN_MASK(bit))
+#define PIN_CLEAR_(gpio, bit)           ((gpio)->ODR &= (uint8_t)~PIN_MASK(bit))
+#define PIN_TOGGLE_(gpio, bit)          ((gpio)->ODR ^= PIN_MASK(bit))
+#define PIN_READ_(gpio, bit)            (((gpio)->IDR & PIN_MASK(bit)) != 0)
+#define PIN_LATCH_(gpio, bit)           (((gpio)->ODR & PIN_MASK(bit)) != 0)
+#define PIN_WRITE_(gpio, bit, value)    do { if (value) PIN_SET_(gpio, bit); else PIN_CLEAR_(gpio, bit); } while (0)
+#define PIN_OUTPUT_(gpio, bit)          do { (gpio)->DDR |= PIN_MASK(bit); (gpio)->CR1 |= PIN_MASK(bit); } while (0)
+#define PIN_OPENDRAIN_(gpio, bit)       do { (gpio)->DDR |= PIN_MASK(bit); (gpio)->CR1 &= (uint8_t)~PIN_MASK(bit); } while (0)
+#define PIN_INPUT_(gpio, bit)           do { (gpio)->DDR &= (uint8_t)~PIN_MASK(bit); (gpio)->CR1 &= (uint8_t)~PIN_MASK(bit); } while (0)
+#define PIN_PULLUP_(gpio, bit)          do { (gpio)->DDR &= (uint8_t)~PIN_MASK(bit); (gpio)->CR1 |= PIN_MASK(bit); } while (0)
+#define PIN_FAST_(gpio, bit)            ((gpio)->CR2 |= PIN_MASK(bit))
+#define PIN_SLOW_(gpio, bit)            ((gpio)->CR2 &= (uint8_t)~PIN_MASK(bit))
+
+#define Pin_Set(pin)                    PIN_SET_(pin)           // BSET
+#define Pin_Clear(pin)                  PIN_CLEAR_(pin)         // BRES
+#define Pin_Toggle(pin)                 PIN_TOGGLE_(pin)        // BCPL
+#define Pin_Read(pin)                   PIN_READ_(pin)          // BTJT/BTJF, input level
+#define Pin_Latch(pin)                  PIN_LATCH_(pin)         // BTJT/BTJF, output latch
+#define Pin_Write(pin, value)           PIN_WRITE_(pin, value)
+#define Pin_ConfigOutput(pin)           PIN_OUTPUT_(pin)        // Push-pull output
+#define Pin_ConfigOpenDrain(pin)        PIN_OPENDRAIN_(pin)     // Open drain output
+#define Pin_ConfigInput(pin)            PIN_INPUT_(pin)         // Floating input
+#define Pin_ConfigPullUp(pin)           PIN_PULLUP_(pin)        // Input with pull up
+#define Pin_ConfigFast(pin)             PIN_FAST_(pin)          // 10MHz output / input interrupt enable
+#define Pin_ConfigSlow(pin)             PIN_SLOW_(pin)          // 2MHz output / input interrupt disable
+
+
+//=============================================================================
+// Flash and data EEPROM
+//
+
+typedef struct
+{
+    __IO uint8_t CR1;       // Control register #1
+    __IO uint8_t CR2;       // Control register #2
+    __IO uint8_t NCR2;      // Complementary control register #2
+    __IO uint8_t FPR;       // Protection register
+    __IO uint8_t NFPR;      // Complementary protection register
+    __IO uint8_t IAPSR;     // In-application programming status register
+    uint8_t RESERVED1[2];
+    __IO uint8_t PUKR;      // Program memory unprotection register
+    uint8_t RESERVED2;
+    __IO uint8_t DUKR;      // Data EEPROM unprotection register
+} stm8_flash_t;
+
+#define FLASH_BaseAddress           0x505A
+#define FLASH                       ((stm8_flash_t *)FLASH_BaseAddress)
+
+#define FLASH_PROGRAM_START         0x8000      // 16K on the STM8S105K4
+#define FLASH_PROGRAM_END           0xBFFF
+#define FLASH_DATA_START            0x4000      // 1K of data EEPROM
+#define FLASH_DATA_END              0x43FF
+#define FLASH_BLOCK_SIZE            128
+#define FLASH_WORD_SIZE             4
+
+#define FLASH_CR1_HALT_MASK         ((uint8_t)0x08)     // Power down in halt mode
+#define FLASH_CR1_AHALT_MASK        ((uint8_t)0x04)     // Power down in active halt mode
+#define FLASH_CR1_IE_MASK           ((uint8_t)0x02)     // Flash interrupt enable
+#define FLASH_CR1_IE_DISABLE        ((uint8_t)0x00)
+#define FLASH_CR1_IE_ENABLE         ((uint8_t)0x02)
+#define FLASH_CR1_FIX_MASK          ((uint8_t)0x01)     // Fixed byte programming time
+
+#define FLASH_CR2_OPT_MASK          ((uint8_t)0x80)     // Write option bytes
+#define FLASH_CR2_WPRG_MASK         ((uint8_t)0x40)     // Word programming
+#define FLASH_CR2_ERASE_MASK        ((uint8_t)0x20)     // Block erasing
+#define FLASH_CR2_FPRG_MASK         ((uint8_t)0x10)     // Fast block programming
+#define FLASH_CR2_PRG_MASK          ((uint8_t)0x01)     // Standard block programming
+
+#define FLASH_IAPSR_HVOFF_MASK      ((uint8_t)0x40)     // End of high voltage
+#define FLASH_IAPSR_DUL_MASK        ((uint8_t)0x08)     // Data EEPROM unlocked
+#define FLASH_IAPSR_EOP_MASK        ((uint8_t)0x04)     // End of programming
+#define FLASH_IAPSR_PUL_MASK        ((uint8_t)0x02)     // Program memory unlocked
+#define FLASH_IAPSR_WR_PG_DIS_MASK  ((uint8_t)0x01)     // Write attempted to protected page
+
+#define FLASH_PUKR_KEY1             ((uint8_t)0x56)
+#define FLASH_PUKR_KEY2             ((uint8_t)0xAE)
+#define FLASH_DUKR_KEY1             ((uint8_t)0xAE)
+#define FLASH_DUKR_KEY2             ((uint8_t)0x56)
+
 
 //=============================================================================
 // Beeper
@@ -1395,6 +1529,71 @@ typedef struct
 #define TIM1_OISR_OIS1_DISABLE      ((uint8_t)0x00)
 #define TIM1_OISR_OIS1_ENABLE       ((uint8_t)0x01)
 
+//-----------------------------------------------------------------------------
+// Timer 2
+//
+// The bits in CR1, IER, SR1, SR2, EGR, CCMR and CCER are in the same places
+// as TIM1 so the TIM1 definitions are used for them.
+//
+typedef struct
+{
+    __IO uint8_t CR1;   /* control register 1 */
+    __IO uint8_t IER;   /* interrupt enable register */
+    __IO uint8_t SR1;   /* status register 1 */
+    __IO uint8_t SR2;   /* status register 2 */
+    __IO uint8_t EGR;   /* event generation register */
+    __IO uint8_t CCMR1; /* CC mode register 1 */
+    __IO uint8_t CCMR2; /* CC mode register 2 */
+    __IO uint8_t CCMR3; /* CC mode register 3 */
+    __IO uint8_t CCER1; /* CC enable register 1 */
+    __IO uint8_t CCER2; /* CC enable register 2 */
+    __IO uint8_t CNTRH; /* counter high */
+    __IO uint8_t CNTRL; /* counter low */
+    __IO uint8_t PSCR;  /* prescaler register */
+    __IO uint8_t ARRH;  /* auto-reload register high */
+    __IO uint8_t ARRL;  /* auto-reload register low */
+    __IO uint8_t CCR1H; /* capture/compare register 1 high */
+    __IO uint8_t CCR1L; /* capture/compare register 1 low */
+    __IO uint8_t CCR2H; /* capture/compare register 2 high */
+    __IO uint8_t CCR2L; /* capture/compare register 2 low */
+    __IO uint8_t CCR3H; /* capture/compare register 3 high */
+    __IO uint8_t CCR3L; /* capture/compare register 3 low */
+} stm8_tim2_t;
+
+#define TIM2                        ((stm8_tim2_t *)TIM2_BaseAddress)
+
+#define TIM2_PSCR_PSC_MASK          ((uint8_t)0x0F) /* Prescaler Value mask, division is 2^PSC. */
+
+//-----------------------------------------------------------------------------
+// Timer 3
+//
+// As timer 2 but with two channels.
+//
+typedef struct
+{
+    __IO uint8_t CR1;   /* control register 1 */
+    __IO uint8_t IER;   /* interrupt enable register */
+    __IO uint8_t SR1;   /* status register 1 */
+    __IO uint8_t SR2;   /* status register 2 */
+    __IO uint8_t EGR;   /* event generation register */
+    __IO uint8_t CCMR1; /* CC mode register 1 */
+    __IO uint8_t CCMR2; /* CC mode register 2 */
+    __IO uint8_t CCER1; /* CC enable register 1 */
+    __IO uint8_t CNTRH; /* counter high */
+    __IO uint8_t CNTRL; /* counter low */
+    __IO uint8_t PSCR;  /* prescaler register */
+    __IO uint8_t ARRH;  /* auto-reload register high */
+    __IO uint8_t ARRL;  /* auto-reload register low */
+    __IO uint8_t CCR1H; /* capture/compare register 1 high */
+    __IO uint8_t CCR1L; /* capture/compare register 1 low */
+    __IO uint8_t CCR2H; /* capture/compare register 2 high */
+    __IO uint8_t CCR2L; /* capture/compare register 2 low */
+} stm8_tim3_t;
+
+#define TIM3                        ((stm8_tim3_t *)TIM3_BaseAddress)
+
+#define TIM3_PSCR_PSC_MASK          ((uint8_t)0x0F) /* Prescaler Value mask, division is 2^PSC. */
+
 //-----------------------------------------------------------------------------
 // Timer 4
 //
@@ -1459,6 +1658,84 @@ typedef struct
 
 #define TIM4_ARR_ARR_MASK           ((uint8_t)0xFF) /* Autoreload Value mask. */
 
+//=============================================================================
+// Serial Peripheral Interface (SPI)
+//
+
+typedef struct
+{
+    __IO uint8_t CR1;       // Control register #1
+    __IO uint8_t CR2;       // Control register #2
+    __IO uint8_t ICR;       // Interrupt control register
+    __IO uint8_t SR;        // Status register
+    __IO uint8_t DR;        // Data register
+    __IO uint8_t CRCPR;     // CRC polynomial register
+    __IO uint8_t RXCRCR;    // Rx CRC register
+    __IO uint8_t TXCRCR;    // Tx CRC register
+} stm8_spi_t;
+
+#define SPI_BaseAddress             0x5200
+#define SPI                         ((stm8_spi_t *)SPI_BaseAddress)
+
+#define SPI_CR1_LSBFIRST_MASK       ((uint8_t)0x80)     // Frame format
+#define SPI_CR1_LSBFIRST_MSB        ((uint8_t)0x00)
+#define SPI_CR1_LSBFIRST_LSB        ((uint8_t)0x80)
+
+#define SPI_CR1_SPE_MASK            ((uint8_t)0x40)     // SPI enable
+#define SPI_CR1_SPE_DISABLE         ((uint8_t)0x00)
+#define SPI_CR1_SPE_ENABLE          ((uint8_t)0x40)
+
+#define SPI_CR1_BR_MASK             ((uint8_t)0x38)     // Baud rate control, fMASTER / 2^(BR+1)
+#define SPI_CR1_BR_SHIFT            3
+#define SPI_CR1_BR_DIV2             ((uint8_t)0x00)
+#define SPI_CR1_BR_DIV4             ((uint8_t)0x08)
+#define SPI_CR1_BR_DIV8             ((uint8_t)0x10)
+#define SPI_CR1_BR_DIV16            ((uint8_t)0x18)
+#define SPI_CR1_BR_DIV32            ((uint8_t)0x20)
+#define SPI_CR1_BR_DIV64            ((uint8_t)0x28)
+#define SPI_CR1_BR_DIV128           ((uint8_t)0x30)
+#define SPI_CR1_BR_DIV256           ((uint8_t)0x38)
+
+#define SPI_CR1_MSTR_MASK           ((uint8_t)0x04)     // Master selection
+#define SPI_CR1_MSTR_SLAVE          ((uint8_t)0x00)
+#define SPI_CR1_MSTR_MASTER         ((uint8_t)0x04)
+
+#define SPI_CR1_CPOL_MASK           ((uint8_t)0x02)     // Clock polarity
+#define SPI_CR1_CPOL_LOW            ((uint8_t)0x00)
+#define SPI_CR1_CPOL_HIGH           ((uint8_t)0x02)
+
+#define SPI_CR1_CPHA_MASK           ((uint8_t)0x01)     // Clock phase
+#define SPI_CR1_CPHA_FIRST          ((uint8_t)0x00)
+#define SPI_CR1_CPHA_SECOND         ((uint8_t)0x01)
+
+#define SPI_CR2_BDM_MASK            ((uint8_t)0x80)     // Bidirectional data mode enable
+#define SPI_CR2_BDOE_MASK           ((uint8_t)0x40)     // Output enable in bidirectional mode
+#define SPI_CR2_CRCEN_MASK          ((uint8_t)0x20)     // Hardware CRC calculation enable
+#define SPI_CR2_CRCNEXT_MASK        ((uint8_t)0x10)     // Transmit CRC next
+#define SPI_CR2_RXONLY_MASK         ((uint8_t)0x04)     // Receive only
+
+#define SPI_CR2_SSM_MASK            ((uint8_t)0x02)     // Software slave management
+#define SPI_CR2_SSM_DISABLE         ((uint8_t)0x00)     // NSS pin used
+#define SPI_CR2_SSM_ENABLE          ((uint8_t)0x02)     // SSI bit used
+
+#define SPI_CR2_SSI_MASK            ((uint8_t)0x01)     // Internal slave select
+#define SPI_CR2_SSI_SLAVE           ((uint8_t)0x00)
+#define SPI_CR2_SSI_MASTER          ((uint8_t)0x01)
+
+#define SPI_ICR_TXIE_MASK           ((uint8_t)0x80)     // Tx buffer empty interrupt enable
+#define SPI_ICR_RXIE_MASK           ((uint8_t)0x40)     // Rx buffer not empty interrupt enable
+#define SPI_ICR_ERRIE_MASK          ((uint8_t)0x20)     // Error interrupt enable
+#define SPI_ICR_WKIE_MASK           ((uint8_t)0x10)     // Wakeup interrupt enable
+
+#define SPI_SR_BSY_MASK             ((uint8_t)0x80)     // Busy flag
+#define SPI_SR_OVR_MASK             ((uint8_t)0x40)     // Overrun flag
+#define SPI_SR_MODF_MASK            ((uint8_t)0x20)     // Mode fault
+#define SPI_SR_CRCERR_MASK          ((uint8_t)0x10)     // CRC error flag
+#define SPI_SR_WKUP_MASK            ((uint8_t)0x08)     // Wakeup flag
+#define SPI_SR_TXE_MASK             ((uint8_t)0x02)     // Transmit buffer empty
+#define SPI_SR_RXNE_MASK            ((uint8_t)0x01)     // Receive buffer not empty
+
+
 //=============================================================================
 // Intra Integrated Circuit (I2C)
 //
@@ -1614,6 +1891,8 @@ typedef struct
 #define I2C_SR2_BERR_NOT_DECTECTED  ((uint8_t)0x00)
 #define I2C_SR2_BERR_DECTECTED      ((uint8_t)0x01)
 
+#define I2C_SR2_ERRORS_MASK         ((uint8_t)0x0F)     // All of the above error flags
+
 #define I2C_SR3_DUALF_MASK          ((uint8_t)0x80)     // Dual flag
 #define I2C_SR3_DUALF_MATCH_OAR1    ((uint8_t)0x00)
 #define I2C_SR3_DUALF_MATCH_OAR2    ((uint8_t)0x80)
@@ -1642,9 +1921,9 @@ typedef struct
 #define I2C_ITR_EVTEN_DISABLE       ((uint8_t)0x00)
 #define I2C_ITR_EVTEN_ENABLE        ((uint8_t)0x02)
 
-#define I2C_ITR_ERREN_MASK          ((uint8_t)0x04)     // Error interrupt enable
+#define I2C_ITR_ERREN_MASK          ((uint8_t)0x01)     // Error interrupt enable
 #define I2C_ITR_ERREN_DISABLE       ((uint8_t)0x00)
-#define I2C_ITR_ERREN_ENABLE        ((uint8_t)0x04)
+#define I2C_ITR_ERREN_ENABLE        ((uint8_t)0x01)
 
 #define I2C_CCRL_CCR_MASK           ((uint8_t)0xFF)     // Clock register low
 
@@ -1969,6 +2248,168 @@ typedef struct
 #define UARTx_PSCR_MASK             ((uint8_t)0xFF)     // Prescaler value (not UART3)
 
 
+//=============================================================================
+// Analog to Digital Converter (ADC1)
+//
+
+//-----------------------------------------------------------------------------
+// Data buffer, used in scan mode
+//
+// Each channel's result is a high and low register pair, DBxRH then DBxRL.
+//
+typedef struct
+{
+    __IO uint8_t DBR[20];   // Data buffer registers
+} stm8_adc1_buffer_t;
+
+#define ADC1_BUFFER_BaseAddress     0x53E0
+#define ADC1_BUFFER                 ((stm8_adc1_buffer_t *)ADC1_BUFFER_BaseAddress)
+#define ADC1_BUFFER_CHANNELS        10
+
+//-----------------------------------------------------------------------------
+// ADC 1
+//
+typedef struct
+{
+    __IO uint8_t CSR;       // Control/status register
+    __IO uint8_t CR1;       // Configuration register #1
+    __IO uint8_t CR2;       // Configuration register #2
+    __IO uint8_t CR3;       // Configuration register #3
+    __IO uint8_t DRH;       // Data register high
+    __IO uint8_t DRL;       // Data register low
+    __IO uint8_t TDRH;      // Schmitt trigger disable register high
+    __IO uint8_t TDRL;      // Schmitt trigger disable register low
+    __IO uint8_t HTRH;      // High threshold register high
+    __IO uint8_t HTRL;      // High threshold register low
+    __IO uint8_t LTRH;      // Low threshold register high
+    __IO uint8_t LTRL;      // Low threshold register low
+    __IO uint8_t AWSRH;     // Analog watchdog status register high
+    __IO uint8_t AWSRL;     // Analog watchdog status register low
+    __IO uint8_t AWCRH;     // Analog watchdog control register high
+    __IO uint8_t AWCRL;     // Analog watchdog control register low
+} stm8_adc1_t;
+
+#define ADC1_BaseAddress            0x5400
+#define ADC1                        ((stm8_adc1_t *)ADC1_BaseAddress)
+
+#define ADC1_CSR_EOC_MASK           ((uint8_t)0x80)     // End of conversion
+#define ADC1_CSR_EOC_CLEAR          ((uint8_t)0x00)
+#define ADC1_CSR_AWD_MASK           ((uint8_t)0x40)     // Analog watchdog flag
+#define ADC1_CSR_EOCIE_MASK         ((uint8_t)0x20)     // Interrupt enable for EOC
+#define ADC1_CSR_EOCIE_DISABLE      ((uint8_t)0x00)
+#define ADC1_CSR_EOCIE_ENABLE       ((uint8_t)0x20)
+#define ADC1_CSR_AWDIE_MASK         ((uint8_t)0x10)     // Analog watchdog interrupt enable
+#define ADC1_CSR_CH_MASK            ((uint8_t)0x0F)     // Channel selection, last channel in scan mode
+
+#define ADC1_CR1_SPSEL_MASK         ((uint8_t)0x70)     // Prescaler selection
+#define ADC1_CR1_SPSEL_DIV2         ((uint8_t)0x00)
+#define ADC1_CR1_SPSEL_DIV3         ((uint8_t)0x10)
+#define ADC1_CR1_SPSEL_DIV4         ((uint8_t)0x20)
+#define ADC1_CR1_SPSEL_DIV6         ((uint8_t)0x30)
+#define ADC1_CR1_SPSEL_DIV8         ((uint8_t)0x40)
+#define ADC1_CR1_SPSEL_DIV10        ((uint8_t)0x50)
+#define ADC1_CR1_SPSEL_DIV12        ((uint8_t)0x60)
+#define ADC1_CR1_SPSEL_DIV18        ((uint8_t)0x70)
+#define ADC1_CR1_SPSEL_SHIFT        4
+
+#define ADC1_CR1_CONT_MASK          ((uint8_t)0x02)     // Continuous conversion
+#define ADC1_CR1_CONT_SINGLE        ((uint8_t)0x00)
+#define ADC1_CR1_CONT_CONTINUOUS    ((uint8_t)0x02)
+
+#define ADC1_CR1_ADON_MASK          ((uint8_t)0x01)     // A/D converter on/off
+#define ADC1_CR1_ADON_OFF           ((uint8_t)0x00)
+#define ADC1_CR1_ADON_ON            ((uint8_t)0x01)
+
+#define ADC1_CR2_EXTTRIG_MASK       ((uint8_t)0x40)     // External trigger enable
+#define ADC1_CR2_EXTTRIG_DISABLE    ((uint8_t)0x00)
+#define ADC1_CR2_EXTTRIG_ENABLE     ((uint8_t)0x40)
+
+#define ADC1_CR2_EXTSEL_MASK        ((uint8_t)0x30)     // External event selection
+#define ADC1_CR2_EXTSEL_TIM1_TRGO   ((uint8_t)0x00)
+#define ADC1_CR2_EXTSEL_ETR         ((uint8_t)0x10)
+
+#define ADC1_CR2_ALIGN_MASK         ((uint8_t)0x08)     // Data alignment
+#define ADC1_CR2_ALIGN_LEFT         ((uint8_t)0x00)
+#define ADC1_CR2_ALIGN_RIGHT        ((uint8_t)0x08)
+
+#define ADC1_CR2_SCAN_MASK          ((uint8_t)0x02)     // Scan mode enable
+#define ADC1_CR2_SCAN_DISABLE       ((uint8_t)0x00)
+#define ADC1_CR2_SCAN_ENABLE        ((uint8_t)0x02)
+
+#define ADC1_CR3_DBUF_MASK          ((uint8_t)0x80)     // Data buffer enable
+#define ADC1_CR3_OVR_MASK           ((uint8_t)0x40)     // Overrun flag
+#define ADC1_CR3_OVR_CLEAR          ((uint8_t)0x00)
+
+
+//=============================================================================
+// Bounded wait functions
+//
+// Every wait on a hardware flag goes through Wait_Flag so that a flag which
+// never changes, eg. a missing crystal, can't hang the system. The budget is
+// a number of polls rather than systick ms, so it works before the system
+// tick is running and with interrupts disabled. A poll is about 12 cycles.
+//
+// Timeouts are counted by source so they can be reported later. A fast path
+// that can't afford a call per poll, eg. a byte at a time SPI transfer, polls
+// inline with its own budget and calls Wait_Expired when that runs out.
+//
+
+typedef enum
+{
+    WAIT_OK,
+    WAIT_TIMEOUT
+} wait_status_t;
+
+typedef enum
+{
+    WAIT_SOURCE_CLOCK,
+    WAIT_SOURCE_UART,
+    WAIT_SOURCE_CAPTURE,
+    WAIT_SOURCE_SPI,
+    WAIT_SOURCE_I2C,
+    WAIT_SOURCE_COUNT
+} wait_source_t;
+
+#define WAIT_BUDGET_CLOCK           0xFFFF      // Oscillator start up can take ms
+#define WAIT_BUDGET_UART            0x4000      // More than a character at 2400 baud at 16MHz
+#define WAIT_BUDGET_CAPTURE         0x4000
+#define WAIT_BUDGET_SPI             0x0800      // Several bytes at the slowest SPI clock
+#define WAIT_BUDGET_I2C             0x4000      // About 10ms at 16MHz, several bytes at 10KHz
+
+uint16_t wait_timeouts[WAIT_SOURCE_COUNT];
+
+//-----------------------------------------------------------------------------
+// Wait until the masked register equals value, for at most budget polls
+//
+wait_status_t Wait_Flag(__IO uint8_t *reg, uint8_t mask, uint8_t value, uint16_t budget, wait_source_t source)
+{
+    while (budget--)
+    {
+        if ((*reg & mask) == value)
+        {
+            return WAIT_OK;
+        }
+    }
+    ++wait_timeouts[source];
+    return WAIT_TIMEOUT;
+}
+
+//-----------------------------------------------------------------------------
+// Count a timeout from a wait polled inline
+//
+void Wait_Expired(wait_source_t source)
+{
+    ++wait_timeouts[source];
+}
+
+//-----------------------------------------------------------------------------
+// Return the number of timeouts from a source
+//
+uint16_t Wait_GetTimeouts(wait_source_t source)
+{
+    return wait_timeouts[source];
+}
+
 //=============================================================================
 // System clock functions
 //
@@ -1976,6 +2417,9 @@ typedef struct
 // conditionally compiled out or the compiler might optimise them out if they
 // aren't used.
 //
+// They return false, leaving the clock as it was, if the oscillator doesn't
+// start or the switch doesn't complete.
+//
 
 uint32_t sysclock;
 
@@ -1986,7 +2430,7 @@ uint32_t sysclock;
 //
 // TODO: Check if the LSI is enabled in the option byte as its required.
 //
-void SysClock_LSI(void)
+bool SysClock_LSI(void)
 {
     // Enable automatic clock switching
     CLK->SWCR = CLK_SWCR_SWEN_AUTOMATIC;
@@ -1995,19 +2439,23 @@ void SysClock_LSI(void)
     CLK->ICKR = CLK_ICKR_LSIEN_ENABLE;
 
     // Wait for the LSI to be ready
-    while ((CLK->ICKR & CLK_ICKR_LSIRDY_MASK) == CLK_ICKR_LSIRDY_NOTREADY)
+    if (Wait_Flag(&CLK->ICKR, CLK_ICKR_LSIRDY_MASK, CLK_ICKR_LSIRDY_READY, WAIT_BUDGET_CLOCK, WAIT_SOURCE_CLOCK) != WAIT_OK)
     {
+        return false;
     }
 
     // Switch to the LSI
     CLK->SWR = CLK_SWR_SWI_LSI;
 
-    // Wait for the switch to the LSI to be completed
-    while (CLK->CMSR != CLK_CMSR_CKM_LSI)
+    // Wait for the switch to the LSI to be completed, abandon it if it doesn't
+    if (Wait_Flag(&CLK->CMSR, 0xFF, CLK_CMSR_CKM_LSI, WAIT_BUDGET_CLOCK, WAIT_SOURCE_CLOCK) != WAIT_OK)
     {
+        CLK->SWCR = (CLK->SWCR & ~CLK_SWCR_SWBSY_MASK) | CLK_SWCR_SWBSY_NOTBUSY;
+        return false;
     }
 
     sysclock = 128000;
+    return true;
 }
 
 //-----------------------------------------------------------------------------
@@ -2015,11 +2463,8 @@ void SysClock_LSI(void)
 //
 // The system will run at 16Mhz
 //
-void SysClock_HSI(void)
+bool SysClock_HSI(void)
 {
-    // Set the clock prescaler for the HSI
-    CLK->CKDIVR = CLK_CKDIVR_CPUDIV1 | CLK_CKDIVR_HSIDIV1;
-
     // Enable automatic clock switching
     CLK->SWCR = CLK_SWCR_SWEN_AUTOMATIC;
 
@@ -2027,19 +2472,27 @@ void SysClock_HSI(void)
     CLK->ICKR = CLK_ICKR_HSIEN_ENABLE;
 
     // Wait for the HSI to be ready
-    while ((CLK->ICKR & CLK_ICKR_HSIRDY_MASK) == CLK_ICKR_HSIRDY_NOTREADY)
+    if (Wait_Flag(&CLK->ICKR, CLK_ICKR_HSIRDY_MASK, CLK_ICKR_HSIRDY_READY, WAIT_BUDGET_CLOCK, WAIT_SOURCE_CLOCK) != WAIT_OK)
     {
+        return false;
     }
 
     // Switch to the HSI
     CLK->SWR = CLK_SWR_SWI_HSI;
 
-    // Wait for the switch to the HSI to be completed
-    while (CLK->CMSR != CLK_CMSR_CKM_HSI)
+    // Wait for the switch to the HSI to be completed, abandon it if it doesn't
+    if (Wait_Flag(&CLK->CMSR, 0xFF, CLK_CMSR_CKM_HSI, WAIT_BUDGET_CLOCK, WAIT_SOURCE_CLOCK) != WAIT_OK)
     {
+        CLK->SWCR = (CLK->SWCR & ~CLK_SWCR_SWBSY_MASK) | CLK_SWCR_SWBSY_NOTBUSY;
+        return false;
     }
 
+    // Set the clock prescaler for the HSI, only once it's in use so a failed
+    // switch leaves the clock as it was
+    CLK->CKDIVR = CLK_CKDIVR_CPUDIV1 | CLK_CKDIVR_HSIDIV1;
+
     sysclock = 16000000;
+    return true;
 }
 
 //-----------------------------------------------------------------------------
@@ -2047,7 +2500,7 @@ void SysClock_HSI(void)
 //
 // The system will run at 1-24Mhz
 //
-void SysClock_HSE(void)
+bool SysClock_HSE(void)
 {
     // Enable automatic clock switching
     CLK->SWCR = CLK_SWCR_SWEN_AUTOMATIC;
@@ -2056,19 +2509,23 @@ void SysClock_HSE(void)
     CLK->ECKR = CLK_ECKR_HSEEN_ENABLE;
 
     // Wait for the HSE to be ready
-    while ((CLK->ECKR & CLK_ECKR_HSERDY_MASK) == CLK_ECKR_HSERDY_NOTREADY)
+    if (Wait_Flag(&CLK->ECKR, CLK_ECKR_HSERDY_MASK, CLK_ECKR_HSERDY_READY, WAIT_BUDGET_CLOCK, WAIT_SOURCE_CLOCK) != WAIT_OK)
     {
+        return false;
     }
 
     // Switch to the HSE
     CLK->SWR = CLK_SWR_SWI_HSE;
 
-    // Wait for the switch to the HSE to be completed
-    while (CLK->CMSR != CLK_CMSR_CKM_HSE)
+    // Wait for the switch to the HSE to be completed, abandon it if it doesn't
+    if (Wait_Flag(&CLK->CMSR, 0xFF, CLK_CMSR_CKM_HSE, WAIT_BUDGET_CLOCK, WAIT_SOURCE_CLOCK) != WAIT_OK)
     {
+        CLK->SWCR = (CLK->SWCR & ~CLK_SWCR_SWBSY_MASK) | CLK_SWCR_SWBSY_NOTBUSY;
+        return false;
     }
 
     sysclock = 8000000;
+    return true;
 }
 
 //-----------------------------------------------------------------------------
@@ -2079,6 +2536,139 @@ uint32_t SysClock_GetClockFreq(void)
     return sysclock;
 }
 
+//=============================================================================
+// Delay functions
+//
+// Delay_Us is a busy loop of a known number of cycles, for short delays
+// that Systick_Wait is far too coarse for. The loop is 4 cycles per pass
+// (nop 1, decw 1, jrne 2 when taken) and the number of passes is worked out
+// from the clock frequency. It's recalculated whenever the clock changes.
+//
+// The fixed cost of the call and the sums is taken off the loop, so the
+// delay is accurate to a pass or so above a few us at 16MHz. Interrupts
+// stretch it, disable them around anything that is timing critical.
+//
+// That cost depends on the code the compiler generates, so Delay_Calibrate
+// measures it on the target rather than it being guessed. It runs TIM2 from
+// the undivided system clock and times Delay_Us at 10, 100 and 1000us with
+// interrupts off. Each time less the cost of reading the counter and less
+// 4 cycles a pass is the overhead, and the smallest is used. The cost is in
+// cycles so it's the same at any clock, but Delay_Measure can be used to
+// check the delays at each clock the application uses.
+//
+// Only clocks of 1MHz and up are useful, at 128KHz a pass is already 31us.
+//
+
+#define DELAY_LOOP_CYCLES           4
+#define DELAY_OVERHEAD_CYCLES       48      // Until Delay_Calibrate has run
+#define DELAY_US_MAX                1000
+
+uint32_t delay_clock;
+uint8_t delay_loops_per_us;         // Q4.4
+uint16_t delay_loops;
+uint8_t delay_overhead_loops = DELAY_OVERHEAD_CYCLES / DELAY_LOOP_CYCLES;
+
+//-----------------------------------------------------------------------------
+// Wait a number of microseconds, up to DELAY_US_MAX
+//
+void Delay_Us(uint16_t us)
+{
+    if (delay_clock != sysclock)
+    {
+        delay_clock = sysclock;
+        delay_loops_per_us = (sysclock + (1000000 * DELAY_LOOP_CYCLES / 32)) / (1000000 * DELAY_LOOP_CYCLES / 16);
+    }
+    if (us > DELAY_US_MAX)
+    {
+        us = DELAY_US_MAX;
+    }
+    delay_loops = (us * delay_loops_per_us) >> 4;
+    if (delay_loops <= delay_overhead_loops)
+    {
+        return;
+    }
+    delay_loops -= delay_overhead_loops;
+
+#if defined __IAR_SYSTEMS_ICC__ || defined _COSMIC_ || defined _RAISONANCE_
+    // Not calibrated for these compilers
+    while (--delay_loops)
+    {
+    }
+#else // __SDCC__
+    __asm
+        ldw x, _delay_loops
+    00001$:
+        nop
+        decw x
+        jrne 00001$
+    __endasm;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Time a delay in system clock cycles using TIM2
+//
+// TIM2 must be running undivided, as set up by Delay_Calibrate. The cost of
+// reading the counter is included, and is all that's timed for 0us.
+//
+uint16_t Delay_Measure(uint16_t us) CRITICAL
+{
+    uint16_t start;
+    uint16_t end;
+
+    start = TIM2->CNTRH << 8;
+    start |= TIM2->CNTRL;
+    if (us)
+    {
+        Delay_Us(us);
+    }
+    end = TIM2->CNTRH << 8;
+    end |= TIM2->CNTRL;
+    return end - start;
+}
+
+//-----------------------------------------------------------------------------
+// Measure the fixed cost of Delay_Us
+//
+// Borrows TIM2, so call it at start up before TIM2 is used. The overhead is
+// in cycles so it doesn't need redoing when the clock changes. Returns it.
+//
+uint16_t Delay_Calibrate(void)
+{
+    static const uint16_t points[] = { 10, 100, DELAY_US_MAX };
+    uint16_t overhead = 0xFFFF;
+    uint16_t reading;
+    uint16_t cycles;
+    uint8_t i;
+
+    TIM2->CR1 = 0;
+    TIM2->PSCR = 0;
+    TIM2->ARRH = 0xFF;
+    TIM2->ARRL = 0xFF;
+    TIM2->EGR = TIM1_EGR_UG_MASK;   // Load the prescaler
+    TIM2->CR1 = TIM1_CR1_CEN_ENABLE;
+
+    // Run every pass so the passes timed are the ones in delay_loops
+    delay_overhead_loops = 0;
+    reading = Delay_Measure(0);
+    for (i = 0; i < sizeof(points) / sizeof(points[0]); ++i)
+    {
+        Delay_Us(points[i]);        // Clock sums done outside the timing
+        cycles = Delay_Measure(points[i]) - reading;
+        cycles -= delay_loops * DELAY_LOOP_CYCLES;
+        if (cycles < overhead)
+        {
+            overhead = cycles;
+        }
+    }
+
+    TIM2->CR1 = 0;
+    TIM2->SR1 = 0;
+
+    delay_overhead_loops = (overhead > 255 * DELAY_LOOP_CYCLES) ? 255 : overhead / DELAY_LOOP_CYCLES;
+    return overhead;
+}
+
 //=============================================================================
 // Interrupt Controller functions
 //
@@ -2249,21 +2839,165 @@ typedef enum
     EXTI_TYPE_RISING_FALLING = EXTI_PxIS_RISING_FALLING
 } exti_type_t;
 
+#ifdef EXTIDISPATCH
+//-----------------------------------------------------------------------------
+// External interrupt dispatch
+//
+// The ports only raise one interrupt each, so the handler works out which pins
+// caused it by comparing IDR with the value seen last time. The changed pins
+// are then filtered by the edge set with EXTI_SetIRQType and the callback for
+// each one is called with the new pin level.
+//
+// Pins are taken lowest first using a lookup of the lowest set bit in each
+// nibble and removed with x & (x - 1), so the handler only does work for the
+// pins that changed rather than looping over all eight.
+//
+// While any pin on a port has a callback the port is set to interrupt on both
+// edges, whatever type was asked for, so that the value seen last time always
+// follows IDR. The edge asked for is then picked out here. A pin that changes
+// and changes back before the handler reads IDR is still missed.
+//
+typedef void (*exti_callback_t)(uint8_t pin, bool level);
+
+typedef struct
+{
+    stm8_gpio_t *gpio;
+    exti_type_t type;
+    uint8_t enabled;                // Pins with a callback
+    uint8_t previous;               // IDR at the last interrupt
+    exti_callback_t callback[8];
+} exti_dispatch_t;
+
+static exti_dispatch_t exti_dispatch[5] =
+{
+    { GPIOA }, { GPIOB }, { GPIOC }, { GPIOD }, { GPIOE }
+};
+
+static const uint8_t exti_lowest_bit[16] =
+{
+    0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0
+};
+#endif // EXTIDISPATCH
+
 //-----------------------------------------------------------------------------
 // Get the interrupt type of an external interrupt on a port
 //
+// This is the type set with EXTI_SetIRQType, not the both edges a port with
+// callbacks is actually set to.
+//
 exti_type_t EXTI_GetIRQType(exti_port_t port)
 {
+#ifdef EXTIDISPATCH
+    if (port != EXTI_TL)
+    {
+        return exti_dispatch[port].type;
+    }
+#endif
     return (*EXTI_Px(port) & EXTI_Px_IS_MASK(port)) >> EXTI_Px_IS_SHIFT(port);
 }
 
 //-----------------------------------------------------------------------------
 // Set the interrupt type of an external interrupt on a port
 //
+// A port with callbacks is set to both edges for a rising or falling type, see
+// EXTI_Dispatch.
+//
+// Note: The sensitivity can only be changed when interrupts are disabled.
+//
 void EXTI_SetIRQType(exti_port_t port, exti_type_t type)
 {
+#ifdef EXTIDISPATCH
+    if (port != EXTI_TL)
+    {
+        exti_dispatch[port].type = type;
+        if (exti_dispatch[port].enabled && ((type == EXTI_TYPE_RISING) || (type == EXTI_TYPE_FALLING)))
+        {
+            type = EXTI_TYPE_RISING_FALLING;
+        }
+    }
+#endif
     *EXTI_Px(port) = (*EXTI_Px(port) & ~EXTI_Px_IS_MASK(port)) | (type << EXTI_Px_IS_SHIFT(port));
 }
+
+#ifdef EXTIDISPATCH
+//-----------------------------------------------------------------------------
+// Set or clear the callback for a pin on a port
+//
+// The pin is made an input with its interrupt enabled, the pull up is left as
+// it was. Passing a NULL callback disables the pin's interrupt.
+//
+void EXTI_SetCallback(exti_port_t port, uint8_t pin, exti_callback_t callback) CRITICAL
+{
+    exti_dispatch_t *dispatch = &exti_dispatch[port];
+    uint8_t mask = (uint8_t)(1 << pin);
+
+    dispatch->callback[pin] = callback;
+    if (callback)
+    {
+        dispatch->gpio->DDR &= (uint8_t)~mask;
+        dispatch->previous = (dispatch->previous & (uint8_t)~mask) | (dispatch->gpio->IDR & mask);
+        dispatch->enabled |= mask;
+        EXTI_SetIRQType(port, dispatch->type);
+        dispatch->gpio->CR2 |= mask;
+    }
+    else
+    {
+        dispatch->gpio->CR2 &= (uint8_t)~mask;
+        dispatch->enabled &= (uint8_t)~mask;
+        EXTI_SetIRQType(port, dispatch->type);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Call the callbacks for the pins of a port that have changed
+//
+static void EXTI_Dispatch(exti_dispatch_t *dispatch)
+{
+    uint8_t now = dispatch->gpio->IDR;
+    uint8_t changed = (now ^ dispatch->previous) & dispatch->enabled;
+    uint8_t pin;
+
+    dispatch->previous = now;
+    switch (dispatch->type)
+    {
+        case EXTI_TYPE_RISING:
+        {
+            changed &= now;
+            break;
+        }
+        case EXTI_TYPE_FALLING:
+        {
+            changed &= (uint8_t)~now;
+            break;
+        }
+        case EXTI_TYPE_FALLING_LOW:
+        {
+            // Level sensitive, keeps interrupting while any enabled pin is low
+            changed = (uint8_t)~now & dispatch->enabled;
+            break;
+        }
+        default:
+        {
+            break;
+        }
+    }
+
+    while (changed)
+    {
+        if (changed & 0x0F)
+        {
+            pin = exti_lowest_bit[changed & 0x0F];
+        }
+        else
+        {
+            pin = 4 + exti_lowest_bit[changed >> 4];
+        }
+        dispatch->callback[pin](pin, (now >> pin) & 0x01);
+        changed &= (uint8_t)(changed - 1);
+    }
+}
+#endif // EXTIDISPATCH
+
 /*
     IRQ_SOURCE_PORTA          = (uint8_t)3,   // Port A external interrupts
     IRQ_SOURCE_PORTB          = (uint8_t)4,   // Port B external interrupts
@@ -2273,34 +3007,359 @@ void EXTI_SetIRQType(exti_port_t port, exti_type_t type)
 */
 void EXTI_portA_ISR(void) __interrupt(IRQ_SOURCE_PORTA)
 {
-
+#ifdef EXTIDISPATCH
+    EXTI_Dispatch(&exti_dispatch[EXTI_PORT_A]);
+#endif
 }
 
 void EXTI_portB_ISR(void) __interrupt(IRQ_SOURCE_PORTB)
 {
-
+#ifdef EXTIDISPATCH
+    EXTI_Dispatch(&exti_dispatch[EXTI_PORT_B]);
+#endif
 }
 
 void EXTI_portC_ISR(void) __interrupt(IRQ_SOURCE_PORTC)
 {
-
+#ifdef EXTIDISPATCH
+    EXTI_Dispatch(&exti_dispatch[EXTI_PORT_C]);
+#endif
 }
 
 void EXTI_portD_ISR(void) __interrupt(IRQ_SOURCE_PORTD)
 {
-
+#ifdef EXTIDISPATCH
+    EXTI_Dispatch(&exti_dispatch[EXTI_PORT_D]);
+#endif
 }
 
 void EXTI_portE_ISR(void) __interrupt(IRQ_SOURCE_PORTE)
 {
-
+#ifdef EXTIDISPATCH
+    EXTI_Dispatch(&exti_dispatch[EXTI_PORT_E]);
+#endif
 }
 
+#if defined FLASHCHECK || defined NORFLASH
 //=============================================================================
-// Uart functions
+// CRC functions
+//
+// CRC-16/CCITT, polynomial 0x1021 starting from 0xFFFF, as used by the flash
+// log records and the flash check. It's table driven with the table split
+// into high and low bytes so each one is a single indexed load.
+//
+// With SDCC, runs of 16 bytes are done by an assembler loop that takes 6.4
+// cycles a byte by its instruction timings, about 6.5ms for the whole 16K of
+// program flash at 16MHz. The rest are done in C. The start up banner in
+// main reports how long the boot check actually took.
+//
+
+#define CRC16_INIT                  0xFFFF
+
+const uint8_t crc16_table_hi[256] =
+{
+    0x00, 0x10, 0x20, 0x30, 0x40, 0x50, 0x60, 0x70, 0x81, 0x91, 0xA1, 0xB1, 0xC1, 0xD1, 0xE1, 0xF1,
+    0x12, 0x02, 0x32, 0x22, 0x52, 0x42, 0x72, 0x62, 0x93, 0x83, 0xB3, 0xA3, 0xD3, 0xC3, 0xF3, 0xE3,
+    0x24, 0x34, 0x04, 0x14, 0x64, 0x74, 0x44, 0x54, 0xA5, 0xB5, 0x85, 0x95, 0xE5, 0xF5, 0xC5, 0xD5,
+    0x36, 0x26, 0x16, 0x06, 0x76, 0x66, 0x56, 0x46, 0xB7, 0xA7, 0x97, 0x87, 0xF7, 0xE7, 0xD7, 0xC7,
+    0x48, 0x58, 0x68, 0x78, 0x08, 0x18, 0x28, 0x38, 0xC9, 0xD9, 0xE9, 0xF9, 0x89, 0x99, 0xA9, 0xB9,
+    0x5A, 0x4A, 0x7A, 0x6A, 0x1A, 0x0A, 0x3A, 0x2A, 0xDB, 0xCB, 0xFB, 0xEB, 0x9B, 0x8B, 0xBB, 0xAB,
+    0x6C, 0x7C, 0x4C, 0x5C, 0x2C, 0x3C, 0x0C, 0x1C, 0xED, 0xFD, 0xCD, 0xDD, 0xAD, 0xBD, 0x8D, 0x9D,
+    0x7E, 0x6E, 0x5E, 0x4E, 0x3E, 0x2E, 0x1E, 0x0E, 0xFF, 0xEF, 0xDF, 0xCF, 0xBF, 0xAF, 0x9F, 0x8F,
+    0x91, 0x81, 0xB1, 0xA1, 0xD1, 0xC1, 0xF1, 0xE1, 0x10, 0x00, 0x30, 0x20, 0x50, 0x40, 0x70, 0x60,
+    0x83, 0x93, 0xA3, 0xB3, 0xC3, 0xD3, 0xE3, 0xF3, 0x02, 0x12, 0x22, 0x32, 0x42, 0x52, 0x62, 0x72,
+    0xB5, 0xA5, 0x95, 0x85, 0xF5, 0xE5, 0xD5, 0xC5, 0x34, 0x24, 0x14, 0x04, 0x74, 0x64, 0x54, 0x44,
+    0xA7, 0xB7, 0x87, 0x97, 0xE7, 0xF7, 0xC7, 0xD7, 0x26, 0x36, 0x06, 0x16, 0x66, 0x76, 0x46, 0x56,
+    0xD9, 0xC9, 0xF9, 0xE9, 0x99, 0x89, 0xB9, 0xA9, 0x58, 0x48, 0x78, 0x68, 0x18, 0x08, 0x38, 0x28,
+    0xCB, 0xDB, 0xEB, 0xFB, 0x8B, 0x9B, 0xAB, 0xBB, 0x4A, 0x5A, 0x6A, 0x7A, 0x0A, 0x1A, 0x2A, 0x3A,
+    0xFD, 0xED, 0xDD, 0xCD, 0xBD, 0xAD, 0x9D, 0x8D, 0x7C, 0x6C, 0x5C, 0x4C, 0x3C, 0x2C, 0x1C, 0x0C,
+    0xEF, 0xFF, 0xCF, 0xDF, 0xAF, 0xBF, 0x8F, 0x9F, 0x6E, 0x7E, 0x4E, 0x5E, 0x2E, 0x3E, 0x0E, 0x1E
+};
+
+const uint8_t crc16_table_lo[256] =
+{
+    0x00, 0x21, 0x42, 0x63, 0x84, 0xA5, 0xC6, 0xE7, 0x08, 0x29, 0x4A, 0x6B, 0x8C, 0xAD, 0xCE, 0xEF,
+    0x31, 0x10, 0x73, 0x52, 0xB5, 0x94, 0xF7, 0xD6, 0x39, 0x18, 0x7B, 0x5A, 0xBD, 0x9C, 0xFF, 0xDE,
+    0x62, 0x43, 0x20, 0x01, 0xE6, 0xC7, 0xA4, 0x85, 0x6A, 0x4B, 0x28, 0x09, 0xEE, 0xCF, 0xAC, 0x8D,
+    0x53, 0x72, 0x11, 0x30, 0xD7, 0xF6, 0x95, 0xB4, 0x5B, 0x7A, 0x19, 0x38, 0xDF, 0xFE, 0x9D, 0xBC,
+    0xC4, 0xE5, 0x86, 0xA7, 0x40, 0x61, 0x02, 0x23, 0xCC, 0xED, 0x8E, 0xAF, 0x48, 0x69, 0x0A, 0x2B,
+    0xF5, 0xD4, 0xB7, 0x96, 0x71, 0x50, 0x33, 0x12, 0xFD, 0xDC, 0xBF, 0x9E, 0x79, 0x58, 0x3B, 0x1A,
+    0xA6, 0x87, 0xE4, 0xC5, 0x22, 0x03, 0x60, 0x41, 0xAE, 0x8F, 0xEC, 0xCD, 0x2A, 0x0B, 0x68, 0x49,
+    0x97, 0xB6, 0xD5, 0xF4, 0x13, 0x32, 0x51, 0x70, 0x9F, 0xBE, 0xDD, 0xFC, 0x1B, 0x3A, 0x59, 0x78,
+    0x88, 0xA9, 0xCA, 0xEB, 0x0C, 0x2D, 0x4E, 0x6F, 0x80, 0xA1, 0xC2, 0xE3, 0x04, 0x25, 0x46, 0x67,
+    0xB9, 0x98, 0xFB, 0xDA, 0x3D, 0x1C, 0x7F, 0x5E, 0xB1, 0x90, 0xF3, 0xD2, 0x35, 0x14, 0x77, 0x56,
+    0xEA, 0xCB, 0xA8, 0x89, 0x6E, 0x4F, 0x2C, 0x0D, 0xE2, 0xC3, 0xA0, 0x81, 0x66, 0x47, 0x24, 0x05,
+    0xDB, 0xFA, 0x99, 0xB8, 0x5F, 0x7E, 0x1D, 0x3C, 0xD3, 0xF2, 0x91, 0xB0, 0x57, 0x76, 0x15, 0x34,
+    0x4C, 0x6D, 0x0E, 0x2F, 0xC8, 0xE9, 0x8A, 0xAB, 0x44, 0x65, 0x06, 0x27, 0xC0, 0xE1, 0x82, 0xA3,
+    0x7D, 0x5C, 0x3F, 0x1E, 0xF9, 0xD8, 0xBB, 0x9A, 0x75, 0x54, 0x37, 0x16, 0xF1, 0xD0, 0xB3, 0x92,
+    0x2E, 0x0F, 0x6C, 0x4D, 0xAA, 0x8B, 0xE8, 0xC9, 0x26, 0x07, 0x64, 0x45, 0xA2, 0x83, 0xE0, 0xC1,
+    0x1F, 0x3E, 0x5D, 0x7C, 0x9B, 0xBA, 0xD9, 0xF8, 0x17, 0x36, 0x55, 0x74, 0x93, 0xB2, 0xD1, 0xF0
+};
+
+// Parameters of the assembler loop, as it doesn't depend on how the compiler
+// passes them
+const uint8_t *crc_block_ptr;
+const uint8_t *crc_block_end;
+uint16_t crc_block_value;
+uint8_t crc_block_lo[2];
+
+//-----------------------------------------------------------------------------
+// Add a multiple of 16 bytes, at least 16, to the CRC
 //
-// Note: Some of the function assume that the serial ports have the certain
-// registers at the same offset. For the registers upto CR4, this is true for
+// The low byte of the CRC after each byte is the table's low byte, so it's
+// kept in alternate memory bytes and only the high byte is in A. There's no
+// register free for it, but a direct memory access is 1 cycle the same as a
+// register. The data is read at offsets from Y, which is moved on once per
+// 16 bytes, so each byte is 6 cycles and the loop overhead 6 more.
+//
+#if defined __SDCC__
+void CRC16_Block(void) __naked
+{
+    __asm
+        ldw y, _crc_block_ptr
+        clrw x
+        ld a, _crc_block_value+1
+        ld _crc_block_lo, a
+        ld a, _crc_block_value
+    00001$:
+        xor a, (y)
+        ld xl, a
+        ld a, (_crc16_table_lo, x)
+        ld _crc_block_lo+1, a
+        ld a, (_crc16_table_hi, x)
+        xor a, _crc_block_lo
+
+        xor a, (1, y)
+        ld xl, a
+        ld a, (_crc16_table_lo, x)
+        ld _crc_block_lo, a
+        ld a, (_crc16_table_hi, x)
+        xor a, _crc_block_lo+1
+
+        xor a, (2, y)
+        ld xl, a
+        ld a, (_crc16_table_lo, x)
+        ld _crc_block_lo+1, a
+        ld a, (_crc16_table_hi, x)
+        xor a, _crc_block_lo
+
+        xor a, (3, y)
+        ld xl, a
+        ld a, (_crc16_table_lo, x)
+        ld _crc_block_lo, a
+        ld a, (_crc16_table_hi, x)
+        xor a, _crc_block_lo+1
+
+        xor a, (4, y)
+        ld xl, a
+        ld a, (_crc16_table_lo, x)
+        ld _crc_block_lo+1, a
+        ld a, (_crc16_table_hi, x)
+        xor a, _crc_block_lo
+
+        xor a, (5, y)
+        ld xl, a
+        ld a, (_crc16_table_lo, x)
+        ld _crc_block_lo, a
+        ld a, (_crc16_table_hi, x)
+        xor a, _crc_block_lo+1
+
+        xor a, (6, y)
+        ld xl, a
+        ld a, (_crc16_table_lo, x)
+        ld _crc_block_lo+1, a
+        ld a, (_crc16_table_hi, x)
+        xor a, _crc_block_lo
+
+        xor a, (7, y)
+        ld xl, a
+        ld a, (_crc16_table_lo, x)
+        ld _crc_block_lo, a
+        ld a, (_crc16_table_hi, x)
+        xor a, _crc_block_lo+1
+
+        xor a, (8, y)
+        ld xl, a
+        ld a, (_crc16_table_lo, x)
+        ld _crc_block_lo+1, a
+        ld a, (_crc16_table_hi, x)
+        xor a, _crc_block_lo
+
+        xor a, (9, y)
+        ld xl, a
+        ld a, (_crc16_table_lo, x)
+        ld _crc_block_lo, a
+        ld a, (_crc16_table_hi, x)
+        xor a, _crc_block_lo+1
+
+        xor a, (10, y)
+        ld xl, a
+        ld a, (_crc16_table_lo, x)
+        ld _crc_block_lo+1, a
+        ld a, (_crc16_table_hi, x)
+        xor a, _crc_block_lo
+
+        xor a, (11, y)
+        ld xl, a
+        ld a, (_crc16_table_lo, x)
+        ld _crc_block_lo, a
+        ld a, (_crc16_table_hi, x)
+        xor a, _crc_block_lo+1
+
+        xor a, (12, y)
+        ld xl, a
+        ld a, (_crc16_table_lo, x)
+        ld _crc_block_lo+1, a
+        ld a, (_crc16_table_hi, x)
+        xor a, _crc_block_lo
+
+        xor a, (13, y)
+        ld xl, a
+        ld a, (_crc16_table_lo, x)
+        ld _crc_block_lo, a
+        ld a, (_crc16_table_hi, x)
+        xor a, _crc_block_lo+1
+
+        xor a, (14, y)
+        ld xl, a
+        ld a, (_crc16_table_lo, x)
+        ld _crc_block_lo+1, a
+        ld a, (_crc16_table_hi, x)
+        xor a, _crc_block_lo
+
+        xor a, (15, y)
+        ld xl, a
+        ld a, (_crc16_table_lo, x)
+        ld _crc_block_lo, a
+        ld a, (_crc16_table_hi, x)
+        xor a, _crc_block_lo+1
+
+        addw y, #16
+        cpw y, _crc_block_end
+        jrne 00001$
+        ld _crc_block_value, a
+        ld a, _crc_block_lo
+        ld _crc_block_value+1, a
+        ret
+    __endasm;
+}
+#endif // __SDCC__
+
+//-----------------------------------------------------------------------------
+// Add bytes to a CRC
+//
+// Start with CRC16_INIT. A message can be done in pieces by passing the result
+// back in, e.g. a frame header and its data.
+//
+uint16_t CRC16_Update(uint16_t crc, const uint8_t *data, uint16_t length)
+{
+    uint8_t index;
+
+#if defined __SDCC__
+    if (length >= 16)
+    {
+        crc_block_ptr = data;
+        crc_block_end = data + (length & ~15);
+        crc_block_value = crc;
+        CRC16_Block();
+        crc = crc_block_value;
+        data = crc_block_end;
+        length &= 15;
+    }
+#endif
+
+    while (length--)
+    {
+        index = (uint8_t)(crc >> 8) ^ *data++;
+        crc = ((uint16_t)((uint8_t)crc ^ crc16_table_hi[index]) << 8) | crc16_table_lo[index];
+    }
+    return crc;
+}
+#endif // FLASHCHECK or NORFLASH
+
+#ifdef FLASHCHECK
+//=============================================================================
+// Flash check functions
+//
+// Checks the program flash hasn't been corrupted. The last 4 bytes of it hold
+// the CRC-16 of the rest followed by its complement, big endian, put there by
+// ihx_crc.py after linking. That also fills the unused flash in the .ihx so
+// the whole of it is written and checked.
+//
+// FlashCheck_Run checks it all in one go at boot. FlashCheck_Start and
+// FlashCheck_Step check it a piece at a time, e.g. from the main loop, to
+// catch it going bad while running.
+//
+
+#define FLASH_CHECK_TRAILER         (FLASH_PROGRAM_END - 3)
+#define FLASH_CHECK_STEP            1024    // Bytes per step, about 0.4ms
+
+typedef enum
+{
+    FLASH_CHECK_BUSY,
+    FLASH_CHECK_OK,
+    FLASH_CHECK_BAD,                // CRC doesn't match
+    FLASH_CHECK_MISSING             // No CRC was added after linking
+} flash_check_t;
+
+uint16_t flash_check_address;
+uint16_t flash_check_crc;
+
+//-----------------------------------------------------------------------------
+// Start checking from the beginning
+//
+void FlashCheck_Start(void)
+{
+    flash_check_address = FLASH_PROGRAM_START;
+    flash_check_crc = CRC16_INIT;
+}
+
+//-----------------------------------------------------------------------------
+// Check the next piece of the flash
+//
+// Returns FLASH_CHECK_BUSY until it's all been done and then the result,
+// after which it starts again from the beginning.
+//
+flash_check_t FlashCheck_Step(uint16_t length)
+{
+    const uint8_t *trailer = (const uint8_t *)FLASH_CHECK_TRAILER;
+    uint16_t stored;
+
+    if (length > FLASH_CHECK_TRAILER - flash_check_address)
+    {
+        length = FLASH_CHECK_TRAILER - flash_check_address;
+    }
+    flash_check_crc = CRC16_Update(flash_check_crc, (const uint8_t *)flash_check_address, length);
+    flash_check_address += length;
+    if (flash_check_address < FLASH_CHECK_TRAILER)
+    {
+        return FLASH_CHECK_BUSY;
+    }
+
+    FlashCheck_Start();
+    stored = ((uint16_t)trailer[0] << 8) | trailer[1];
+    if ((stored ^ (((uint16_t)trailer[2] << 8) | trailer[3])) != 0xFFFF)
+    {
+        return FLASH_CHECK_MISSING;
+    }
+    return (stored == flash_check_crc) ? FLASH_CHECK_OK : FLASH_CHECK_BAD;
+}
+
+//-----------------------------------------------------------------------------
+// Check the whole flash
+//
+flash_check_t FlashCheck_Run(void)
+{
+    FlashCheck_Start();
+    return FlashCheck_Step(FLASH_CHECK_TRAILER - FLASH_PROGRAM_START);
+}
+#endif // FLASHCHECK
+
+//=============================================================================
+// Uart functions
+//
+// Note: Some of the function assume that the serial ports have the certain
+// registers at the same offset. For the registers upto CR4, this is true for
 // all four uarts.
 //
 
@@ -2522,12 +3581,16 @@ void Uart2_BlockingSendByte(uint8_t byte)
 //-----------------------------------------------------------------------------
 // Send a byte, without using circular buffer, but blocking till it can be sent
 //
-void Uart2_DirectSendByte(uint8_t byte)
+// Returns false if the transmitter never became ready.
+//
+bool Uart2_DirectSendByte(uint8_t byte)
 {
-    while ((UART2->SR & UARTx_SR_TXE_MASK) == UARTx_SR_TXE_NOTREADY)
+    if (Wait_Flag(&UART2->SR, UARTx_SR_TXE_MASK, UARTx_SR_TXE_READY, WAIT_BUDGET_UART, WAIT_SOURCE_UART) != WAIT_OK)
     {
+        return false;
     }
     UART2->DR = byte;
+    return true;
 }
 
 //-----------------------------------------------------------------------------
@@ -3151,8 +4214,8 @@ inline void Tim1_SetPrescaler(uint16_t division)
 //
 inline void Tim1_SetCounter(uint16_t counter)
 {
-    TIM1->CCR3H = (counter >> 8) & 0xFF;
-    TIM1->CCR3L = (counter >> 0) & 0xFF;
+    TIM1->CNTRH = (counter >> 8) & 0xFF;
+    TIM1->CNTRL = (counter >> 0) & 0xFF;
 }
 
 //-----------------------------------------------------------------------------
@@ -3182,11 +4245,9 @@ inline void Tim1_SetCapturePrescaler(tim1_ic_prescaler_t prescaler)
 //-----------------------------------------------------------------------------
 // Wait for the capture flag on channel 1
 //
-inline void Tim1_WaitCapture1(void)
+inline bool Tim1_WaitCapture1(void)
 {
-    while ((TIM1->SR1 & ~TIM1_SR1_CC1IF_MATCH) != TIM1_SR1_CC1IF_CAPTURE)
-    {
-    }
+    return Wait_Flag(&TIM1->SR1, TIM1_SR1_CC1IF_MASK, TIM1_SR1_CC1IF_CAPTURE, WAIT_BUDGET_CAPTURE, WAIT_SOURCE_CAPTURE) == WAIT_OK;
 }
 
 //-----------------------------------------------------------------------------
@@ -3265,1259 +4326,5999 @@ inline void Tim1_ConfigCapture1(tim1_ic_polarity_t polarity, tim1_ic_filter_t fi
 }
 
 //-----------------------------------------------------------------------------
-// Configure the TIM1 timer
+// Channel helpers shared by TIM1, TIM2 and TIM3
+//
+// The capture/compare registers of the three timers are laid out the same
+// way, so they're indexed from the channel 1 register:
+//  CCMRx is ccmr1[ch]
+//  CCRx  is ccr1h[ch * 2] (high) and ccr1h[ch * 2 + 1] (low)
+//  CCxE, CCxP, CCxNE and CCxNP are a nibble in ccer1[ch / 2]
 //
-void Tim1_Config(void)
-{
-    // Disable to setup
-    Tim1_Disable();
-
-    // Set the auto-reload value
-    Tim1_SetAutoReload(TIM1_PERIOD);
 
-    // Set the prescaler to division by 1
-    Tim1_SetPrescaler(1);
+//-----------------------------------------------------------------------------
+// Set a capture/compare channel's mode and enables
+//
+// ccer is the nibble for the channel, using the channel 1 bit values. The
+// channel is disabled while CCMR is changed.
+//
+static void Tim_ConfigChannel(__IO uint8_t *ccmr1, __IO uint8_t *ccer1, uint8_t channel, uint8_t ccmr, uint8_t ccer)
+{
+    __IO uint8_t *ccerx = ccer1 + (channel >> 1);
+    uint8_t shift = (channel & 1) << 2;
 
-    // Set the counter mode to up
-    TIM1->CR1 = (TIM1->CR1 & ~(TIM1_CR1_CMS_MASK | TIM1_CR1_DIR_MASK)) |
-                TIM1_CR1_CMS_EDGE | TIM1_CR1_DIR_UP;
+    *ccerx &= ~(0x0F << shift);
+    ccmr1[channel] = ccmr;
+    *ccerx |= (ccer & 0x0F) << shift;
+}
 
-    // Set the repetition counter to zero
-    TIM1->RCR = 0;
+//-----------------------------------------------------------------------------
+// Write a capture/compare register
+//
+// Note that High register must be set first.
+//
+inline void Tim_SetCCR(__IO uint8_t *ccr1h, uint8_t channel, uint16_t value)
+{
+    ccr1h += channel << 1;
+    ccr1h[0] = (value >> 8) & 0xFF;
+    ccr1h[1] = (value >> 0) & 0xFF;
+}
 
-    TIM1->CCER2 = (TIM1->CCER2 & ~(TIM1_CCER2_CC3E_MASK | TIM1_CCER2_CC3NE_MASK | TIM1_CCER2_CC3P_MASK | TIM1_CCER2_CC3NP_MASK)) |
-                    (TIM1_CCER2_CC3E_ENABLE) |
-                    (TIM1_CCER2_CC3P_HIGH) |
-                    (TIM1_CCER2_CC3NE_ENABLE) |
-                    (TIM1_CCER2_CC3NP_ENABLE);
-    TIM1->CCMR3 = (TIM1->CCMR3 & ~(TIM1_CCMR_OCxM_MASK | TIM1_CCMR_OCxPE_MASK)) | TIM1_CCMR_OCxM_PWM2 | TIM1_CCMR_OCxPE_ENABLE;
-    TIM1->OISR &= ~(TIM1_OISR_OIS3_MASK | TIM1_OISR_OIS3N_MASK);
-    TIM1->OISR |= (TIM1_OISR_OIS3_ENABLE) | (TIM1_OISR_OIS3N_ENABLE);
-    TIM1->CCR3H = (TIM1_CH3_DUTY >> 8) & 0xFF;
-    TIM1->CCR3L = (TIM1_CH3_DUTY >> 0) & 0xFF;
-    TIM1->BKR |= TIM1_BKR_MOE_ENABLE;
+//-----------------------------------------------------------------------------
+// Read a capture/compare register
+//
+// Note that High register must be read first, it latches the low register.
+//
+inline uint16_t Tim_GetCCR(__IO uint8_t *ccr1h, uint8_t channel)
+{
+    uint16_t value;
 
-    Tim1_Enable();
+    ccr1h += channel << 1;
+    value = ccr1h[0] << 8;
+    return value | ccr1h[1];
 }
 
 //-----------------------------------------------------------------------------
-// Configure the TIM1 timer for PWM use
+// TIM1 PWM
 //
-void Tim1_ConfigPWM(void)
+// All four channels can be used for PWM, channels 1 to 3 also have
+// complementary outputs for driving half-bridges. The CCR and ARR registers
+// are preloaded so new values only take effect at the next update event and
+// a duty change never produces a runt pulse. Several duties can be changed
+// together by holding off the update while they're written.
+//
+// OISx and OISxN are 2 bits per channel in OISR.
+//
+
+typedef enum
 {
-    // Disable to setup
-    Tim1_Disable();
+    TIM1_CHANNEL_1 = 0,
+    TIM1_CHANNEL_2 = 1,
+    TIM1_CHANNEL_3 = 2,
+    TIM1_CHANNEL_4 = 3
+} tim1_channel_t;
 
-    // Set the auto-reload value
-    Tim1_SetAutoReload(TIM1_PERIOD);
+typedef enum
+{
+    TIM1_PWM_MODE1 = TIM1_CCMR_OCxM_PWM1,   // Active while counter < CCR
+    TIM1_PWM_MODE2 = TIM1_CCMR_OCxM_PWM2    // Inactive while counter < CCR
+} tim1_pwm_mode_t;
 
-    // Set the prescaler to division by 1
-    Tim1_SetPrescaler(1);
+// Output flags, these match the CCER nibble for a channel
+#define TIM1_PWM_OUT_ENABLE         ((uint8_t)0x01)     // OCx driven
+#define TIM1_PWM_OUT_ACTIVE_LOW     ((uint8_t)0x02)
+#define TIM1_PWM_OUTN_ENABLE        ((uint8_t)0x04)     // OCxN driven (not channel 4)
+#define TIM1_PWM_OUTN_ACTIVE_LOW    ((uint8_t)0x08)
 
-    // Set the counter mode to up
-    TIM1->CR1 = (TIM1->CR1 & ~(TIM1_CR1_CMS_MASK | TIM1_CR1_DIR_MASK)) |
-                TIM1_CR1_CMS_EDGE | TIM1_CR1_DIR_UP;
+// Idle flags, the levels outputs are forced to when the main output is off
+#define TIM1_PWM_IDLE_HIGH          ((uint8_t)0x01)
+#define TIM1_PWM_IDLEN_HIGH         ((uint8_t)0x02)
 
-    // Set the repetition counter to zero
-    TIM1->RCR = 0;
+typedef enum
+{
+    TIM1_BREAK_DISABLE = TIM1_BKR_BKE_DISABLE,
+    TIM1_BREAK_LOW = TIM1_BKR_BKE_ENABLE | TIM1_BKR_BKP_LOW,
+    TIM1_BREAK_HIGH = TIM1_BKR_BKE_ENABLE | TIM1_BKR_BKP_HIGH
+} tim1_break_t;
 
-    TIM1->CCER2 = (TIM1->CCER2 & ~(TIM1_CCER2_CC3E_MASK | TIM1_CCER2_CC3NE_MASK | TIM1_CCER2_CC3P_MASK | TIM1_CCER2_CC3NP_MASK)) |
-                    (TIM1_CCER2_CC3E_ENABLE) |
-                    (TIM1_CCER2_CC3P_HIGH) |
-                    (TIM1_CCER2_CC3NE_ENABLE) |
-                    (TIM1_CCER2_CC3NP_ENABLE);
-    TIM1->CCMR3 = (TIM1->CCMR3 & ~(TIM1_CCMR_OCxM_MASK | TIM1_CCMR_OCxPE_MASK)) | TIM1_CCMR_OCxM_PWM2 | TIM1_CCMR_OCxPE_ENABLE;
-    TIM1->OISR &= ~(TIM1_OISR_OIS3_MASK | TIM1_OISR_OIS3N_MASK);
-    TIM1->OISR |= (TIM1_OISR_OIS3_ENABLE) | (TIM1_OISR_OIS3N_ENABLE);
-    TIM1->CCR3H = (TIM1_CH3_DUTY >> 8) & 0xFF;
-    TIM1->CCR3L = (TIM1_CH3_DUTY >> 0) & 0xFF;
-    TIM1->BKR |= TIM1_BKR_MOE_ENABLE;
+//-----------------------------------------------------------------------------
+// Set up the time base for PWM
+//
+// The PWM frequency is fMASTER / (prescaler * period). All outputs are off
+// until Tim1_EnableOutputs is called.
+//
+void Tim1_InitPWM(uint16_t prescaler, uint16_t period)
+{
+    Tim1_Disable();
+    TIM1->BKR = (TIM1->BKR & ~TIM1_BKR_MOE_MASK) | TIM1_BKR_MOE_DISABLE;
 
-    Tim1_Enable();
+    Tim1_SetAutoReload(period);
+    Tim1_SetPrescaler(prescaler);
+
+    // Edge aligned, counting up, with the auto-reload preloaded
+    TIM1->CR1 = (TIM1->CR1 & ~(TIM1_CR1_ARPE_MASK | TIM1_CR1_CMS_MASK | TIM1_CR1_DIR_MASK | TIM1_CR1_UDIS_MASK)) |
+                TIM1_CR1_ARPE_ENABLE | TIM1_CR1_CMS_EDGE | TIM1_CR1_DIR_UP | TIM1_CR1_UDIS_DISABLE;
+    TIM1->RCR = 0;
+
+    // Load the prescaler and auto-reload now rather than at the first overflow
+    TIM1->EGR = TIM1_EGR_UG_ENABLE;
 }
 
 //-----------------------------------------------------------------------------
-// Disable the TIM4 timer
+// Set the duty for a channel
 //
-inline void Tim4_Disable(void)
+// The value is the CCR count, 0 is always inactive and the period is always
+// active (for PWM mode 1). It takes effect at the next update event.
+//
+inline void Tim1_SetDuty(tim1_channel_t channel, uint16_t duty)
 {
-    TIM4->CR1 = (TIM4->CR1 & ~TIM4_CR1_CEN_MASK) | TIM4_CR1_CEN_DISABLE;
+    Tim_SetCCR(&TIM1->CCR1H, channel, duty);
 }
 
 //-----------------------------------------------------------------------------
-// Enable the TIM4 timer
+// Configure a channel for PWM
 //
-inline void Tim4_Enable(void)
+// outputs is a combination of the TIM1_PWM_OUT flags and idle the
+// TIM1_PWM_IDLE flags.
+//
+void Tim1_ConfigPWMChannel(tim1_channel_t channel, tim1_pwm_mode_t mode, uint8_t outputs, uint8_t idle, uint16_t duty)
 {
-    TIM4->CR1 = (TIM4->CR1 & ~TIM4_CR1_CEN_MASK) | TIM4_CR1_CEN_ENABLE;
+    uint8_t oisr_shift = channel << 1;
+
+    TIM1->OISR = (TIM1->OISR & ~(0x03 << oisr_shift)) | ((idle & 0x03) << oisr_shift);
+    Tim1_SetDuty(channel, duty);
+
+    if (channel == TIM1_CHANNEL_4)
+    {
+        outputs &= (TIM1_PWM_OUT_ENABLE | TIM1_PWM_OUT_ACTIVE_LOW);
+    }
+    Tim_ConfigChannel(&TIM1->CCMR1, &TIM1->CCER1, channel,
+                      TIM1_CCMR_CCxS_OUTPUT | mode | TIM1_CCMR_OCxPE_ENABLE, outputs);
 }
 
 //-----------------------------------------------------------------------------
-// Configure the TIM4 timer
+// Hold off the update event so several duties change together
 //
-void Tim4_Config(uint8_t prescaler, uint8_t reload)
+inline void Tim1_HoldUpdate(void)
 {
-    Tim4_Disable();
-    TIM4->PSCR = prescaler;
-    TIM4->ARR = reload;
-    TIM4->SR1 = (TIM4->SR1 & ~TIM4_SR1_UIF_MASK) | TIM4_SR1_UIF_CLEAR;
-    TIM4->IER = (TIM4->IER & ~TIM4_IER_UIE_MASK) | TIM4_IER_UIE_ENABLE;
-    TIM4->CNTR = 0;
-    TIM4->CR1 = (TIM4->CR1 & ~TIM4_CR1_ARPE_MASK) | TIM4_CR1_ARPE_ENABLE;
-    Tim4_Enable();
+    TIM1->CR1 = (TIM1->CR1 & ~TIM1_CR1_UDIS_MASK) | TIM1_CR1_UDIS_ENABLE;
 }
 
 //-----------------------------------------------------------------------------
-// Configure the TIM4 timer for 1ms interrupts
+// Let the duties written since Tim1_HoldUpdate take effect
 //
-// Setup 8-bit basic timer as 1ms system tick using interrupts to update the tick counter
+inline void Tim1_ReleaseUpdate(void)
+{
+    TIM1->CR1 = (TIM1->CR1 & ~TIM1_CR1_UDIS_MASK) | TIM1_CR1_UDIS_DISABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Convert a dead time in fMASTER ticks to a DTR value
 //
-// With 16Mhz HSI prescaler is 128 and reload value is 124. freq = 16000000/128 is 125Khz, therefore reload value is 125 - 1 or 124. Period is 125/125000 which is 0.001s or 1ms
-// With 8Mhz HSE prescaler is 64 and reload value is 124. freq is 8000000/64 is 125Khz.
-// With 128Khz LSI prescaler is 16 and reload value is 128. freq is 128000/16 is 8Khz.
+// DTR has four ranges with coarser steps, the result is rounded up so the
+// dead time is never shorter than asked for. The longest is 1008 ticks.
 //
-void Tim4_Config1ms(void)
+uint8_t Tim1_DeadTimeFromTicks(uint16_t ticks)
 {
-    if (SysClock_GetClockFreq() == 16000000)
+    if (ticks <= 127)
     {
-        Tim4_Config(TIM4_PSCR_DIV128, 124);
+        return (uint8_t)ticks;
     }
-    else if (SysClock_GetClockFreq() == 8000000)
+    if (ticks <= 254)
     {
-        Tim4_Config(TIM4_PSCR_DIV64, 124);
+        return 0x80 | (((ticks + 1) >> 1) - 64);
     }
-    else if (SysClock_GetClockFreq() == 128000)
+    if (ticks <= 504)
     {
-        Tim4_Config(TIM4_PSCR_DIV1, 128);
+        return 0xC0 | (((ticks + 7) >> 3) - 32);
+    }
+    if (ticks <= 1008)
+    {
+        return 0xE0 | (((ticks + 15) >> 4) - 32);
     }
+    return 0xFF;
 }
 
-//=============================================================================
-// Beeper functions
+//-----------------------------------------------------------------------------
+// Set the dead time inserted between an output and its complement
 //
-
-typedef enum
+// Use Tim1_DeadTimeFromTicks to get the value.
+//
+inline void Tim1_SetDeadTime(uint8_t dtr)
 {
-    BEEP_8KHZ  = 0,      // 128Khz/(8*prescale) -> 500Hz to 8Khz
-    BEEP_16KHZ = 1,      // 128Khz/(4*prescale) -> 1Khz to 16Khz
-    BEEP_32KHZ = 2       // 128Khz/(2*prescale) -> 2Khz to 32Khz
-} beep_freq_t;
+    TIM1->DTR = dtr & TIM1_DTR_DTG_MASK;
+}
 
-typedef enum
+//-----------------------------------------------------------------------------
+// Configure the break input (BKIN)
+//
+// A break clears MOE in hardware and the outputs go to their idle levels. If
+// auto_restart is set they are enabled again at the next update event after
+// the break input goes inactive, otherwise Tim1_EnableOutputs must be called.
+//
+void Tim1_ConfigBreak(tim1_break_t brk, bool auto_restart)
 {
-    BEEP_PRESCALE_2    = 0x00,
-    BEEP_PRESCALE_3    = 0x01,
-    BEEP_PRESCALE_4    = 0x02,
-    BEEP_PRESCALE_5    = 0x03,
-    BEEP_PRESCALE_6    = 0x04,
-    BEEP_PRESCALE_7    = 0x05,
-    BEEP_PRESCALE_8    = 0x06,
-    BEEP_PRESCALE_9    = 0x07,
-    BEEP_PRESCALE_10   = 0x08,
-    BEEP_PRESCALE_11   = 0x09,
-    BEEP_PRESCALE_12   = 0x0A,
-    BEEP_PRESCALE_13   = 0x0B,
-    BEEP_PRESCALE_14   = 0x0C,
-    BEEP_PRESCALE_15   = 0x0D,
-    BEEP_PRESCALE_16   = 0x0E,
-    BEEP_PRESCALE_17   = 0x0F,
-    BEEP_PRESCALE_18   = 0x10,
-    BEEP_PRESCALE_19   = 0x11,
-    BEEP_PRESCALE_20   = 0x12,
-    BEEP_PRESCALE_21   = 0x13,
-    BEEP_PRESCALE_22   = 0x14,
-    BEEP_PRESCALE_23   = 0x15,
-    BEEP_PRESCALE_24   = 0x16,
-    BEEP_PRESCALE_25   = 0x17,
-    BEEP_PRESCALE_26   = 0x18,
-    BEEP_PRESCALE_27   = 0x19,
-    BEEP_PRESCALE_28   = 0x1A,
-    BEEP_PRESCALE_29   = 0x1B,
-    BEEP_PRESCALE_30   = 0x1C,
-    BEEP_PRESCALE_31   = 0x1D,
-    BEEP_PRESCALE_32   = 0x1E
-} beep_prescaler_t;
+    TIM1->BKR = (TIM1->BKR & ~(TIM1_BKR_BKE_MASK | TIM1_BKR_BKP_MASK | TIM1_BKR_AOE_MASK | TIM1_BKR_OSSR_MASK | TIM1_BKR_OSSI_MASK)) |
+                brk |
+                (auto_restart ? TIM1_BKR_AOE_ENABLE : TIM1_BKR_AOE_DISABLE) |
+                TIM1_BKR_OSSR_ENABLE | TIM1_BKR_OSSI_ENABLE;
+    TIM1->SR1 = (uint8_t)~TIM1_SR1_BIF_MASK;
+}
 
 //-----------------------------------------------------------------------------
-// Turn on beeper
+// Check if a break has occurred, clearing the flag
 //
-inline void Beep_On(void)
+bool Tim1_CheckBreak(void)
 {
-    BEEP->CSR = (BEEP->CSR & ~BEEP_CSR_EN_MASK) | BEEP_CSR_EN_ENABLE;
+    if ((TIM1->SR1 & TIM1_SR1_BIF_MASK) == TIM1_SR1_BIF_DETECTED)
+    {
+        TIM1->SR1 = (uint8_t)~TIM1_SR1_BIF_MASK;
+        return true;
+    }
+    return false;
 }
 
 //-----------------------------------------------------------------------------
-// Turn off beeper
+// Enable the outputs (MOE) and start the counter
 //
-inline void Beep_Off(void)
+inline void Tim1_EnableOutputs(void)
 {
-    BEEP->CSR = (BEEP->CSR & ~BEEP_CSR_EN_MASK) | BEEP_CSR_EN_DISABLE;
+    TIM1->BKR = (TIM1->BKR & ~TIM1_BKR_MOE_MASK) | TIM1_BKR_MOE_ENABLE;
+    Tim1_Enable();
 }
 
 //-----------------------------------------------------------------------------
-// Toggle state of beeper
+// Force all the outputs to their idle levels
 //
-inline void Beep_Toggle(void)
+inline void Tim1_DisableOutputs(void)
 {
-    BEEP->CSR = (BEEP->CSR & ~BEEP_CSR_EN_MASK) | (~BEEP->CSR & BEEP_CSR_EN_MASK);
+    TIM1->BKR = (TIM1->BKR & ~TIM1_BKR_MOE_MASK) | TIM1_BKR_MOE_DISABLE;
 }
 
 //-----------------------------------------------------------------------------
-// Set prescaler for beep
+// Call a function on every TIM1 update event, NULL to stop
 //
-inline void Beep_SetPrescaler(beep_prescaler_t prescaler)
+// With the repetition counter the update event, and so the callback, only
+// happens every RCR + 1 periods.
+//
+
+void (*tim1_update_cb)(void);
+
+void Tim1_SetUpdateInterrupt(void (*cb)(void))
 {
-    BEEP->CSR = (BEEP->CSR & ~BEEP_CSR_DIV_MASK) | prescaler;
+    TIM1->IER = (TIM1->IER & ~TIM1_IER_UIE_MASK) | TIM1_IER_UIE_DISABLE;
+    tim1_update_cb = cb;
+    if (cb)
+    {
+        TIM1->SR1 = (uint8_t)~TIM1_SR1_UIF_MASK;
+        TIM1->IER = (TIM1->IER & ~TIM1_IER_UIE_MASK) | TIM1_IER_UIE_ENABLE;
+    }
 }
 
 //-----------------------------------------------------------------------------
-// Set frequency of beep
+// Interrupt handler for the TIM1 update event
 //
-void Beep_SetFrequency(beep_freq_t freq)
+#if defined __IAR_SYSTEMS_ICC__
+#pragma vector=11
+#endif
+INTERRUPT(TIM1_UPD_OVF_IRQHandler, 11)
 {
-    switch (freq)
+    TIM1->SR1 = (uint8_t)~TIM1_SR1_UIF_MASK;
+    if (tim1_update_cb)
     {
-        case BEEP_8KHZ:
-        {
-            BEEP->CSR = (BEEP->CSR & ~BEEP_CSR_SEL_MASK) | BEEP_CSR_SEL_8KHZ;
-            break;
-        }
-        case BEEP_16KHZ:
-        {
-            BEEP->CSR = (BEEP->CSR & ~BEEP_CSR_SEL_MASK) | BEEP_CSR_SEL_16KHZ;
-            break;
-        }
-        case BEEP_32KHZ:
-        {
-            BEEP->CSR = (BEEP->CSR & ~BEEP_CSR_SEL_MASK) | BEEP_CSR_SEL_32KHZ;
-            break;
-        }
+        tim1_update_cb();
     }
 }
 
 //-----------------------------------------------------------------------------
-// Set prescaler divider based on LSI frequency
+// Configure the TIM1 timer for PWM use
 //
-// Note on the calculation:
-//   lsi_freq is the frequency of the LSI RC clock as measured by a timer
+// 50Khz on channel 3 with its complementary output active low.
 //
-// A is the integer part of LSIFreqkHz/4 and x the decimal part.
-// x <= A/(1+2A) is equivalent to A >= x(1+2A) and also to 4A >= 4x(1+2A) [F1]
-// but we know that A + x = LSIFreqkHz/4 ==> 4x = LSIFreqkHz-4A
-// so [F1] can be written :
-// 4A >= (LSIFreqkHz-4A)(1+2A)
+void Tim1_ConfigPWM(void)
+{
+    Tim1_InitPWM(1, TIM1_PERIOD);
+    Tim1_ConfigPWMChannel(TIM1_CHANNEL_3, TIM1_PWM_MODE2,
+                          TIM1_PWM_OUT_ENABLE | TIM1_PWM_OUTN_ENABLE | TIM1_PWM_OUTN_ACTIVE_LOW,
+                          TIM1_PWM_IDLE_HIGH | TIM1_PWM_IDLEN_HIGH, TIM1_CH3_DUTY);
+    Tim1_EnableOutputs();
+}
+
+#ifdef ONEPULSE
+//-----------------------------------------------------------------------------
+// TIM1 one pulse mode
 //
-void Beep_Calibrate(uint32_t lsi_freq)
+// Generates a single pulse of an exact number of counter ticks on a channel
+// each time it's triggered. The output goes active delay ticks after the
+// trigger and inactive width ticks later, then the counter stops itself. The
+// delay must be at least 1 so the output starts inactive.
+//
+void Tim1_InitOnePulse(tim1_channel_t channel, uint16_t prescaler, uint16_t delay, uint16_t width, uint8_t outputs)
 {
-    uint16_t khz;
-    uint16_t div8;
-    uint8_t div;
+    Tim1_InitPWM(prescaler, delay + width);
+    TIM1->CR1 = (TIM1->CR1 & ~(TIM1_CR1_OPM_MASK | TIM1_CR1_URS_MASK)) | TIM1_CR1_OPM_ENABLE | TIM1_CR1_URS_UPDATE;
+    Tim1_ConfigPWMChannel(channel, TIM1_PWM_MODE2, outputs, 0, delay);
 
-    khz = (uint16_t)(lsi_freq / 1000);
+    // Load the preloaded CCR now, URS stops this setting the update flag
+    TIM1->EGR = TIM1_EGR_UG_ENABLE;
+    TIM1->BKR = (TIM1->BKR & ~TIM1_BKR_MOE_MASK) | TIM1_BKR_MOE_ENABLE;
+}
 
-    // Calculation of BEEPER calibration value
-    div8 = khz / 8;
-    if ((8U * div8) >= ((khz - (8U * div8)) * (1U + (2U * div8))))
-    {
-        div = (uint8_t)(div8 - 2U);
-    }
-    else
-    {
-        div = (uint8_t)(div8 - 1U);
-    }
-    BEEP->CSR = (BEEP->CSR & BEEP_CSR_DIV_MASK) | div;
+//-----------------------------------------------------------------------------
+// Trigger the pulse
+//
+inline void Tim1_Pulse(void)
+{
+    Tim1_Enable();
 }
 
-//=============================================================================
-// Auto wakeup functions
+//-----------------------------------------------------------------------------
+// Check if the pulse is still being generated
+//
+inline bool Tim1_PulseBusy(void)
+{
+    return (TIM1->CR1 & TIM1_CR1_CEN_MASK) == TIM1_CR1_CEN_ENABLE;
+}
+#endif // ONEPULSE
+
+#ifdef CAPTURE
+//-----------------------------------------------------------------------------
+// TIM1 PWM input
+//
+// Measures the period and high time of a signal on TI1 (channel 1 pin)
+// entirely in hardware. TI1 goes to both IC1 and IC2, IC1 captures the
+// rising edge and IC2 the falling edge, and the rising edge also resets the
+// counter through the slave mode controller. So CCR1 holds the period and
+// CCR2 the high time, updated every cycle with no interrupts.
+//
+// URS is set so only a real counter overflow sets the update flag, which
+// means the signal is slower than the 16-bit range or has stopped.
 //
 
-// High nibble is APR value, low nibble is TBR value
 typedef enum
 {
-    AWU_PERIOD_250us    = 0x0000,
-    AWU_PERIOD_500us    = 0x1E01,
-    AWU_PERIOD_1ms      = 0x1E02,
-    AWU_PERIOD_2ms      = 0x1E03,
-    AWU_PERIOD_4ms      = 0x1E04,
-    AWU_PERIOD_8ms      = 0x1E05,
-    AWU_PERIOD_16ms     = 0x1E06,
-    AWU_PERIOD_32ms     = 0x1E07,
-    AWU_PERIOD_64ms     = 0x1E08,
-    AWU_PERIOD_128ms    = 0x1E09,
-    AWU_PERIOD_256ms    = 0x1E0A,
-    AWU_PERIOD_512ms    = 0x1E0B,
-    AWU_PERIOD_1s       = 0x3D0C,
-    AWU_PERIOD_2s       = 0x170C,
-    AWU_PERIOD_12s      = 0x170F,
-    AWU_PERIOD_30s      = 0x3E0F
-} awu_period_t;
+    TIM1_PWMIN_OK,
+    TIM1_PWMIN_NO_CAPTURE,      // No new period since the last read
+    TIM1_PWMIN_OVERFLOW         // Counter overflowed, signal too slow or stopped
+} tim1_pwmin_status_t;
 
 //-----------------------------------------------------------------------------
-// Set the period for auto wakeup
+// Start measuring
 //
-void Awu_SetPeriod(uint8_t tbr, uint8_t apr)
+// The counter runs at fMASTER / prescaler.
+//
+void Tim1_InitPWMInput(uint16_t prescaler, tim1_ic_filter_t filter)
 {
-    AWU->CSR = (AWU->CSR & ~AWU_CSR_AWEN_MASK) | AWU_CSR_AWEN_ENABLE;
-    AWU->TBR = (AWU->TBR & ~AWU_TBR_MASK) | tbr;
-    AWU->APR = (AWU->APR & ~AWU_APR_DIV_MASK) | apr;
+    Tim1_Disable();
+    TIM1->IER = 0;
+    TIM1->CCER1 = 0;
+    TIM1->CCER2 = 0;
+
+    Tim1_SetPrescaler(prescaler);
+    Tim1_SetAutoReload(0);          // Full 65536 count
+    TIM1->CR1 = (TIM1->CR1 & ~(TIM1_CR1_CMS_MASK | TIM1_CR1_DIR_MASK | TIM1_CR1_URS_MASK | TIM1_CR1_UDIS_MASK)) |
+                TIM1_CR1_CMS_EDGE | TIM1_CR1_DIR_UP | TIM1_CR1_URS_UPDATE | TIM1_CR1_UDIS_DISABLE;
+
+    // IC1 on TI1 rising, IC2 on TI1 falling
+    Tim_ConfigChannel(&TIM1->CCMR1, &TIM1->CCER1, TIM1_CHANNEL_1,
+                      TIM1_CCMR_CCxS_IN_TI1FP1 | filter | TIM1_CCMR_ICxPSC_DIV1,
+                      TIM1_CCER1_CC1E_ENABLE | TIM1_CCER1_CC1P_RISING);
+    Tim_ConfigChannel(&TIM1->CCMR1, &TIM1->CCER1, TIM1_CHANNEL_2,
+                      TIM1_CCMR_CCxS_IN_TI1FP2 | TIM1_CCMR_ICxPSC_DIV1,
+                      TIM1_CCER1_CC1E_ENABLE | TIM1_CCER1_CC1P_FALLING);
+
+    // Reset the counter on the TI1 rising edge
+    TIM1->SMCR = (TIM1->SMCR & ~(TIM1_SMCR_TS_MASK | TIM1_SMCR_SMS_MASK)) | TIM1_SMCR_TS_TI1FP1 | TIM1_SMCR_SMS_RESET;
+
+    TIM1->EGR = TIM1_EGR_UG_ENABLE;
+    TIM1->SR1 = 0;
+    TIM1->SR2 = 0;
+    Tim1_Enable();
 }
 
 //-----------------------------------------------------------------------------
-// Set the period for auto wakeup
+// Read the last period and high time in counter ticks
 //
-// Sample period have been predefined in the awu_period_t enum
+// Periods missed between reads are simply overwritten by the hardware.
 //
-void Awu_SetPresetPeriod(awu_period_t period)
+tim1_pwmin_status_t Tim1_ReadPWMInput(uint16_t *period, uint16_t *high)
 {
-    Awu_SetPeriod((period >> 0) & 0xFF, (period >> 8) & 0xFF);
+    if ((TIM1->SR1 & TIM1_SR1_UIF_MASK) == TIM1_SR1_UIF_PENDING)
+    {
+        TIM1->SR1 = (uint8_t)~(TIM1_SR1_UIF_MASK | TIM1_SR1_CC1IF_MASK | TIM1_SR1_CC2IF_MASK);
+        return TIM1_PWMIN_OVERFLOW;
+    }
+    if ((TIM1->SR1 & TIM1_SR1_CC1IF_MASK) == TIM1_SR1_CC1IF_NONE)
+    {
+        return TIM1_PWMIN_NO_CAPTURE;
+    }
+
+    // Reading CCR1 clears CC1IF, CCR2 is the high time of the period just ended
+    *period = Tim_GetCCR(&TIM1->CCR1H, TIM1_CHANNEL_1);
+    *high = Tim_GetCCR(&TIM1->CCR1H, TIM1_CHANNEL_2);
+    TIM1->SR2 = (uint8_t)~(TIM1_SR2_CC1OF_MASK | TIM1_SR2_CC2OF_MASK);
+    return TIM1_PWMIN_OK;
 }
 
 //-----------------------------------------------------------------------------
-// Set the idle mode
+// Stop measuring
 //
-void Awu_SetIdleMode(void)
+void Tim1_StopPWMInput(void)
 {
-    AWU->CSR = (AWU->CSR & ~AWU_CSR_AWEN_MASK) | AWU_CSR_AWEN_DISABLE;
-    AWU->TBR = (AWU->TBR & ~AWU_TBR_MASK) | AWU_TBR_NONE;
+    Tim1_Disable();
+    TIM1->SMCR = (TIM1->SMCR & ~(TIM1_SMCR_TS_MASK | TIM1_SMCR_SMS_MASK)) | TIM1_SMCR_SMS_DISABLE;
+    TIM1->CCER1 = 0;
 }
+#endif // CAPTURE
 
+#ifdef TIMGP
 //-----------------------------------------------------------------------------
-// Disable the auto wakeup functionality
+// TIM2 and TIM3
 //
-void Awu_Disable(void)
+// The general purpose timers only differ in the number of channels, which
+// shifts the registers after CCMR, so one set of functions drives both
+// through a table of register addresses. Channels use the TIM1 channel
+// numbering and the TIM1 mode, polarity and filter values.
+//
+// The prescaler is a power of two, the frequency is
+// fMASTER / (2^prescaler * period).
+//
+
+typedef enum
 {
-    AWU->CSR = (AWU->CSR & ~AWU_CSR_AWEN_MASK) | AWU_CSR_AWEN_DISABLE;
-}
+    TIM_GP_2 = 0,
+    TIM_GP_3 = 1
+} tim_gp_t;
+
+typedef struct
+{
+    __IO uint8_t *cr1;
+    __IO uint8_t *ier;
+    __IO uint8_t *sr1;
+    __IO uint8_t *sr2;
+    __IO uint8_t *egr;
+    __IO uint8_t *ccmr1;
+    __IO uint8_t *ccer1;
+    __IO uint8_t *cntrh;
+    __IO uint8_t *pscr;
+    __IO uint8_t *arrh;
+    __IO uint8_t *ccr1h;
+    uint8_t channels;
+} tim_gp_regs_t;
+
+const tim_gp_regs_t tim_gp_regs[] =
+{
+    { &TIM2->CR1, &TIM2->IER, &TIM2->SR1, &TIM2->SR2, &TIM2->EGR, &TIM2->CCMR1, &TIM2->CCER1, &TIM2->CNTRH, &TIM2->PSCR, &TIM2->ARRH, &TIM2->CCR1H, 3 },
+    { &TIM3->CR1, &TIM3->IER, &TIM3->SR1, &TIM3->SR2, &TIM3->EGR, &TIM3->CCMR1, &TIM3->CCER1, &TIM3->CNTRH, &TIM3->PSCR, &TIM3->ARRH, &TIM3->CCR1H, 2 }
+};
+
+#define TIM_GP_SR1_CCxIF_MASK       (TIM1_SR1_CC1IF_MASK | TIM1_SR1_CC2IF_MASK | TIM1_SR1_CC3IF_MASK)
+
+typedef void (*tim_update_cb_t)(void);
+typedef void (*tim_capcom_cb_t)(tim1_channel_t channel, uint16_t ccr);
+
+tim_update_cb_t tim_gp_update_cb[2];
+tim_capcom_cb_t tim_gp_capcom_cb[2];
 
 //-----------------------------------------------------------------------------
-// Enable the auto wakeup functionality
+// Disable a general purpose timer
 //
-void Awu_Enable(void)
+inline void Tim_Disable(tim_gp_t tim)
 {
-    AWU->CSR = (AWU->CSR & ~ AWU_CSR_AWEN_MASK) | AWU_CSR_AWEN_ENABLE;
+    *tim_gp_regs[tim].cr1 = (*tim_gp_regs[tim].cr1 & ~TIM1_CR1_CEN_MASK) | TIM1_CR1_CEN_DISABLE;
 }
 
-
 //-----------------------------------------------------------------------------
-//  Measure the LSI frequency using timer IC1 and update the calibration registers.
+// Enable a general purpose timer
 //
-//   It is recommended to use a timer clock frequency of at least 10MHz in order
-//   to obtain a better in the LSI frequency measurement.
+inline void Tim_Enable(tim_gp_t tim)
+{
+    *tim_gp_regs[tim].cr1 = (*tim_gp_regs[tim].cr1 & ~TIM1_CR1_CEN_MASK) | TIM1_CR1_CEN_ENABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Set the auto-reload value
 //
-// Two capture samples are taken from the timer and used to calculate the LSI's
-// frequency.
+// Note that High register must be set first.
 //
-uint32_t AWU_MeasureLSI(void)
+inline void Tim_SetAutoReload(tim_gp_t tim, uint16_t period)
 {
-    uint32_t lsi_freq_hz = 0;
-    uint32_t fmaster;
-    uint16_t ICValue1;
-    uint16_t ICValue2;
-
-    // Get master frequency
-    fmaster = SysClock_GetClockFreq();
-
-    // Enable the LSI measurement: LSI clock connected to timer Input Capture 1
-    AWU->CSR = (AWU->CSR & ~ AWU_CSR_MSR_MASK) | AWU_CSR_MSR_ENABLE;
+    __IO uint8_t *arr = tim_gp_regs[tim].arrh;
 
-    // Measure the LSI frequency with TIMER Input Capture 1
-    // Capture only every 8 events!!!
-    // Enable capture of TI1
-    Tim1_ConfigCapture1(TIM1_ICPOL_RISING, TIM1_ICFILT_NONE);
-    Tim1_SetPrescaler(TIM1_ICPSC_DIV8);
+    arr[0] = ((period - 1) >> 8) & 0xFF;
+    arr[1] = ((period - 1) >> 0) & 0xFF;
+}
 
-    // TIM1_ICInit(TIM1_CHANNEL_1, TIM1_ICPOLARITY_RISING, TIM1_ICSELECTION_DIRECTTI, TIM1_ICPSC_DIV8, 0);
+//-----------------------------------------------------------------------------
+// Set the counter value
+//
+// Note that High register must be set first.
+//
+inline void Tim_SetCounter(tim_gp_t tim, uint16_t counter)
+{
+    __IO uint8_t *cntr = tim_gp_regs[tim].cntrh;
 
-    Tim1_Enable();
+    cntr[0] = (counter >> 8) & 0xFF;
+    cntr[1] = (counter >> 0) & 0xFF;
+}
 
-    // Capture first sample
-    Tim1_WaitCapture1();
-    ICValue1 = Tim1_GetCapture1Time();
-    Tim1_ClearCapture1();
+//-----------------------------------------------------------------------------
+// Get the counter value
+//
+// Note that High register must be read first, it latches the low register.
+//
+inline uint16_t Tim_GetCounter(tim_gp_t tim)
+{
+    __IO uint8_t *cntr = tim_gp_regs[tim].cntrh;
+    uint16_t value = cntr[0] << 8;
 
-    // Capture second sample
-    Tim1_WaitCapture1();
-    ICValue2 = Tim1_GetCapture1Time();
-    Tim1_ClearCapture1();
+    return value | cntr[1];
+}
 
-    Tim1_DisableCapture1();
-    Tim1_Disable();
+//-----------------------------------------------------------------------------
+// Set up the time base of a general purpose timer
+//
+// The timer is left disabled with all channels off. A period of 0 gives the
+// full 65536 count.
+//
+void Tim_Init(tim_gp_t tim, uint8_t prescaler, uint16_t period)
+{
+    const tim_gp_regs_t *regs = &tim_gp_regs[tim];
+    uint8_t ch;
 
-    // Compute LSI clock frequency
-    lsi_freq_hz = (8 * fmaster) / (ICValue2 - ICValue1);
+    Tim_Disable(tim);
+    for (ch = 0; ch < regs->channels; ch += 2)
+    {
+        regs->ccer1[ch >> 1] = 0;
+    }
+    *regs->ier = 0;
+    *regs->pscr = prescaler & TIM2_PSCR_PSC_MASK;
+    Tim_SetAutoReload(tim, period);
+    *regs->cr1 = (*regs->cr1 & ~(TIM1_CR1_ARPE_MASK | TIM1_CR1_UDIS_MASK | TIM1_CR1_URS_MASK)) |
+                 TIM1_CR1_ARPE_ENABLE | TIM1_CR1_UDIS_DISABLE | TIM1_CR1_URS_UPDATE;
+
+    // Load the prescaler now rather than at the first overflow, URS stops
+    // this setting the update flag
+    *regs->egr = TIM1_EGR_UG_ENABLE;
+    *regs->sr1 = 0;
+    *regs->sr2 = 0;
+}
 
-    // Disable the LSI measurement: LSI clock disconnected from timer Input Capture 1
-    AWU->CSR = (AWU->CSR & ~AWU_CSR_MSR_MASK) | AWU_CSR_MSR_DISABLE;
+//-----------------------------------------------------------------------------
+// Configure a channel for output compare
+//
+// mode is one of the TIM1_CCMR_OCxM values. The compare register isn't
+// preloaded so Tim_SetCompare takes effect straight away, as needed for
+// toggle mode.
+//
+void Tim_ConfigCompare(tim_gp_t tim, tim1_channel_t channel, uint8_t mode, bool active_low, uint16_t value)
+{
+    const tim_gp_regs_t *regs = &tim_gp_regs[tim];
 
-    return lsi_freq_hz;
+    Tim_SetCCR(regs->ccr1h, channel, value);
+    Tim_ConfigChannel(regs->ccmr1, regs->ccer1, channel,
+                      TIM1_CCMR_CCxS_OUTPUT | (mode & TIM1_CCMR_OCxM_MASK) | TIM1_CCMR_OCxPE_DISABLE,
+                      TIM1_CCER1_CC1E_ENABLE | (active_low ? TIM1_CCER1_CC1P_LOW : TIM1_CCER1_CC1P_HIGH));
 }
 
-//=============================================================================
-// Watchdog functions
+//-----------------------------------------------------------------------------
+// Configure a channel for PWM
 //
+// The compare register is preloaded so duty changes take effect at the next
+// update event.
 //
-typedef enum
+void Tim_ConfigPWM(tim_gp_t tim, tim1_channel_t channel, tim1_pwm_mode_t mode, bool active_low, uint16_t duty)
 {
-    IWDG_PERIOD_16MS    = 0x00,     // 15.9ms with RL of 0xFF
-    IWDG_PERIOD_32MS    = 0x01,     // 31.9ms with RL of 0xFF
-    IWDG_PERIOD_63MS    = 0x02,     // 63.7ms with RL of 0xFF
-    IWDG_PERIOD_127MS   = 0x03,     // 127ms with RL of 0xFF
-    IWDG_PERIOD_255MS   = 0x04,     // 255ms with RL of 0xFF
-    IWDG_PERIOD_510MS   = 0x05,     // 510ms with RL of 0xFF
-    IWDG_PERIOD_1S      = 0x06      // 1.02s with RL of 0xFF
-} iwdg_period_t;
+    const tim_gp_regs_t *regs = &tim_gp_regs[tim];
+
+    Tim_SetCCR(regs->ccr1h, channel, duty);
+    Tim_ConfigChannel(regs->ccmr1, regs->ccer1, channel,
+                      TIM1_CCMR_CCxS_OUTPUT | mode | TIM1_CCMR_OCxPE_ENABLE,
+                      TIM1_CCER1_CC1E_ENABLE | (active_low ? TIM1_CCER1_CC1P_LOW : TIM1_CCER1_CC1P_HIGH));
+}
 
 //-----------------------------------------------------------------------------
-// Initialise the independent watchdog
+// Configure a channel for input capture on its own input
 //
-void Iwdg_Init(iwdg_period_t period)
+void Tim_ConfigCapture(tim_gp_t tim, tim1_channel_t channel, tim1_ic_polarity_t polarity, tim1_ic_filter_t filter, tim1_ic_prescaler_t prescaler)
 {
-    IWDG->KR = IWDG_KR_KEY_ACCESS;
-    IWDG->PR = (IWDG->PR & ~IWDG_PR_PR_MASK) | period;
-    IWDG->RLR = 0xFF;
-    IWDG->KR = IWDG_KR_KEY_ENABLE;
+    const tim_gp_regs_t *regs = &tim_gp_regs[tim];
+
+    Tim_ConfigChannel(regs->ccmr1, regs->ccer1, channel,
+                      TIM1_CCMR_CCxS_DIRECT | filter | prescaler,
+                      TIM1_CCER1_CC1E_ENABLE | ((polarity == TIM1_ICPOL_FALLING) ? TIM1_CCER1_CC1P_FALLING : TIM1_CCER1_CC1P_RISING));
 }
 
 //-----------------------------------------------------------------------------
-// Refresh the reload register (feed the dog)
+// Turn a channel off
 //
-void Iwdg_Refresh(void)
+void Tim_DisableChannel(tim_gp_t tim, tim1_channel_t channel)
 {
-    IWDG->KR = IWDG_KR_KEY_REFRESH;
+    const tim_gp_regs_t *regs = &tim_gp_regs[tim];
+
+    regs->ccer1[channel >> 1] &= ~(0x0F << ((channel & 1) << 2));
+    *regs->ier &= ~(TIM1_IER_CC1IE_MASK << channel);
 }
 
 //-----------------------------------------------------------------------------
-// Initialise the window watchdog
+// Set the compare value for a channel
 //
-void Wwdg_Init(void)
+inline void Tim_SetCompare(tim_gp_t tim, tim1_channel_t channel, uint16_t value)
 {
-    WWDG->CR = (WWDG->CR & ~(WWDG_CR_WDGA_MASK | WWDG_CR_T_MASK)) | WWDG_CR_WDGA_ENABLE | WWDG_CR_T_MAX;
+    Tim_SetCCR(tim_gp_regs[tim].ccr1h, channel, value);
 }
 
 //-----------------------------------------------------------------------------
-// Refresh the downcounter register (feed the dog)
+// Get the last capture for a channel
 //
-void Wwdg_Refresh(void)
+inline uint16_t Tim_GetCapture(tim_gp_t tim, tim1_channel_t channel)
 {
-    WWDG->CR = WWDG_CR_T_MAX;
+    return Tim_GetCCR(tim_gp_regs[tim].ccr1h, channel);
 }
 
 //-----------------------------------------------------------------------------
-// Return the period between refreshes before a reset occurs
+// Call a function on every update event, NULL to stop
 //
-uint16_t Wwdg_Period(void)
+void Tim_SetUpdateInterrupt(tim_gp_t tim, tim_update_cb_t cb)
 {
-    uint16_t period = SysClock_GetClockFreq() * 12288;
-    return (period * WWDG_CR_T_MAX) - (period * WWDG_CR_T_MIN);
-}
+    const tim_gp_regs_t *regs = &tim_gp_regs[tim];
 
+    *regs->ier &= ~TIM1_IER_UIE_MASK;
+    tim_gp_update_cb[tim] = cb;
+    if (cb)
+    {
+        *regs->sr1 = (uint8_t)~TIM1_SR1_UIF_MASK;
+        *regs->ier |= TIM1_IER_UIE_ENABLE;
+    }
+}
 
-//=============================================================================
-// System Tick functions
+//-----------------------------------------------------------------------------
+// Call a function on capture/compare events of a channel
 //
-// The system tick is a 1ms timer. It uses the basic 8-bit timer TIM4. Counter
-// is 16 bit so maximum period of time that can be handled is 65s.
+// The callback is shared by all the channels of the timer and is given the
+// channel and its CCR value. Use Tim_DisableChannel to stop.
 //
+void Tim_SetCapComInterrupt(tim_gp_t tim, tim1_channel_t channel, tim_capcom_cb_t cb)
+{
+    const tim_gp_regs_t *regs = &tim_gp_regs[tim];
 
-__IO uint16_t systick;
+    tim_gp_capcom_cb[tim] = cb;
+    *regs->sr1 = (uint8_t)~(TIM1_SR1_CC1IF_MASK << channel);
+    *regs->ier |= (TIM1_IER_CC1IE_ENABLE << channel);
+}
 
+#ifdef ONEPULSE
 //-----------------------------------------------------------------------------
-// Initialise
+// Set up one pulse mode on a channel
 //
-// Setup 8-bit basic timer as 1ms system tick using interrupts to update the tick counter
+// As Tim1_InitOnePulse, the pulse starts delay ticks after Tim_Pulse and
+// lasts width ticks. Ticks are fMASTER / 2^prescaler.
 //
-void Systick_Init(void)
+void Tim_InitOnePulse(tim_gp_t tim, tim1_channel_t channel, uint8_t prescaler, uint16_t delay, uint16_t width, bool active_low)
 {
-    Tim4_Config1ms();
+    const tim_gp_regs_t *regs = &tim_gp_regs[tim];
+
+    Tim_Init(tim, prescaler, delay + width);
+    *regs->cr1 = (*regs->cr1 & ~TIM1_CR1_OPM_MASK) | TIM1_CR1_OPM_ENABLE;
+    Tim_ConfigPWM(tim, channel, TIM1_PWM_MODE2, active_low, delay);
+    *regs->egr = TIM1_EGR_UG_ENABLE;
 }
 
 //-----------------------------------------------------------------------------
-// Check if a period has passed since the start time.
+// Trigger the pulse
 //
-// If the timeout has expired, the start value is reset to the current time
-// so that it can be reused.
+inline void Tim_Pulse(tim_gp_t tim)
+{
+    Tim_Enable(tim);
+}
+
+//-----------------------------------------------------------------------------
+// Check if the pulse is still being generated
 //
-bool Systick_Timeout(uint16_t *start, uint16_t period)
+inline bool Tim_PulseBusy(tim_gp_t tim)
 {
-    if (systick - *start >= period)
+    return (*tim_gp_regs[tim].cr1 & TIM1_CR1_CEN_MASK) == TIM1_CR1_CEN_ENABLE;
+}
+#endif // ONEPULSE
+
+//-----------------------------------------------------------------------------
+// Common update interrupt handling
+//
+static void Tim_UpdateHandler(tim_gp_t tim)
+{
+    *tim_gp_regs[tim].sr1 = (uint8_t)~TIM1_SR1_UIF_MASK;
+    if (tim_gp_update_cb[tim])
     {
-        *start = systick;
-        return true;
+        tim_gp_update_cb[tim]();
     }
-    return false;
 }
 
 //-----------------------------------------------------------------------------
-// Wait a period of time
+// Common capture/compare interrupt handling
 //
-void Systick_Wait(uint16_t period)
+// Reading CCR clears the flag for a capture, for a compare it's cleared
+// explicitly.
+//
+static void Tim_CapComHandler(tim_gp_t tim)
 {
-    uint16_t start = systick;
-    while (!Systick_Timeout(&start, period))
+    const tim_gp_regs_t *regs = &tim_gp_regs[tim];
+    uint8_t pending = *regs->sr1 & *regs->ier & TIM_GP_SR1_CCxIF_MASK;
+    uint8_t channel;
+
+    for (channel = TIM1_CHANNEL_1; pending; ++channel)
     {
+        uint8_t flag = TIM1_SR1_CC1IF_MASK << channel;
+
+        if (pending & flag)
+        {
+            uint16_t ccr = Tim_GetCCR(regs->ccr1h, channel);
+
+            pending &= ~flag;
+            *regs->sr1 = (uint8_t)~flag;
+            if (tim_gp_capcom_cb[tim])
+            {
+                tim_gp_capcom_cb[tim]((tim1_channel_t)channel, ccr);
+            }
+        }
     }
 }
 
 //-----------------------------------------------------------------------------
-// Interrupt handler for the system tick counter
+// Interrupt handlers for TIM2 and TIM3
 //
 #if defined __IAR_SYSTEMS_ICC__
-#pragma vector=23
+#pragma vector=13
 #endif
-INTERRUPT(TIM4_UPD_OVF_IRQHandler, 23)
+INTERRUPT(TIM2_UPD_OVF_IRQHandler, 13)
 {
-    ++systick;
+    Tim_UpdateHandler(TIM_GP_2);
+}
 
-    // Clear Interrupt Pending bit
-    TIM4->SR1 = (TIM4->SR1 & ~TIM4_SR1_UIF_MASK) | TIM4_SR1_UIF_CLEAR;
+#if defined __IAR_SYSTEMS_ICC__
+#pragma vector=14
+#endif
+INTERRUPT(TIM2_CAPCOM_IRQHandler, 14)
+{
+    Tim_CapComHandler(TIM_GP_2);
 }
 
+#if defined __IAR_SYSTEMS_ICC__
+#pragma vector=15
+#endif
+INTERRUPT(TIM3_UPD_OVF_IRQHandler, 15)
+{
+    Tim_UpdateHandler(TIM_GP_3);
+}
 
-//=============================================================================
-// I2C functions
+#if defined __IAR_SYSTEMS_ICC__
+#pragma vector=16
+#endif
+INTERRUPT(TIM3_CAPCOM_IRQHandler, 16)
+{
+    Tim_CapComHandler(TIM_GP_3);
+}
+#endif // TIMGP
+
+//-----------------------------------------------------------------------------
+// Disable the TIM4 timer
 //
+inline void Tim4_Disable(void)
+{
+    TIM4->CR1 = (TIM4->CR1 & ~TIM4_CR1_CEN_MASK) | TIM4_CR1_CEN_DISABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Enable the TIM4 timer
 //
+inline void Tim4_Enable(void)
+{
+    TIM4->CR1 = (TIM4->CR1 & ~TIM4_CR1_CEN_MASK) | TIM4_CR1_CEN_ENABLE;
+}
 
-// Use when clock is 10Mhz
-// MSbit is the duty cycle, rest is the CCR value
-/*typedef enum
+//-----------------------------------------------------------------------------
+// Configure the TIM4 timer
+//
+void Tim4_Config(uint8_t prescaler, uint8_t reload)
 {
-    I2C_SPEED_400KHZ    = 0x8001,
-    I2C_SPEED_370KHZ    = 0x0009,
-    I2C_SPEED_350KHZ    = 0x0009,
-    I2C_SPEED_320KHZ    = 0x000A,
-    I2C_SPEED_300KHZ    = 0x000B,
-    I2C_SPEED_270KHZ    = 0x000C,
-    I2C_SPEED_250KHZ    = 0x000D,
-    I2C_SPEED_220KHZ    = 0x000F,
-    I2C_SPEED_200KHZ    = 0x8002,
-    I2C_SPEED_170KHZ    = 0x0013,
-    I2C_SPEED_150KHZ    = 0x0016,
-    I2C_SPEED_120KHZ    = 0x001B,
-    I2C_SPEED_100KHZ    = 0x0032,
-    I2C_SPEED_50KHZ     = 0x0064,
-    I2C_SPEED_30KHZ     = 0x00A6,
-    I2C_SPEED_20KHZ     = 0x00FA
-} i2c_speed_t;
-*/
+    Tim4_Disable();
+    TIM4->PSCR = prescaler;
+    TIM4->ARR = reload;
+    TIM4->SR1 = (TIM4->SR1 & ~TIM4_SR1_UIF_MASK) | TIM4_SR1_UIF_CLEAR;
+    TIM4->IER = (TIM4->IER & ~TIM4_IER_UIE_MASK) | TIM4_IER_UIE_ENABLE;
+    TIM4->CNTR = 0;
+    TIM4->CR1 = (TIM4->CR1 & ~TIM4_CR1_ARPE_MASK) | TIM4_CR1_ARPE_ENABLE;
+    Tim4_Enable();
+}
 
-typedef enum
+//-----------------------------------------------------------------------------
+// Configure the TIM4 timer for 1ms interrupts
+//
+// Setup 8-bit basic timer as 1ms system tick using interrupts to update the tick counter
+//
+// With 16Mhz HSI prescaler is 128 and reload value is 124. freq = 16000000/128 is 125Khz, therefore reload value is 125 - 1 or 124. Period is 125/125000 which is 0.001s or 1ms
+// With 8Mhz HSE prescaler is 64 and reload value is 124. freq is 8000000/64 is 125Khz.
+// With 128Khz LSI prescaler is 16 and reload value is 128. freq is 128000/16 is 8Khz.
+//
+void Tim4_Config1ms(void)
 {
-    I2C_SPEED_STANDARD,
-    I2C_SPEED_FULL
-} i2c_speed_t;
+    if (SysClock_GetClockFreq() == 16000000)
+    {
+        Tim4_Config(TIM4_PSCR_DIV128, 124);
+    }
+    else if (SysClock_GetClockFreq() == 8000000)
+    {
+        Tim4_Config(TIM4_PSCR_DIV64, 124);
+    }
+    else if (SysClock_GetClockFreq() == 128000)
+    {
+        Tim4_Config(TIM4_PSCR_DIV1, 128);
+    }
+}
 
-// Use when clock is 16Mhz
-// MSbit is the duty cycle, rest is the CCR value
-typedef enum
+#ifdef FADER
+//=============================================================================
+// LED fade functions
+//
+// Fades LEDs on the TIM1 PWM channels. Brightness is 0-255 and goes through
+// a gamma table so equal steps look equal to the eye. Each channel moves
+// towards its target at a rate set from the ramp time.
+//
+// The steps are made from the TIM1 update interrupt with the repetition
+// counter dividing the PWM rate down to about FADE_RATE_HZ, so fading costs
+// nothing in the main loop and isn't disturbed by it. The new duty is
+// preloaded so it takes effect at the same update event.
+//
+// Level is Q8.8 so slow ramps still move smoothly.
+//
+// The LED is taken to be on the channel's OCx output, eg. PC3 for channel 3,
+// lit while the output is high. Fade_Init reads each channel's PWM mode and
+// OCx polarity, and a channel where that makes the duty the time dark, PWM
+// mode 2 or active low but not both, has its CCR inverted. Tim1_ConfigPWM
+// sets channel 3 to mode 2 active high, so it is one of these.
+//
+
+#define FADE_RATE_HZ        200
+#define FADE_CHANNELS       4
+
+// (i / 255)^2.2 as Q0.16
+static const uint16_t fade_gamma[256] =
+{
+    0x0000, 0x0000, 0x0002, 0x0004, 0x0007, 0x000B, 0x0011, 0x0018,
+    0x0020, 0x002A, 0x0035, 0x0041, 0x004F, 0x005E, 0x006F, 0x0081,
+    0x0094, 0x00A9, 0x00C0, 0x00D8, 0x00F2, 0x010E, 0x012B, 0x014A,
+    0x016A, 0x018C, 0x01B0, 0x01D5, 0x01FC, 0x0225, 0x024F, 0x027B,
+    0x02A9, 0x02D9, 0x030B, 0x033E, 0x0373, 0x03AA, 0x03E3, 0x041D,
+    0x0459, 0x0497, 0x04D7, 0x0519, 0x055D, 0x05A3, 0x05EA, 0x0633,
+    0x067F, 0x06CC, 0x071B, 0x076C, 0x07BF, 0x0814, 0x086B, 0x08C3,
+    0x091E, 0x097B, 0x09D9, 0x0A3A, 0x0A9D, 0x0B01, 0x0B68, 0x0BD0,
+    0x0C3B, 0x0CA8, 0x0D16, 0x0D87, 0x0DFA, 0x0E6E, 0x0EE5, 0x0F5E,
+    0x0FD9, 0x1056, 0x10D5, 0x1156, 0x11DA, 0x125F, 0x12E6, 0x1370,
+    0x13FB, 0x1489, 0x1519, 0x15AB, 0x163F, 0x16D5, 0x176E, 0x1808,
+    0x18A5, 0x1944, 0x19E5, 0x1A88, 0x1B2D, 0x1BD4, 0x1C7E, 0x1D2A,
+    0x1DD8, 0x1E88, 0x1F3A, 0x1FEF, 0x20A6, 0x215F, 0x221A, 0x22D7,
+    0x2397, 0x2459, 0x251D, 0x25E3, 0x26AC, 0x2776, 0x2843, 0x2913,
+    0x29E4, 0x2AB8, 0x2B8E, 0x2C66, 0x2D41, 0x2E1E, 0x2EFD, 0x2FDE,
+    0x30C2, 0x31A8, 0x3290, 0x337B, 0x3468, 0x3557, 0x3648, 0x373C,
+    0x3832, 0x392B, 0x3A25, 0x3B22, 0x3C22, 0x3D24, 0x3E28, 0x3F2E,
+    0x4037, 0x4142, 0x424F, 0x435F, 0x4471, 0x4586, 0x469D, 0x47B6,
+    0x48D2, 0x49F0, 0x4B10, 0x4C33, 0x4D58, 0x4E7F, 0x4FA9, 0x50D6,
+    0x5204, 0x5335, 0x5469, 0x559F, 0x56D7, 0x5812, 0x594F, 0x5A8E,
+    0x5BD0, 0x5D15, 0x5E5C, 0x5FA5, 0x60F1, 0x623F, 0x638F, 0x64E2,
+    0x6638, 0x6790, 0x68EA, 0x6A47, 0x6BA6, 0x6D08, 0x6E6C, 0x6FD3,
+    0x713C, 0x72A7, 0x7415, 0x7586, 0x76F9, 0x786E, 0x79E6, 0x7B61,
+    0x7CDE, 0x7E5D, 0x7FDF, 0x8164, 0x82EA, 0x8474, 0x8600, 0x878E,
+    0x891F, 0x8AB3, 0x8C49, 0x8DE1, 0x8F7C, 0x911A, 0x92BA, 0x945D,
+    0x9602, 0x97A9, 0x9954, 0x9B00, 0x9CB0, 0x9E62, 0xA016, 0xA1CD,
+    0xA386, 0xA542, 0xA701, 0xA8C2, 0xAA86, 0xAC4C, 0xAE15, 0xAFE1,
+    0xB1AF, 0xB37F, 0xB552, 0xB728, 0xB900, 0xBADB, 0xBCB9, 0xBE99,
+    0xC07B, 0xC261, 0xC449, 0xC633, 0xC820, 0xCA10, 0xCC02, 0xCDF7,
+    0xCFEE, 0xD1E8, 0xD3E5, 0xD5E4, 0xD7E6, 0xD9EB, 0xDBF2, 0xDDFC,
+    0xE008, 0xE217, 0xE429, 0xE63D, 0xE854, 0xEA6E, 0xEC8A, 0xEEA9,
+    0xF0CA, 0xF2EE, 0xF515, 0xF73F, 0xF96B, 0xFB9A, 0xFDCB, 0xFFFF
+};
+
+typedef struct
 {
-    I2C_FREQUENCY_400KHZ    = 0x000D,
-    I2C_FREQUENCY_370KHZ    = 0x000E,
-    I2C_FREQUENCY_350KHZ    = 0x000F,
-    I2C_FREQUENCY_320KHZ    = 0x8002,
-    I2C_FREQUENCY_300KHZ    = 0x0011,
-    I2C_FREQUENCY_270KHZ    = 0x0013,
-    I2C_FREQUENCY_250KHZ    = 0x0015,
-    I2C_FREQUENCY_220KHZ    = 0x0018,
-    I2C_FREQUENCY_200KHZ    = 0x001A,
-    I2C_FREQUENCY_170KHZ    = 0x001F,
-    I2C_FREQUENCY_150KHZ    = 0x0023,
-    I2C_FREQUENCY_120KHZ    = 0x002C,
-    I2C_FREQUENCY_100KHZ    = 0x0050,
-    I2C_FREQUENCY_50KHZ     = 0x00A0,
-    I2C_FREQUENCY_30KHZ     = 0x010A,
-    I2C_FREQUENCY_20KHZ     = 0x0190
-} i2c_frequency_t;
+    uint16_t level;         // Q8.8
+    uint16_t target;        // Q8.8
+    uint16_t step;          // Q8.8 per update
+} fade_channel_t;
 
-typedef enum
+fade_channel_t fade_channels[FADE_CHANNELS];
+uint16_t fade_period;
+uint16_t fade_rate;
+uint8_t fade_inverted;              // Channels whose CCR is the time dark
+
+//-----------------------------------------------------------------------------
+// Set a channel's duty for a level
+//
+static void Fade_SetDuty(uint8_t ch, uint16_t level)
 {
-    I2C_DIRECTION_WRITE = 0,
-    I2C_DIRECTION_READ  = 1
-} i2c_direction_t;
+    uint16_t duty = (uint16_t)(((uint32_t)fade_gamma[level >> 8] * (fade_period + 1)) >> 16);
 
-/**
-  * @brief  I2C Flags
-  * @brief Elements values convention: 0xXXYY
-  *  X = SRx registers index
-  *      X = 1 : SR1
-  *      X = 2 : SR2
-  *      X = 3 : SR3
-  *  Y = Flag mask in the register
-  */
-typedef enum
+    if (fade_inverted & (1 << ch))
+    {
+        duty = fade_period + 1 - duty;
+    }
+    Tim_SetCCR(&TIM1->CCR1H, ch, duty);
+}
+
+//-----------------------------------------------------------------------------
+// Step the fades, called on the TIM1 update event
+//
+static void Fade_Update(void)
 {
-  /* SR1 register flags */
-  I2C_FLAG_TXEMPTY             = (uint16_t)0x0180,  /*!< Transmit Data Register Empty flag */
-  I2C_FLAG_RXNOTEMPTY          = (uint16_t)0x0140,  /*!< Read Data Register Not Empty flag */
-  I2C_FLAG_STOPDETECTION       = (uint16_t)0x0110,  /*!< Stop detected flag */
-  I2C_FLAG_HEADERSENT          = (uint16_t)0x0108,  /*!< 10-bit Header sent flag */
-  I2C_FLAG_TRANSFERFINISHED    = (uint16_t)0x0104,  /*!< Data Byte Transfer Finished flag */
-  I2C_FLAG_ADDRESSSENTMATCHED  = (uint16_t)0x0102,  /*!< Address Sent/Matched (master/slave) flag */
-  I2C_FLAG_STARTDETECTION      = (uint16_t)0x0101,  /*!< Start bit sent flag */
+    fade_channel_t *fade = fade_channels;
+    uint8_t ch;
 
-  /* SR2 register flags */
-  I2C_FLAG_WAKEUPFROMHALT      = (uint16_t)0x0220,  /*!< Wake Up From Halt Flag */
-  I2C_FLAG_OVERRUNUNDERRUN     = (uint16_t)0x0208,  /*!< Overrun/Underrun flag */
-  I2C_FLAG_ACKNOWLEDGEFAILURE  = (uint16_t)0x0204,  /*!< Acknowledge Failure Flag */
-  I2C_FLAG_ARBITRATIONLOSS     = (uint16_t)0x0202,  /*!< Arbitration Loss Flag */
-  I2C_FLAG_BUSERROR            = (uint16_t)0x0201,  /*!< Misplaced Start or Stop condition */
+    for (ch = 0; ch < FADE_CHANNELS; ++ch, ++fade)
+    {
+        if (fade->level == fade->target)
+        {
+            continue;
+        }
+        if (fade->level < fade->target)
+        {
+            fade->level = (fade->target - fade->level > fade->step) ? fade->level + fade->step : fade->target;
+        }
+        else
+        {
+            fade->level = (fade->level - fade->target > fade->step) ? fade->level - fade->step : fade->target;
+        }
+        Fade_SetDuty(ch, fade->level);
+    }
+}
 
-  /* SR3 register flags */
-  I2C_FLAG_GENERALCALL         = (uint16_t)0x0310,  /*!< General Call header received Flag */
-  I2C_FLAG_TRANSMITTERRECEIVER = (uint16_t)0x0304,  /*!< Transmitter Receiver Flag */
-  I2C_FLAG_BUSBUSY             = (uint16_t)0x0302,  /*!< Bus Busy Flag */
-  I2C_FLAG_MASTERSLAVE         = (uint16_t)0x0301   /*!< Master Slave Flag */
-} I2C_Flag_TypeDef;
+//-----------------------------------------------------------------------------
+// Start the fade engine
+//
+// TIM1 must already be set up for PWM with the period given, pwm_hz is the
+// PWM frequency. All channels start off.
+//
+void Fade_Init(uint16_t period, uint32_t pwm_hz)
+{
+    uint32_t rcr = pwm_hz / FADE_RATE_HZ;
+    bool mode2;
+    bool active_low;
+    uint8_t ch;
 
-/**
-  * @brief I2C Pending bits
-  * Elements values convention: 0xXYZZ
-  *  X = SRx registers index
-  *      X = 1 : SR1
-  *      X = 2 : SR2
-  *  Y = Position of the corresponding Interrupt
-  *  ZZ = flag mask in the dedicated register(X register)
-  */
+    if (rcr > 256)
+    {
+        rcr = 256;
+    }
+    if (rcr == 0)
+    {
+        rcr = 1;
+    }
+    fade_period = period;
+    fade_rate = pwm_hz / rcr;
+    fade_inverted = 0;
+    for (ch = 0; ch < FADE_CHANNELS; ++ch)
+    {
+        mode2 = ((&TIM1->CCMR1)[ch] & TIM1_CCMR_OCxM_MASK) == TIM1_CCMR_OCxM_PWM2;
+        active_low = (((&TIM1->CCER1)[ch >> 1] >> ((ch & 1) << 2)) & TIM1_PWM_OUT_ACTIVE_LOW) != 0;
+        if (mode2 != active_low)
+        {
+            fade_inverted |= (uint8_t)(1 << ch);
+        }
+        fade_channels[ch].level = 0;
+        fade_channels[ch].target = 0;
+        fade_channels[ch].step = 0;
+        Fade_SetDuty(ch, 0);
+    }
+    TIM1->RCR = rcr - 1;
+    Tim1_SetUpdateInterrupt(Fade_Update);
+}
 
-typedef enum
+//-----------------------------------------------------------------------------
+// Fade a channel to a brightness over a time in ms
+//
+void Fade_To(tim1_channel_t channel, uint8_t brightness, uint16_t ramp_ms) CRITICAL
 {
-    /* SR1 register flags */
-    I2C_ITPENDINGBIT_TXEMPTY             = (uint16_t)0x1680,    /*!< Transmit Data Register Empty  */
-    I2C_ITPENDINGBIT_RXNOTEMPTY          = (uint16_t)0x1640,    /*!< Read Data Register Not Empty  */
-    I2C_ITPENDINGBIT_STOPDETECTION       = (uint16_t)0x1210,    /*!< Stop detected  */
-    I2C_ITPENDINGBIT_HEADERSENT          = (uint16_t)0x1208,    /*!< 10-bit Header sent */
-    I2C_ITPENDINGBIT_TRANSFERFINISHED    = (uint16_t)0x1204,    /*!< Data Byte Transfer Finished  */
-    I2C_ITPENDINGBIT_ADDRESSSENTMATCHED  = (uint16_t)0x1202,    /*!< Address Sent/Matched (master/slave)  */
-    I2C_ITPENDINGBIT_STARTDETECTION      = (uint16_t)0x1201,    /*!< Start bit sent  */
+    fade_channel_t *fade = &fade_channels[channel];
+    uint16_t target = (uint16_t)brightness << 8;
+    uint32_t steps = ((uint32_t)ramp_ms * fade_rate) / 1000;
+    uint16_t distance = (fade->level > target) ? fade->level - target : target - fade->level;
 
-    /* SR2 register flags */
-    I2C_ITPENDINGBIT_WAKEUPFROMHALT      = (uint16_t)0x2220,    /*!< Wake Up From Halt  */
-    I2C_ITPENDINGBIT_OVERRUNUNDERRUN     = (uint16_t)0x2108,    /*!< Overrun/Underrun  */
-    I2C_ITPENDINGBIT_ACKNOWLEDGEFAILURE  = (uint16_t)0x2104,    /*!< Acknowledge Failure  */
-    I2C_ITPENDINGBIT_ARBITRATIONLOSS     = (uint16_t)0x2102,    /*!< Arbitration Loss  */
-    I2C_ITPENDINGBIT_BUSERROR            = (uint16_t)0x2101     /*!< Misplaced Start or Stop condition */
-} I2C_ITPendingBit_TypeDef;
+    fade->step = (steps > 1) ? distance / steps : distance;
+    if (fade->step == 0)
+    {
+        fade->step = 1;
+    }
+    fade->target = target;
+}
 
-/**
-  * @brief I2C possible events
-  * Values convention: 0xXXYY
-  * XX = Event SR3 corresponding value
-  * YY = Event SR1 corresponding value
-  * @note if Event = EV3_2 the rule above does not apply
-  * YY = Event SR2 corresponding value
-  */
+//-----------------------------------------------------------------------------
+// Check if a channel is still fading
+//
+bool Fade_Busy(tim1_channel_t channel) CRITICAL
+{
+    return fade_channels[channel].level != fade_channels[channel].target;
+}
+#endif // FADER
 
-typedef enum
+#ifdef FLASHER
+//=============================================================================
+// Status LED functions
+//
+// Blinks a status LED from a table of on and off times without any work in
+// the main loop. The LED is on a timer channel in output compare toggle mode
+// so the hardware switches it at the exact time. The compare interrupt only
+// runs at each step to set up the time of the next toggle, so the timing
+// stays right however busy the main loop is.
+//
+// PD7 has no timer output, so the LED for this is on TIM3_CH1 (PD2).
+//
+// The timer prescaler is chosen so a tick is as close to 1ms as a power of
+// two allows, within about 3%, and the table times are used as ticks.
+//
+
+#define STATUS_TIM                  TIM_GP_3
+#define STATUS_CHANNEL              TIM1_CHANNEL_1
+#define STATUS_ACTIVE_LOW           false
+
+typedef struct
 {
-  /*========================================
-                       I2C Master Events (Events grouped in order of communication)
-                                                          ==========================================*/
-  /**
-    * @brief  Communication start
-    *
-    * After sending the START condition (I2C_GenerateSTART() function) the master
-    * has to wait for this event. It means that the Start condition has been correctly
-    * released on the I2C bus (the bus is free, no other devices is communicating).
-    *
-    */
-  /* --EV5 */
-  I2C_EVENT_MASTER_MODE_SELECT               = (uint16_t)0x0301,  /*!< BUSY, MSL and SB flag */
+    const uint16_t *steps;      // On and off times in ms, in pairs, 0 terminated
+    uint16_t gap;               // Extra off time after the last repeat
+} status_pattern_t;
 
-  /**
-    * @brief  Address Acknowledge
-    *
-    * After checking on EV5 (start condition correctly released on the bus), the
-    * master sends the address of the slave(s) with which it will communicate
-    * (I2C_Send7bitAddress() function, it also determines the direction of the communication:
-    * Master transmitter or Receiver).
-    * Then the master has to wait that a slave acknowledges his address.
-    * If an acknowledge is sent on the bus, one of the following events will
-    * be set:
-    *
-    *  1) In case of Master Receiver (7-bit addressing):
-    *  the I2C_EVENT_MASTER_RECEIVER_MODE_SELECTED event is set.
-    *
-    *  2) In case of Master Transmitter (7-bit addressing):
-    *  the I2C_EVENT_MASTER_TRANSMITTER_MODE_SELECTED is set
-    *
-    *  3) In case of 10-Bit addressing mode, the master (just after generating the START
-    *  and checking on EV5) has to send the header of 10-bit addressing mode (I2C_SendData()
-    *  function).
-    *  Then master should wait on EV9. It means that the 10-bit addressing
-    *  header has been correctly sent on the bus.
-    *  Then master should send the second part of the 10-bit address (LSB) using
-    *  the function I2C_Send7bitAddress(). Then master should wait for event EV6.
-    *
-    */
-  /* --EV6 */
-  I2C_EVENT_MASTER_TRANSMITTER_MODE_SELECTED = (uint16_t)0x0782,  /*!< BUSY, MSL, ADDR, TXE and TRA flags */
-  I2C_EVENT_MASTER_RECEIVER_MODE_SELECTED    = (uint16_t)0x0302,  /*!< BUSY, MSL and ADDR flags */
-  /* --EV9 */
-  I2C_EVENT_MASTER_MODE_ADDRESS10            = (uint16_t)0x0308,  /*!< BUSY, MSL and ADD10 flags */
+static const uint16_t status_heartbeat_steps[] = { 60, 140, 60, 740, 0 };
+static const uint16_t status_fast_fail_steps[] = { 50, 50, 0 };
+static const uint16_t status_count_steps[] = { 200, 300, 0 };
 
-  /**
-    * @brief Communication events
-    *
-    * If a communication is established (START condition generated and slave address
-    * acknowledged) then the master has to check on one of the following events for
-    * communication procedures:
-    *
-    * 1) Master Receiver mode: The master has to wait on the event EV7 then to read
-    *    the data received from the slave (I2C_ReceiveData() function).
-    *
-    * 2) Master Transmitter mode: The master has to send data (I2C_SendData()
-    *    function) then to wait on event EV8 or EV8_2.
-    *    These two events are similar:
-    *     - EV8 means that the data has been written in the data register and is
-    *       being shifted out.
-    *     - EV8_2 means that the data has been physically shifted out and output
-    *       on the bus.
-    *     In most cases, using EV8 is sufficient for the application.
-    *     Using EV8_2 leads to a slower communication but ensures more reliable test.
-    *     EV8_2 is also more suitable than EV8 for testing on the last data transmission
-    *     (before Stop condition generation).
-    *
-    *  @note In case the user software does not guarantee that this event EV7 is
-    *  managed before the current byte end of transfer, then user may check on EV7
-    *  and BTF flag at the same time (ie. (I2C_EVENT_MASTER_BYTE_RECEIVED | I2C_FLAG_BTF)).
-    *  In this case the communication may be slower.
-    *
-    */
-  /* Master RECEIVER mode -----------------------------*/
-  /* --EV7 */
-  I2C_EVENT_MASTER_BYTE_RECEIVED             = (uint16_t)0x0340,  /*!< BUSY, MSL and RXNE flags */
+static const status_pattern_t status_heartbeat = { status_heartbeat_steps, 0 };
+static const status_pattern_t status_fast_fail = { status_fast_fail_steps, 0 };
+static const status_pattern_t status_error_count = { status_count_steps, 1500 };  // Repeat for the error number
 
-  /* Master TRANSMITTER mode --------------------------*/
-  /* --EV8 */
-  I2C_EVENT_MASTER_BYTE_TRANSMITTING         = (uint16_t)0x0780,  /*!< TRA, BUSY, MSL, TXE flags */
-  /* --EV8_2 */
+const status_pattern_t *status_pattern;
+uint8_t status_repeats;
+uint8_t status_repeat;
+uint8_t status_step;
 
-  I2C_EVENT_MASTER_BYTE_TRANSMITTED          = (uint16_t)0x0784,  /*!< EV8_2: TRA, BUSY, MSL, TXE and BTF flags */
+//-----------------------------------------------------------------------------
+// Set up the toggle after the one that just happened
+//
+static void Status_Step(tim1_channel_t channel, uint16_t ccr)
+{
+    const uint16_t *steps = status_pattern->steps;
+    uint16_t duration = steps[status_step];
 
+    (void)channel;
+    ++status_step;
+    if (steps[status_step] == 0)
+    {
+        status_step = 0;
+        if (++status_repeat >= status_repeats)
+        {
+            status_repeat = 0;
+            duration += status_pattern->gap;
+        }
+    }
+    Tim_SetCompare(STATUS_TIM, STATUS_CHANNEL, ccr + duration);
+}
 
-  /*========================================
-                       I2C Slave Events (Events grouped in order of communication)
-                                                          ==========================================*/
+//-----------------------------------------------------------------------------
+// Set the output compare mode of the LED channel
+//
+inline void Status_SetMode(uint8_t mode)
+{
+    __IO uint8_t *ccmr = tim_gp_regs[STATUS_TIM].ccmr1 + STATUS_CHANNEL;
 
-  /**
-    * @brief  Communication start events
-    *
-    * Wait on one of these events at the start of the communication. It means that
-    * the I2C peripheral detected a Start condition on the bus (generated by master
-    * device) followed by the peripheral address.
-    * The peripheral generates an ACK condition on the bus (if the acknowledge
-    * feature is enabled through function I2C_AcknowledgeConfig()) and the events
-    * listed above are set :
-    *
-    * 1) In normal case (only one address managed by the slave), when the address
-    *   sent by the master matches the own address of the peripheral (configured by
-    *   I2C_OwnAddress1 field) the I2C_EVENT_SLAVE_XXX_ADDRESS_MATCHED event is set
-    *   (where XXX could be TRANSMITTER or RECEIVER).
-    *
-    * 2) In case the address sent by the master is General Call (address 0x00) and
-    *   if the General Call is enabled for the peripheral (using function I2C_GeneralCallCmd())
-    *   the following event is set I2C_EVENT_SLAVE_GENERALCALLADDRESS_MATCHED.
-    *
-    */
+    *ccmr = (*ccmr & ~TIM1_CCMR_OCxM_MASK) | mode;
+}
 
-  /* --EV1  (all the events below are variants of EV1) */
-  /* 1) Case of One Single Address managed by the slave */
-  I2C_EVENT_SLAVE_RECEIVER_ADDRESS_MATCHED    = (uint16_t)0x0202,  /*!< BUSY and ADDR flags */
-  I2C_EVENT_SLAVE_TRANSMITTER_ADDRESS_MATCHED = (uint16_t)0x0682,  /*!< TRA, BUSY, TXE and ADDR flags */
+//-----------------------------------------------------------------------------
+// Set up the timer for the status LED, leaving it off
+//
+void Status_Init(void)
+{
+    uint8_t prescaler = 0;
 
-  /* 2) Case of General Call enabled for the slave */
-  I2C_EVENT_SLAVE_GENERALCALLADDRESS_MATCHED  = (uint16_t)0x1200,  /*!< EV2: GENCALL and BUSY flags */
+    while ((SysClock_GetClockFreq() >> prescaler) > 1000)
+    {
+        ++prescaler;
+    }
+    status_pattern = NULL;
+    Tim_Init(STATUS_TIM, prescaler, 0);
+    Tim_ConfigCompare(STATUS_TIM, STATUS_CHANNEL, TIM1_CCMR_OCxM_FORCELOW, STATUS_ACTIVE_LOW, 0);
+    Tim_Enable(STATUS_TIM);
+}
 
-  /**
-    * @brief  Communication events
-    *
-    * Wait on one of these events when EV1 has already been checked :
-    *
-    * - Slave RECEIVER mode:
-    *     - EV2: When the application is expecting a data byte to be received.
-    *     - EV4: When the application is expecting the end of the communication:
-    *       master sends a stop condition and data transmission is stopped.
-    *
-    * - Slave Transmitter mode:
-    *    - EV3: When a byte has been transmitted by the slave and the application
-    *      is expecting the end of the byte transmission.
-    *      The two events I2C_EVENT_SLAVE_BYTE_TRANSMITTED and I2C_EVENT_SLAVE_BYTE_TRANSMITTING
-    *      are similar. The second one can optionally be used when the user software
-    *      doesn't guarantee the EV3 is managed before the current byte end of transfer.
-    *    - EV3_2: When the master sends a NACK in order to tell slave that data transmission
-    *      shall end (before sending the STOP condition).
-    *      In this case slave has to stop sending data bytes and expect a Stop
-    *      condition on the bus.
-    *
-    *  @note In case the  user software does not guarantee that the event EV2 is
-    *  managed before the current byte end of transfer, then user may check on EV2
-    *  and BTF flag at the same time (ie. (I2C_EVENT_SLAVE_BYTE_RECEIVED | I2C_FLAG_BTF)).
-    *  In this case the communication may be slower.
-    *
-    */
-  /* Slave RECEIVER mode --------------------------*/
-  /* --EV2 */
-  I2C_EVENT_SLAVE_BYTE_RECEIVED              = (uint16_t)0x0240,  /*!< BUSY and RXNE flags */
-  /* --EV4  */
-  I2C_EVENT_SLAVE_STOP_DETECTED              = (uint16_t)0x0010,  /*!< STOPF flag */
+//-----------------------------------------------------------------------------
+// Start showing a pattern, repeats is the number of times before the gap
+//
+void Status_Show(const status_pattern_t *pattern, uint8_t repeats) CRITICAL
+{
+    Status_SetMode(TIM1_CCMR_OCxM_FORCELOW);
+    status_pattern = pattern;
+    status_repeats = repeats ? repeats : 1;
+    status_repeat = 0;
+    status_step = 0;
 
-  /* Slave TRANSMITTER mode -----------------------*/
-  /* --EV3 */
-  I2C_EVENT_SLAVE_BYTE_TRANSMITTED           = (uint16_t)0x0684,  /*!< TRA, BUSY, TXE and BTF flags */
-  I2C_EVENT_SLAVE_BYTE_TRANSMITTING          = (uint16_t)0x0680,  /*!< TRA, BUSY and TXE flags */
-  /* --EV3_2 */
-  I2C_EVENT_SLAVE_ACK_FAILURE                = (uint16_t)0x0004  /*!< AF flag */
-} I2C_Event_TypeDef;
+    // The first toggle turns the LED on and starts the first step
+    Tim_SetCompare(STATUS_TIM, STATUS_CHANNEL, Tim_GetCounter(STATUS_TIM) + 2);
+    Tim_SetCapComInterrupt(STATUS_TIM, STATUS_CHANNEL, Status_Step);
+    Status_SetMode(TIM1_CCMR_OCxM_TOGGLE);
+}
+
+//-----------------------------------------------------------------------------
+// Turn the status LED off
+//
+void Status_Off(void) CRITICAL
+{
+    *tim_gp_regs[STATUS_TIM].ier &= ~(TIM1_IER_CC1IE_MASK << STATUS_CHANNEL);
+    Status_SetMode(TIM1_CCMR_OCxM_FORCELOW);
+    status_pattern = NULL;
+}
+#endif // FLASHER
 
+#ifdef BAM
 //=============================================================================
-// Calculate CCR values
+// Bit angle modulation functions
 //
-// This function will calculate the CCR and DUTY values for a given peripheral
-// clock frequency and requested I2C data rate. The function works by iteratively
-// going through all potential CCR/DUTY values and finding the one which is the
-// closest to the requested speed.
+// Dims LEDs on ordinary port pins. Each 8-bit level is shown one bit at a
+// time, with bit n on for a time of 2^n. So a timer interrupt is needed for
+// each bit plane, 8 per frame, with the timer period doubling each time.
 //
-// The system clock in Mhz is passed in freq and the requested speed is passed
-// in speed. The CCR & DUTY values that produce an actual speed with the smallest
-// margin of error are returned.
+// The output byte for every port is worked out for every plane when a level
+// is set, so the interrupt only does one write per port whatever the number
+// of pins. Pins on the same port that aren't used for this are left alone,
+// but as ODR is rewritten from the interrupt they shouldn't be changed from
+// the main loop with interrupts enabled.
+//
+// The frame rate is BAM_FRAME_HZ, high enough not to flicker.
+//
+
+#define BAM_TIM                     TIM_GP_2
+#define BAM_PRESCALER               4           // 1MHz ticks at 16MHz
+#define BAM_FRAME_HZ                100
+#define BAM_PLANES                  8
+#define BAM_PORTS                   4
+#define BAM_CHANNELS                16
+
+typedef struct
+{
+    stm8_gpio_t *gpio;
+    uint8_t mask;                   // Pins used on this port
+    uint8_t planes[BAM_PLANES];     // Output bits for each plane
+} bam_port_t;
+
+typedef struct
+{
+    uint8_t port;                   // Index into bam_ports
+    uint8_t pin;
+} bam_channel_t;
+
+bam_port_t bam_ports[BAM_PORTS];
+uint8_t bam_port_count;
+bam_channel_t bam_channels[BAM_CHANNELS];
+uint8_t bam_channel_count;
+uint16_t bam_base;                  // Ticks for the lowest plane
+uint8_t bam_plane;
+
+//-----------------------------------------------------------------------------
+// Show the next plane, called on the timer update event
+//
+// The update event has just loaded the period for this plane so the one for
+// the next plane is preloaded.
+//
+static void Bam_Update(void)
+{
+    bam_port_t *port = bam_ports;
+    uint8_t plane = bam_plane;
+    uint8_t i;
+
+    for (i = bam_port_count; i; --i, ++port)
+    {
+        port->gpio->ODR = (port->gpio->ODR & ~port->mask) | port->planes[plane];
+    }
+    if (++plane == BAM_PLANES)
+    {
+        plane = 0;
+    }
+    bam_plane = plane;
+    Tim_SetAutoReload(BAM_TIM, bam_base << plane);
+}
+
+//-----------------------------------------------------------------------------
+// Set up the timer, with no pins
+//
+void Bam_Init(void)
+{
+    bam_port_count = 0;
+    bam_channel_count = 0;
+    bam_plane = 0;
+    bam_base = (SysClock_GetClockFreq() >> BAM_PRESCALER) / (BAM_FRAME_HZ * 255UL);
+    if (bam_base == 0)
+    {
+        bam_base = 1;
+    }
+
+    Tim_Init(BAM_TIM, BAM_PRESCALER, bam_base);
+    Tim_SetUpdateInterrupt(BAM_TIM, Bam_Update);
+    Tim_Enable(BAM_TIM);
+}
+
+//-----------------------------------------------------------------------------
+// Add a pin, returning its channel number or 0xFF if there's no room
+//
+// The pin is made a push-pull output and starts off.
+//
+uint8_t Bam_AddPin(stm8_gpio_t *gpio, uint8_t pin)
+{
+    uint8_t port;
+    uint8_t plane;
+
+    if (bam_channel_count == BAM_CHANNELS)
+    {
+        return 0xFF;
+    }
+    for (port = 0; port < bam_port_count; ++port)
+    {
+        if (bam_ports[port].gpio == gpio)
+        {
+            break;
+        }
+    }
+    if (port == bam_port_count)
+    {
+        if (bam_port_count == BAM_PORTS)
+        {
+            return 0xFF;
+        }
+        bam_ports[port].gpio = gpio;
+        bam_ports[port].mask = 0;
+        for (plane = 0; plane < BAM_PLANES; ++plane)
+        {
+            bam_ports[port].planes[plane] = 0;
+        }
+    }
+
+    gpio->ODR &= ~pin;
+    gpio->DDR |= pin;
+    gpio->CR1 |= pin;
+
+    // The interrupt only reads these, so setting the mask before the count
+    // means it never sees a half set up port
+    bam_channels[bam_channel_count].port = port;
+    bam_channels[bam_channel_count].pin = pin;
+    bam_ports[port].mask |= pin;
+    if (port == bam_port_count)
+    {
+        ++bam_port_count;
+    }
+    return bam_channel_count++;
+}
+
+//-----------------------------------------------------------------------------
+// Set the brightness of a channel, 0-255
+//
+// Each plane byte is a single write so the interrupt never sees a half
+// updated byte.
+//
+void Bam_Set(uint8_t channel, uint8_t level)
+{
+    bam_port_t *port = &bam_ports[bam_channels[channel].port];
+    uint8_t pin = bam_channels[channel].pin;
+    uint8_t plane;
+
+    for (plane = 0; plane < BAM_PLANES; ++plane, level >>= 1)
+    {
+        if (level & 1)
+        {
+            port->planes[plane] |= pin;
+        }
+        else
+        {
+            port->planes[plane] &= ~pin;
+        }
+    }
+}
+#endif // BAM
+
+//=============================================================================
+// Beeper functions
+//
+
+typedef enum
+{
+    BEEP_8KHZ  = 0,      // 128Khz/(8*prescale) -> 500Hz to 8Khz
+    BEEP_16KHZ = 1,      // 128Khz/(4*prescale) -> 1Khz to 16Khz
+    BEEP_32KHZ = 2       // 128Khz/(2*prescale) -> 2Khz to 32Khz
+} beep_freq_t;
+
+typedef enum
+{
+    BEEP_PRESCALE_2    = 0x00,
+    BEEP_PRESCALE_3    = 0x01,
+    BEEP_PRESCALE_4    = 0x02,
+    BEEP_PRESCALE_5    = 0x03,
+    BEEP_PRESCALE_6    = 0x04,
+    BEEP_PRESCALE_7    = 0x05,
+    BEEP_PRESCALE_8    = 0x06,
+    BEEP_PRESCALE_9    = 0x07,
+    BEEP_PRESCALE_10   = 0x08,
+    BEEP_PRESCALE_11   = 0x09,
+    BEEP_PRESCALE_12   = 0x0A,
+    BEEP_PRESCALE_13   = 0x0B,
+    BEEP_PRESCALE_14   = 0x0C,
+    BEEP_PRESCALE_15   = 0x0D,
+    BEEP_PRESCALE_16   = 0x0E,
+    BEEP_PRESCALE_17   = 0x0F,
+    BEEP_PRESCALE_18   = 0x10,
+    BEEP_PRESCALE_19   = 0x11,
+    BEEP_PRESCALE_20   = 0x12,
+    BEEP_PRESCALE_21   = 0x13,
+    BEEP_PRESCALE_22   = 0x14,
+    BEEP_PRESCALE_23   = 0x15,
+    BEEP_PRESCALE_24   = 0x16,
+    BEEP_PRESCALE_25   = 0x17,
+    BEEP_PRESCALE_26   = 0x18,
+    BEEP_PRESCALE_27   = 0x19,
+    BEEP_PRESCALE_28   = 0x1A,
+    BEEP_PRESCALE_29   = 0x1B,
+    BEEP_PRESCALE_30   = 0x1C,
+    BEEP_PRESCALE_31   = 0x1D,
+    BEEP_PRESCALE_32   = 0x1E
+} beep_prescaler_t;
+
+//-----------------------------------------------------------------------------
+// Turn on beeper
+//
+inline void Beep_On(void)
+{
+    BEEP->CSR = (BEEP->CSR & ~BEEP_CSR_EN_MASK) | BEEP_CSR_EN_ENABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Turn off beeper
+//
+inline void Beep_Off(void)
+{
+    BEEP->CSR = (BEEP->CSR & ~BEEP_CSR_EN_MASK) | BEEP_CSR_EN_DISABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Toggle state of beeper
+//
+inline void Beep_Toggle(void)
+{
+    BEEP->CSR = (BEEP->CSR & ~BEEP_CSR_EN_MASK) | (~BEEP->CSR & BEEP_CSR_EN_MASK);
+}
+
+//-----------------------------------------------------------------------------
+// Set prescaler for beep
+//
+inline void Beep_SetPrescaler(beep_prescaler_t prescaler)
+{
+    BEEP->CSR = (BEEP->CSR & ~BEEP_CSR_DIV_MASK) | prescaler;
+}
+
+//-----------------------------------------------------------------------------
+// Set frequency of beep
+//
+void Beep_SetFrequency(beep_freq_t freq)
+{
+    switch (freq)
+    {
+        case BEEP_8KHZ:
+        {
+            BEEP->CSR = (BEEP->CSR & ~BEEP_CSR_SEL_MASK) | BEEP_CSR_SEL_8KHZ;
+            break;
+        }
+        case BEEP_16KHZ:
+        {
+            BEEP->CSR = (BEEP->CSR & ~BEEP_CSR_SEL_MASK) | BEEP_CSR_SEL_16KHZ;
+            break;
+        }
+        case BEEP_32KHZ:
+        {
+            BEEP->CSR = (BEEP->CSR & ~BEEP_CSR_SEL_MASK) | BEEP_CSR_SEL_32KHZ;
+            break;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Set prescaler divider based on LSI frequency
+//
+// Note on the calculation:
+//   lsi_freq is the frequency of the LSI RC clock as measured by a timer
+//
+// A is the integer part of LSIFreqkHz/4 and x the decimal part.
+// x <= A/(1+2A) is equivalent to A >= x(1+2A) and also to 4A >= 4x(1+2A) [F1]
+// but we know that A + x = LSIFreqkHz/4 ==> 4x = LSIFreqkHz-4A
+// so [F1] can be written :
+// 4A >= (LSIFreqkHz-4A)(1+2A)
+//
+void Beep_Calibrate(uint32_t lsi_freq)
+{
+    uint16_t khz;
+    uint16_t div8;
+    uint8_t div;
+
+    khz = (uint16_t)(lsi_freq / 1000);
+
+    // Calculation of BEEPER calibration value
+    div8 = khz / 8;
+    if ((8U * div8) >= ((khz - (8U * div8)) * (1U + (2U * div8))))
+    {
+        div = (uint8_t)(div8 - 2U);
+    }
+    else
+    {
+        div = (uint8_t)(div8 - 1U);
+    }
+    BEEP->CSR = (BEEP->CSR & BEEP_CSR_DIV_MASK) | div;
+}
+
+//=============================================================================
+// Auto wakeup functions
+//
+
+// High nibble is APR value, low nibble is TBR value
+typedef enum
+{
+    AWU_PERIOD_250us    = 0x0000,
+    AWU_PERIOD_500us    = 0x1E01,
+    AWU_PERIOD_1ms      = 0x1E02,
+    AWU_PERIOD_2ms      = 0x1E03,
+    AWU_PERIOD_4ms      = 0x1E04,
+    AWU_PERIOD_8ms      = 0x1E05,
+    AWU_PERIOD_16ms     = 0x1E06,
+    AWU_PERIOD_32ms     = 0x1E07,
+    AWU_PERIOD_64ms     = 0x1E08,
+    AWU_PERIOD_128ms    = 0x1E09,
+    AWU_PERIOD_256ms    = 0x1E0A,
+    AWU_PERIOD_512ms    = 0x1E0B,
+    AWU_PERIOD_1s       = 0x3D0C,
+    AWU_PERIOD_2s       = 0x170C,
+    AWU_PERIOD_12s      = 0x170F,
+    AWU_PERIOD_30s      = 0x3E0F
+} awu_period_t;
+
+//-----------------------------------------------------------------------------
+// Set the period for auto wakeup
+//
+void Awu_SetPeriod(uint8_t tbr, uint8_t apr)
+{
+    AWU->CSR = (AWU->CSR & ~AWU_CSR_AWEN_MASK) | AWU_CSR_AWEN_ENABLE;
+    AWU->TBR = (AWU->TBR & ~AWU_TBR_MASK) | tbr;
+    AWU->APR = (AWU->APR & ~AWU_APR_DIV_MASK) | apr;
+}
+
+//-----------------------------------------------------------------------------
+// Set the period for auto wakeup
+//
+// Sample period have been predefined in the awu_period_t enum
+//
+void Awu_SetPresetPeriod(awu_period_t period)
+{
+    Awu_SetPeriod((period >> 0) & 0xFF, (period >> 8) & 0xFF);
+}
+
+//-----------------------------------------------------------------------------
+// Set the idle mode
+//
+void Awu_SetIdleMode(void)
+{
+    AWU->CSR = (AWU->CSR & ~AWU_CSR_AWEN_MASK) | AWU_CSR_AWEN_DISABLE;
+    AWU->TBR = (AWU->TBR & ~AWU_TBR_MASK) | AWU_TBR_NONE;
+}
+
+//-----------------------------------------------------------------------------
+// Disable the auto wakeup functionality
+//
+void Awu_Disable(void)
+{
+    AWU->CSR = (AWU->CSR & ~AWU_CSR_AWEN_MASK) | AWU_CSR_AWEN_DISABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Enable the auto wakeup functionality
+//
+void Awu_Enable(void)
+{
+    AWU->CSR = (AWU->CSR & ~ AWU_CSR_AWEN_MASK) | AWU_CSR_AWEN_ENABLE;
+}
+
+
+//-----------------------------------------------------------------------------
+//  Measure the LSI frequency using timer IC1 and update the calibration registers.
+//
+//   It is recommended to use a timer clock frequency of at least 10MHz in order
+//   to obtain a better in the LSI frequency measurement.
+//
+// Two capture samples are taken from the timer and used to calculate the LSI's
+// frequency. Returns 0 if the captures time out.
+//
+uint32_t AWU_MeasureLSI(void)
+{
+    uint32_t lsi_freq_hz = 0;
+    uint32_t fmaster;
+    uint16_t ICValue1;
+    uint16_t ICValue2;
+
+    // Get master frequency
+    fmaster = SysClock_GetClockFreq();
+
+    // Enable the LSI measurement: LSI clock connected to timer Input Capture 1
+    AWU->CSR = (AWU->CSR & ~ AWU_CSR_MSR_MASK) | AWU_CSR_MSR_ENABLE;
+
+    // Measure the LSI frequency with TIMER Input Capture 1
+    // Capture only every 8 events!!!
+    // Enable capture of TI1
+    Tim1_ConfigCapture1(TIM1_ICPOL_RISING, TIM1_ICFILT_NONE);
+    Tim1_SetCapturePrescaler(TIM1_ICPSC_DIV8);
+
+    // TIM1_ICInit(TIM1_CHANNEL_1, TIM1_ICPOLARITY_RISING, TIM1_ICSELECTION_DIRECTTI, TIM1_ICPSC_DIV8, 0);
+
+    Tim1_Enable();
+
+    // Capture two samples, giving up if the LSI isn't reaching the timer
+    if (Tim1_WaitCapture1())
+    {
+        ICValue1 = Tim1_GetCapture1Time();
+        Tim1_ClearCapture1();
+        if (Tim1_WaitCapture1())
+        {
+            ICValue2 = Tim1_GetCapture1Time();
+            Tim1_ClearCapture1();
+
+            // Compute LSI clock frequency
+            lsi_freq_hz = (8 * fmaster) / (uint16_t)(ICValue2 - ICValue1);
+        }
+    }
+
+    Tim1_DisableCapture1();
+    Tim1_Disable();
+
+    // Disable the LSI measurement: LSI clock disconnected from timer Input Capture 1
+    AWU->CSR = (AWU->CSR & ~AWU_CSR_MSR_MASK) | AWU_CSR_MSR_DISABLE;
+
+    return lsi_freq_hz;
+}
+
+//=============================================================================
+// Watchdog functions
+//
+//
+typedef enum
+{
+    IWDG_PERIOD_16MS    = 0x00,     // 15.9ms with RL of 0xFF
+    IWDG_PERIOD_32MS    = 0x01,     // 31.9ms with RL of 0xFF
+    IWDG_PERIOD_63MS    = 0x02,     // 63.7ms with RL of 0xFF
+    IWDG_PERIOD_127MS   = 0x03,     // 127ms with RL of 0xFF
+    IWDG_PERIOD_255MS   = 0x04,     // 255ms with RL of 0xFF
+    IWDG_PERIOD_510MS   = 0x05,     // 510ms with RL of 0xFF
+    IWDG_PERIOD_1S      = 0x06      // 1.02s with RL of 0xFF
+} iwdg_period_t;
+
+//-----------------------------------------------------------------------------
+// Initialise the independent watchdog
+//
+void Iwdg_Init(iwdg_period_t period)
+{
+    IWDG->KR = IWDG_KR_KEY_ACCESS;
+    IWDG->PR = (IWDG->PR & ~IWDG_PR_PR_MASK) | period;
+    IWDG->RLR = 0xFF;
+    IWDG->KR = IWDG_KR_KEY_ENABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Refresh the reload register (feed the dog)
+//
+void Iwdg_Refresh(void)
+{
+    IWDG->KR = IWDG_KR_KEY_REFRESH;
+}
+
+//-----------------------------------------------------------------------------
+// Initialise the window watchdog
+//
+void Wwdg_Init(void)
+{
+    WWDG->CR = (WWDG->CR & ~(WWDG_CR_WDGA_MASK | WWDG_CR_T_MASK)) | WWDG_CR_WDGA_ENABLE | WWDG_CR_T_MAX;
+}
+
+//-----------------------------------------------------------------------------
+// Refresh the downcounter register (feed the dog)
+//
+void Wwdg_Refresh(void)
+{
+    WWDG->CR = WWDG_CR_T_MAX;
+}
+
+//-----------------------------------------------------------------------------
+// Return the period between refreshes before a reset occurs
+//
+uint16_t Wwdg_Period(void)
+{
+    uint16_t period = SysClock_GetClockFreq() * 12288;
+    return (period * WWDG_CR_T_MAX) - (period * WWDG_CR_T_MIN);
+}
+
+
+#ifdef DEBOUNCE
+//=============================================================================
+// Debounce functions
+//
+// Pushbuttons and switches are sampled a whole port at a time from the system
+// tick interrupt. Each pin has a two bit vertical counter, the bits for eight
+// pins being held in two bytes, so debouncing a port takes the same handful of
+// byte operations whether one pin or eight are used. A pin's state changes
+// after it has read the same for four samples in a row.
+//
+// How long a pin has been held is counted in the same way with a
+// DEBOUNCE_HOLD_BITS deep vertical counter. When that overflows a long press
+// is reported, once, until the pin is released.
+//
+// Press, release and long press events are latched until read. States and
+// events are 1 for pressed, whichever level the pin is active at.
+//
+// With an interval of 5ms a pin is debounced in 20ms and a long press is
+// 2^DEBOUNCE_HOLD_BITS intervals, 640ms.
+//
+
+#define DEBOUNCE_PORTS              3
+#define DEBOUNCE_HOLD_BITS          7
+
+typedef enum
+{
+    DEBOUNCE_PRESS,
+    DEBOUNCE_RELEASE,
+    DEBOUNCE_LONG_PRESS,
+    DEBOUNCE_EVENTS
+} debounce_event_t;
+
+typedef struct
+{
+    stm8_gpio_t *gpio;
+    uint8_t mask;                   // Pins being debounced
+    uint8_t active_low;             // Pins that are pressed when low
+    uint8_t state;                  // Debounced state
+    uint8_t count0;                 // Vertical debounce counter
+    uint8_t count1;
+    uint8_t hold[DEBOUNCE_HOLD_BITS];   // Vertical hold counter
+    uint8_t long_done;              // Pins that have reported a long press
+    uint8_t events[DEBOUNCE_EVENTS];
+} debounce_port_t;
+
+debounce_port_t debounce_ports[DEBOUNCE_PORTS];
+uint8_t debounce_port_count;
+uint8_t debounce_interval;
+uint8_t debounce_ticks;
+
+//-----------------------------------------------------------------------------
+// Initialise
+//
+// The ports are sampled every interval system ticks.
+//
+void Debounce_Init(uint8_t interval)
+{
+    debounce_port_count = 0;
+    debounce_ticks = 0;
+    debounce_interval = interval;
+}
+
+//-----------------------------------------------------------------------------
+// Add pins on a port to be debounced
+//
+// The pins are made inputs, the active low ones with their pull ups enabled.
+// The current levels are taken as the starting state so nothing is reported
+// for pins held at start up.
+//
+// Returns the port's index for reading the events or 0xFF if there's no room.
+//
+uint8_t Debounce_AddPort(stm8_gpio_t *gpio, uint8_t pins, uint8_t active_low) CRITICAL
+{
+    debounce_port_t *port;
+    uint8_t bit;
+
+    if (debounce_port_count == DEBOUNCE_PORTS)
+    {
+        return 0xFF;
+    }
+
+    active_low &= pins;
+    gpio->DDR &= ~pins;
+    gpio->CR1 = (gpio->CR1 & ~pins) | active_low;
+
+    port = &debounce_ports[debounce_port_count];
+    port->gpio = gpio;
+    port->mask = pins;
+    port->active_low = active_low;
+    port->state = (gpio->IDR ^ active_low) & pins;
+    port->count0 = 0xFF;
+    port->count1 = 0xFF;
+    for (bit = 0; bit < DEBOUNCE_HOLD_BITS; ++bit)
+    {
+        port->hold[bit] = 0;
+    }
+    port->long_done = port->state;
+    for (bit = 0; bit < DEBOUNCE_EVENTS; ++bit)
+    {
+        port->events[bit] = 0;
+    }
+
+    return debounce_port_count++;
+}
+
+//-----------------------------------------------------------------------------
+// Sample and debounce all the ports
+//
+// Called from the system tick interrupt.
+//
+static void Debounce_Sample(void)
+{
+    debounce_port_t *port;
+    uint8_t index;
+    uint8_t changed;
+    uint8_t carry;
+    uint8_t overflow;
+    uint8_t bit;
+
+    if (++debounce_ticks < debounce_interval)
+    {
+        return;
+    }
+    debounce_ticks = 0;
+
+    for (index = 0; index < debounce_port_count; ++index)
+    {
+        port = &debounce_ports[index];
+
+        // Counters are held at 3 while a pin reads the same as its state and
+        // count down while it differs, the state flips when they wrap
+        changed = ((port->gpio->IDR ^ port->active_low) & port->mask) ^ port->state;
+        port->count0 = ~(port->count0 & changed);
+        port->count1 = port->count0 ^ (port->count1 & changed);
+        changed &= port->count0 & port->count1;
+        port->state ^= changed;
+
+        port->events[DEBOUNCE_PRESS] |= changed & port->state;
+        port->events[DEBOUNCE_RELEASE] |= changed & ~port->state;
+
+        // Count up while pressed, clear on release
+        carry = port->state & ~port->long_done;
+        for (bit = 0; bit < DEBOUNCE_HOLD_BITS; ++bit)
+        {
+            overflow = port->hold[bit] & carry;
+            port->hold[bit] = (port->hold[bit] ^ carry) & port->state;
+            carry = overflow;
+        }
+        port->events[DEBOUNCE_LONG_PRESS] |= carry;
+        port->long_done = (port->long_done | carry) & port->state;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Return the debounced state of a port's pins, 1 is pressed
+//
+uint8_t Debounce_GetState(uint8_t index)
+{
+    return debounce_ports[index].state;
+}
+
+//-----------------------------------------------------------------------------
+// Return and clear the pins of a port that have had an event
+//
+uint8_t Debounce_GetEvents(uint8_t index, debounce_event_t event) CRITICAL
+{
+    uint8_t pins = debounce_ports[index].events[event];
+    debounce_ports[index].events[event] = 0;
+    return pins;
+}
+#endif // DEBOUNCE
+
+//=============================================================================
+// System Tick functions
+//
+// The system tick is a 1ms timer. It uses the basic 8-bit timer TIM4. Counter
+// is 16 bit so maximum period of time that can be handled is 65s.
+//
+
+__IO uint16_t systick;
+
+//-----------------------------------------------------------------------------
+// Initialise
+//
+// Setup 8-bit basic timer as 1ms system tick using interrupts to update the tick counter
+//
+void Systick_Init(void)
+{
+    Tim4_Config1ms();
+}
+
+//-----------------------------------------------------------------------------
+// Check if a period has passed since the start time.
+//
+// If the timeout has expired, the start value is reset to the current time
+// so that it can be reused.
+//
+bool Systick_Timeout(uint16_t *start, uint16_t period)
+{
+    if (systick - *start >= period)
+    {
+        *start = systick;
+        return true;
+    }
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+// Wait a period of time
+//
+void Systick_Wait(uint16_t period)
+{
+    uint16_t start = systick;
+    while (!Systick_Timeout(&start, period))
+    {
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Interrupt handler for the system tick counter
+//
+#if defined __IAR_SYSTEMS_ICC__
+#pragma vector=23
+#endif
+INTERRUPT(TIM4_UPD_OVF_IRQHandler, 23)
+{
+    ++systick;
+
+#ifdef DEBOUNCE
+    if (debounce_port_count)
+    {
+        Debounce_Sample();
+    }
+#endif // DEBOUNCE
+
+    // Clear Interrupt Pending bit
+    TIM4->SR1 = (TIM4->SR1 & ~TIM4_SR1_UIF_MASK) | TIM4_SR1_UIF_CLEAR;
+}
+
+
+#ifdef CAPTURE
+//=============================================================================
+// Capture functions
+//
+// Interrupt driven measurement of the period, and optionally the duty, of a
+// signal on a TIM2 or TIM3 channel. The engine takes over the update and
+// capture/compare interrupts of a timer it's used on; the other channels of
+// that timer can still be used for capture.
+//
+// Timestamps are extended to 32 bits by counting timer overflows, so periods
+// can be much longer than the 16-bit counter. Each result is the average
+// over a number of periods. If no edge arrives within the timeout the signal
+// is reported lost, eg. a stopped fan or no flow.
+//
+// For the duty both edges are captured by swapping the channel's polarity
+// after each one, so it's for signals of up to a few kHz.
+//
+// Results are fixed point:
+//  period     Q24.8 timer ticks
+//  frequency  Q16.16 Hz
+//  duty       Q0.16, 0xFFFF is 100%
+//
+
+#define CAPTURE_DUTY                ((uint8_t)0x01)     // Measure the high time too
+#define CAPTURE_FALLING             ((uint8_t)0x02)     // Period from falling edges, duty is the low time
+
+typedef enum
+{
+    CAPTURE_OK,
+    CAPTURE_PENDING,        // Not enough periods yet
+    CAPTURE_TIMEOUT         // No edges within the timeout
+} capture_status_t;
+
+typedef struct
+{
+    uint32_t period;        // Q24.8 timer ticks
+    uint32_t frequency;     // Q16.16 Hz, 0xFFFFFFFF if 65536Hz or more
+    uint16_t duty;          // Q0.16, only with CAPTURE_DUTY
+} capture_result_t;
+
+typedef struct
+{
+    tim_gp_t tim;
+    tim1_channel_t channel;
+    uint8_t flags;
+    uint8_t average;        // Number of periods to average
+    uint16_t timeout;       // ms
+
+    // Updated by the interrupt
+    bool started;           // Seen the first period edge
+    bool high;              // Waiting for the end of the high time
+    uint32_t rise;          // Last period edge
+    uint32_t fall;          // Last opposite edge
+    uint32_t period_acc;
+    uint32_t high_acc;
+    uint8_t count;
+    uint16_t edge_ms;       // systick at the last edge
+
+    // Last complete result
+    uint32_t period_sum;
+    uint32_t high_sum;
+    uint8_t periods;
+    bool ready;
+} capture_t;
+
+capture_t *capture_channels[2][3];
+__IO uint16_t capture_overflows[2];
+uint8_t capture_prescaler[2];
+
+//-----------------------------------------------------------------------------
+// Divide giving a fixed point result with frac fractional bits
+//
+// Saturates at 0xFFFFFFFF if the result doesn't fit in 32 bits. Avoids
+// needing 64-bit arithmetic.
+//
+static uint32_t Capture_FixedDivide(uint32_t num, uint32_t den, uint8_t frac)
+{
+    uint32_t q = num / den;
+    uint32_t r = num % den;
+
+    while (frac--)
+    {
+        bool carry = (r & 0x80000000UL) != 0;
+
+        if (q & 0x80000000UL)
+        {
+            return 0xFFFFFFFFUL;
+        }
+        q <<= 1;
+        r <<= 1;
+        if (carry || r >= den)
+        {
+            r -= den;
+            q |= 1;
+        }
+    }
+    return q;
+}
+
+//-----------------------------------------------------------------------------
+// Handle an edge on a channel
+//
+static void Capture_Edge(tim_gp_t tim, tim1_channel_t channel, uint16_t ccr)
+{
+    capture_t *cap = capture_channels[tim][channel];
+    uint16_t overflows = capture_overflows[tim];
+    uint32_t time;
+
+    if (!cap)
+    {
+        return;
+    }
+
+    // An overflow just before the capture may not have been counted yet
+    if ((*tim_gp_regs[tim].sr1 & TIM1_SR1_UIF_MASK) && (ccr < 0x8000))
+    {
+        ++overflows;
+    }
+    time = ((uint32_t)overflows << 16) | ccr;
+    cap->edge_ms = systick;
+
+    if (cap->flags & CAPTURE_DUTY)
+    {
+        // Swap to the other edge
+        tim_gp_regs[tim].ccer1[channel >> 1] ^= TIM1_CCER1_CC1P_MASK << ((channel & 1) << 2);
+        if (cap->high)
+        {
+            cap->high = false;
+            cap->fall = time;
+            return;
+        }
+        cap->high = true;
+    }
+
+    if (cap->started)
+    {
+        cap->period_acc += time - cap->rise;
+        cap->high_acc += cap->fall - cap->rise;
+        if (++cap->count >= cap->average)
+        {
+            cap->period_sum = cap->period_acc;
+            cap->high_sum = cap->high_acc;
+            cap->periods = cap->count;
+            cap->ready = true;
+            cap->period_acc = 0;
+            cap->high_acc = 0;
+            cap->count = 0;
+        }
+    }
+    cap->started = true;
+    cap->rise = time;
+}
+
+//-----------------------------------------------------------------------------
+// Timer callbacks
+//
+static void Capture_Tim2Overflow(void)
+{
+    ++capture_overflows[TIM_GP_2];
+}
+
+static void Capture_Tim3Overflow(void)
+{
+    ++capture_overflows[TIM_GP_3];
+}
+
+static void Capture_Tim2Edge(tim1_channel_t channel, uint16_t ccr)
+{
+    Capture_Edge(TIM_GP_2, channel, ccr);
+}
+
+static void Capture_Tim3Edge(tim1_channel_t channel, uint16_t ccr)
+{
+    Capture_Edge(TIM_GP_3, channel, ccr);
+}
+
+//-----------------------------------------------------------------------------
+// Set up a timer for capturing
+//
+// The timer counts at fMASTER / 2^prescaler. Pick it so a period to measure
+// is a reasonable number of ticks; too many and the Q24.8 period overflows
+// after 2^24 ticks.
+//
+void Capture_InitTimer(tim_gp_t tim, uint8_t prescaler)
+{
+    uint8_t ch;
+
+    for (ch = 0; ch < 3; ++ch)
+    {
+        capture_channels[tim][ch] = NULL;
+    }
+    capture_overflows[tim] = 0;
+    capture_prescaler[tim] = prescaler;
+
+    Tim_Init(tim, prescaler, 0);
+    Tim_SetUpdateInterrupt(tim, (tim == TIM_GP_2) ? Capture_Tim2Overflow : Capture_Tim3Overflow);
+    Tim_Enable(tim);
+}
+
+//-----------------------------------------------------------------------------
+// Start measuring on a channel
+//
+// average is the number of periods in each result, timeout is in ms.
+//
+void Capture_Start(capture_t *cap, tim_gp_t tim, tim1_channel_t channel, tim1_ic_filter_t filter,
+                   uint8_t flags, uint8_t average, uint16_t timeout)
+{
+    cap->tim = tim;
+    cap->channel = channel;
+    cap->flags = flags;
+    cap->average = average ? average : 1;
+    cap->timeout = timeout;
+    cap->started = false;
+    cap->high = false;
+    cap->period_acc = 0;
+    cap->high_acc = 0;
+    cap->count = 0;
+    cap->edge_ms = systick;
+    cap->ready = false;
+
+    capture_channels[tim][channel] = cap;
+    Tim_ConfigCapture(tim, channel, (flags & CAPTURE_FALLING) ? TIM1_ICPOL_FALLING : TIM1_ICPOL_RISING,
+                      filter, TIM1_ICPSC_DIV1);
+    Tim_SetCapComInterrupt(tim, channel, (tim == TIM_GP_2) ? Capture_Tim2Edge : Capture_Tim3Edge);
+}
+
+//-----------------------------------------------------------------------------
+// Stop measuring on a channel
+//
+void Capture_Stop(capture_t *cap)
+{
+    Tim_DisableChannel(cap->tim, cap->channel);
+    capture_channels[cap->tim][cap->channel] = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Take the last result from the interrupt
+//
+// On a timeout the measurement starts again from the next edge.
+//
+static capture_status_t Capture_Take(capture_t *cap, uint32_t *period_sum, uint32_t *high_sum, uint8_t *periods) CRITICAL
+{
+    if ((uint16_t)(systick - cap->edge_ms) > cap->timeout)
+    {
+        cap->started = false;
+        cap->period_acc = 0;
+        cap->high_acc = 0;
+        cap->count = 0;
+        cap->ready = false;
+        if (cap->flags & CAPTURE_DUTY)
+        {
+            // Back to waiting for a period edge
+            if (cap->high)
+            {
+                tim_gp_regs[cap->tim].ccer1[cap->channel >> 1] ^= TIM1_CCER1_CC1P_MASK << ((cap->channel & 1) << 2);
+                cap->high = false;
+            }
+        }
+        return CAPTURE_TIMEOUT;
+    }
+    if (!cap->ready)
+    {
+        return CAPTURE_PENDING;
+    }
+    *period_sum = cap->period_sum;
+    *high_sum = cap->high_sum;
+    *periods = cap->periods;
+    return CAPTURE_OK;
+}
+
+//-----------------------------------------------------------------------------
+// Read the latest measurement
+//
+// The result is only filled in if CAPTURE_OK is returned. The same result
+// is returned until the next set of periods is complete.
+//
+capture_status_t Capture_Read(capture_t *cap, capture_result_t *result)
+{
+    uint32_t period_sum;
+    uint32_t high_sum;
+    uint8_t periods;
+    uint32_t duty;
+    capture_status_t status = Capture_Take(cap, &period_sum, &high_sum, &periods);
+
+    if (status != CAPTURE_OK)
+    {
+        return status;
+    }
+
+    result->period = Capture_FixedDivide(period_sum, periods, 8);
+    result->frequency = result->period ? Capture_FixedDivide(SysClock_GetClockFreq() >> capture_prescaler[cap->tim], result->period, 24) : 0;
+    result->duty = 0;
+    if ((cap->flags & CAPTURE_DUTY) && period_sum)
+    {
+        duty = Capture_FixedDivide(high_sum, period_sum, 16);
+        result->duty = (duty > 0xFFFF) ? 0xFFFF : (uint16_t)duty;
+    }
+    return CAPTURE_OK;
+}
+
+#endif // CAPTURE
+
+#ifdef ENCODER
+//=============================================================================
+// Encoder functions
+//
+// Quadrature encoder on TIM1 channels 1 and 2 (PC1 and PC2). The encoder
+// mode of the slave controller counts every edge of both inputs up or down,
+// so the counting is all in hardware and no steps are missed. The update
+// interrupt extends the count to 32 bits on each wrap; the counting
+// direction at the time says whether it wrapped up or down.
+//
+// Velocity is worked out from the change in position over a window of ms.
+//
+
+int16_t encoder_high;
+uint16_t encoder_window;
+uint16_t encoder_last_ms;
+int32_t encoder_last_position;
+int32_t encoder_velocity;
+
+//-----------------------------------------------------------------------------
+// Extend the count on a wrap, called on the TIM1 update event
+//
+// The direction is taken from which side of the wrap the counter is now, as
+// in Encoder_GetPosition. DIR only says which way it last counted, which is
+// wrong if the shaft reversed between the wrap and the interrupt.
+//
+static void Encoder_Wrap(void)
+{
+    uint16_t count = (TIM1->CNTRH << 8);
+
+    count |= TIM1->CNTRL;
+    if (count < 0x8000)
+    {
+        ++encoder_high;
+    }
+    else
+    {
+        --encoder_high;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Start the encoder interface
+//
+// The filter removes contact bounce, window is the velocity window in ms.
+//
+void Encoder_Init(tim1_ic_filter_t filter, uint16_t window)
+{
+    Tim1_Disable();
+    TIM1->IER = 0;
+    TIM1->CCER1 = 0;
+    TIM1->CCER2 = 0;
+    Tim1_SetPrescaler(1);
+    Tim1_SetAutoReload(0);          // Full 65536 count
+    TIM1->RCR = 0;
+    TIM1->CR1 = (TIM1->CR1 & ~(TIM1_CR1_CMS_MASK | TIM1_CR1_URS_MASK | TIM1_CR1_UDIS_MASK)) |
+                TIM1_CR1_CMS_EDGE | TIM1_CR1_URS_UPDATE | TIM1_CR1_UDIS_DISABLE;
+
+    // TI1FP1 and TI2FP2, not inverted
+    Tim_ConfigChannel(&TIM1->CCMR1, &TIM1->CCER1, TIM1_CHANNEL_1,
+                      TIM1_CCMR_CCxS_IN_TI1FP1 | filter, TIM1_CCER1_CC1E_ENABLE | TIM1_CCER1_CC1P_RISING);
+    Tim_ConfigChannel(&TIM1->CCMR1, &TIM1->CCER1, TIM1_CHANNEL_2,
+                      TIM1_CCMR_CCxS_IN_TI2FP2 | filter, TIM1_CCER1_CC1E_ENABLE | TIM1_CCER1_CC1P_RISING);
+
+    // Count on both edges of both inputs
+    TIM1->SMCR = (TIM1->SMCR & ~(TIM1_SMCR_TS_MASK | TIM1_SMCR_SMS_MASK)) | TIM1_SMCR_SMS_ENCODER3;
+
+    TIM1->EGR = TIM1_EGR_UG_ENABLE;
+    Tim1_SetCounter(0);
+    encoder_high = 0;
+    encoder_window = window;
+    encoder_last_ms = systick;
+    encoder_last_position = 0;
+    encoder_velocity = 0;
+    Tim1_SetUpdateInterrupt(Encoder_Wrap);
+    Tim1_Enable();
+}
+
+//-----------------------------------------------------------------------------
+// Get the position in counts, 4 per encoder cycle
+//
+// If the counter has wrapped but the interrupt hasn't run yet, the counter
+// is read again after the wrap and its value shows which way it went.
+//
+int32_t Encoder_GetPosition(void) CRITICAL
+{
+    int16_t high = encoder_high;
+    uint16_t count = (TIM1->CNTRH << 8);
+
+    count |= TIM1->CNTRL;
+    if ((TIM1->SR1 & TIM1_SR1_UIF_MASK) == TIM1_SR1_UIF_PENDING)
+    {
+        count = (TIM1->CNTRH << 8);
+        count |= TIM1->CNTRL;
+        high += (count < 0x8000) ? 1 : -1;
+    }
+    return ((int32_t)high << 16) | count;
+}
+
+//-----------------------------------------------------------------------------
+// Set the position
+//
+void Encoder_SetPosition(int32_t position)
+{
+    Tim1_Disable();
+    Tim1_SetCounter((uint16_t)position);
+    TIM1->SR1 = (uint8_t)~TIM1_SR1_UIF_MASK;
+    encoder_high = (int16_t)(position >> 16);
+    encoder_last_position = position;
+    encoder_velocity = 0;
+    Tim1_Enable();
+}
+
+//-----------------------------------------------------------------------------
+// Get the velocity in counts per second
+//
+// The velocity is recalculated when a window has passed, so this should be
+// called at least that often.
+//
+int32_t Encoder_GetVelocity(void)
+{
+    uint16_t elapsed = systick - encoder_last_ms;
+
+    if (elapsed >= encoder_window)
+    {
+        int32_t position = Encoder_GetPosition();
+
+        encoder_velocity = ((position - encoder_last_position) * 1000) / elapsed;
+        encoder_last_position = position;
+        encoder_last_ms += elapsed;
+    }
+    return encoder_velocity;
+}
+#endif // ENCODER
+
+#ifdef ADCSCAN
+//=============================================================================
+// ADC functions
+//
+// ADC1 is used in scan mode, converting channels 0 up to a last channel one
+// after another into its data buffer. Each scan is started by TIM1's TRGO,
+// set to the update event, so the sample rate is exactly the timer's and
+// doesn't suffer from interrupt latency. The end of conversion interrupt comes
+// once per scan and hands the whole set of channels to a callback.
+//
+// This uses TIM1's time base, so can't be used at the same time as TIM1
+// capture, PWM input or the encoder. TIM1 PWM outputs can still be used as
+// they share the same period.
+//
+// The ADC clock is kept to 4MHz or less, a conversion is 14 ADC clocks, so a
+// scan of all 10 channels takes 35us at best.
+//
+
+#define ADC_MAX_HZ                  4000000
+#define ADC_STABILISE_US            7
+
+typedef void (*adc_scan_cb_t)(const uint16_t *values, uint8_t count);
+
+uint16_t adc_values[ADC1_BUFFER_CHANNELS];
+uint8_t adc_channels;
+adc_scan_cb_t adc_scan_cb;
+__IO uint16_t adc_scans;            // Completed scans, wraps
+__IO uint8_t adc_overruns;          // Scans lost because the buffer wasn't read in time
+
+//-----------------------------------------------------------------------------
+// Initialise for scanning channels 0 to last
+//
+// schmitt is a bit mask of the channels to disable the Schmitt trigger on,
+// which should be all the analog inputs. The callback is called from the
+// interrupt after each scan with the right aligned results. Returns false
+// if last is past the data buffer, which only has room for channels 0 to 9.
+//
+bool ADC_InitScan(uint8_t last, uint16_t schmitt, adc_scan_cb_t cb)
+{
+    static const uint8_t divider[] = { 2, 3, 4, 6, 8, 10, 12, 18 };
+    uint32_t clock = SysClock_GetClockFreq();
+    uint8_t spsel = 0;
+
+    if (last >= ADC1_BUFFER_CHANNELS)
+    {
+        return false;
+    }
+
+    while ((spsel < 7) && ((clock / divider[spsel]) > ADC_MAX_HZ))
+    {
+        ++spsel;
+    }
+
+    CLK->PCKENR2 |= CLK_PCKENR2_ADC;
+    ADC1->CR1 = ADC1_CR1_ADON_OFF;
+    ADC1->CSR = ADC1_CSR_EOC_CLEAR | ADC1_CSR_EOCIE_DISABLE | last;
+    ADC1->CR1 = (spsel << ADC1_CR1_SPSEL_SHIFT) | ADC1_CR1_CONT_SINGLE;
+    ADC1->CR2 = ADC1_CR2_EXTTRIG_DISABLE | ADC1_CR2_ALIGN_RIGHT | ADC1_CR2_SCAN_ENABLE;
+    ADC1->CR3 = 0;
+    ADC1->TDRH = (schmitt >> 8) & 0xFF;
+    ADC1->TDRL = (schmitt >> 0) & 0xFF;
+
+    adc_channels = last + 1;
+    adc_scan_cb = cb;
+    adc_scans = 0;
+    adc_overruns = 0;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Start scanning from TIM1
+//
+// A scan is started every prescaler * period master clocks. The first setting
+// of ADON only powers up the ADC, the conversions wait for the trigger.
+//
+void ADC_StartTriggered(uint16_t prescaler, uint16_t period)
+{
+    Tim1_InitPWM(prescaler, period);
+    TIM1->CR2 = (TIM1->CR2 & ~TIM1_CR2_MMS_MASK) | TIM1_CR2_MMS_UPDATE;
+
+    ADC1->CR1 |= ADC1_CR1_ADON_ON;
+    Delay_Us(ADC_STABILISE_US);
+    ADC1->CR2 = (ADC1->CR2 & ~(ADC1_CR2_EXTTRIG_MASK | ADC1_CR2_EXTSEL_MASK)) |
+                ADC1_CR2_EXTTRIG_ENABLE | ADC1_CR2_EXTSEL_TIM1_TRGO;
+    ADC1->CSR = (ADC1->CSR & ~(ADC1_CSR_EOC_MASK | ADC1_CSR_EOCIE_MASK)) | ADC1_CSR_EOCIE_ENABLE;
+
+    Tim1_Enable();
+}
+
+//-----------------------------------------------------------------------------
+// Stop scanning and power down the ADC
+//
+void ADC_Stop(void)
+{
+    Tim1_Disable();
+    TIM1->CR2 = (TIM1->CR2 & ~TIM1_CR2_MMS_MASK) | TIM1_CR2_MMS_RESET;
+    ADC1->CSR &= ~ADC1_CSR_EOCIE_MASK;
+    ADC1->CR2 &= ~ADC1_CR2_EXTTRIG_MASK;
+    ADC1->CR1 &= ~ADC1_CR1_ADON_MASK;
+}
+
+//-----------------------------------------------------------------------------
+// Return and clear the number of overruns
+//
+uint8_t ADC_TakeOverruns(void) CRITICAL
+{
+    uint8_t overruns = adc_overruns;
+    adc_overruns = 0;
+    return overruns;
+}
+
+//-----------------------------------------------------------------------------
+// Interrupt handler
+//
+// Copies the buffer out so the next scan can start, then passes it on. With
+// right alignment the low byte must be read before the high byte.
+//
+#if defined __IAR_SYSTEMS_ICC__
+#pragma vector=22
+#endif
+INTERRUPT(ADC1_IRQHandler, 22)
+{
+    __IO uint8_t *dbr = ADC1_BUFFER->DBR;
+    uint8_t channel;
+    uint8_t low;
+
+    ADC1->CSR &= ~ADC1_CSR_EOC_MASK;
+    for (channel = 0; channel < adc_channels; ++channel)
+    {
+        low = dbr[1];
+        adc_values[channel] = ((uint16_t)dbr[0] << 8) | low;
+        dbr += 2;
+    }
+    if (ADC1->CR3 & ADC1_CR3_OVR_MASK)
+    {
+        ADC1->CR3 &= ~ADC1_CR3_OVR_MASK;
+        ++adc_overruns;
+    }
+    ++adc_scans;
+
+    if (adc_scan_cb)
+    {
+        adc_scan_cb(adc_values, adc_channels);
+    }
+}
+#endif // ADCSCAN
+
+#ifdef PIPELINE
+//=============================================================================
+// Sampling pipeline functions
+//
+// Sits between the ADC scan interrupt and the application. For each channel:
+//
+//  oversample  4^n scans are summed and decimated by 2^n, giving n extra bits
+//              (n up to 3, the same for all channels)
+//  calibrate   (x - offset) * gain, gain is Q8.8
+//  average     Moving average over 2^n outputs (n up to 3)
+//  filter      First order IIR, y += (x - y) / 2^n (0 is off), which settles
+//              to within 2^n of the input
+//
+// Values are scaled to 16 bits full scale after oversampling, so each stage
+// works in the same units whatever the oversampling and there's room for
+// the filter's fraction.
+//
+// Results go into one of two snapshots, the other being the one the main
+// loop reads. Pipeline_Read copies the latest and checks the sequence number
+// didn't change while it did, so there's no need to disable interrupts.
+//
+// Only shifts, adds and 8x8 multiplies are used, SDCC does the multiplies
+// with MUL rather than calling its 16 or 32 bit multiply.
+//
+
+#define PIPELINE_OVERSAMPLE_MAX     3
+#define PIPELINE_AVERAGE_MAX        3
+#define PIPELINE_GAIN_ONE           0x0100
+
+typedef struct
+{
+    uint16_t offset;                // Subtracted, 16 bit full scale
+    uint16_t gain;                  // Q8.8
+    uint8_t average_bits;           // Moving average of 2^n
+    uint8_t iir_shift;              // IIR coefficient 1/2^n, 0 is off
+} pipeline_channel_t;
+
+typedef struct
+{
+    uint16_t sum;                   // Oversampling accumulator
+    uint16_t history[1 << PIPELINE_AVERAGE_MAX];
+    uint32_t history_sum;
+    uint8_t history_index;
+    uint16_t iir;
+    bool iir_primed;
+} pipeline_state_t;
+
+typedef struct
+{
+    uint16_t values[ADC1_BUFFER_CHANNELS];
+} pipeline_snapshot_t;
+
+pipeline_channel_t pipeline_channels[ADC1_BUFFER_CHANNELS];
+pipeline_state_t pipeline_state[ADC1_BUFFER_CHANNELS];
+pipeline_snapshot_t pipeline_snapshots[2];
+__IO uint8_t pipeline_front;        // Snapshot the main loop reads
+__IO uint16_t pipeline_sequence;    // Incremented when the front snapshot changes
+uint8_t pipeline_oversample_bits;
+uint8_t pipeline_scans;             // Scans summed so far
+
+//-----------------------------------------------------------------------------
+// 8x8 multiply
+//
+inline uint16_t Pipeline_Mul8(uint8_t a, uint8_t b)
+{
+    return (uint16_t)a * b;
+}
+
+//-----------------------------------------------------------------------------
+// Apply a Q8.8 gain, saturating at 0xFFFF
+//
+// The 16x16 multiply is done as four 8x8 multiplies keeping bits 8 to 23.
+//
+static uint16_t Pipeline_Scale(uint16_t value, uint16_t gain)
+{
+    uint8_t vh = value >> 8;
+    uint8_t vl = value & 0xFF;
+    uint8_t gh = gain >> 8;
+    uint8_t gl = gain & 0xFF;
+    uint16_t high = Pipeline_Mul8(vh, gh);
+    uint32_t result;
+
+    if (high > 0xFF)
+    {
+        return 0xFFFF;
+    }
+    result = (uint32_t)(high << 8) + Pipeline_Mul8(vh, gl) + Pipeline_Mul8(vl, gh) + (Pipeline_Mul8(vl, gl) >> 8);
+    return (result > 0xFFFF) ? 0xFFFF : (uint16_t)result;
+}
+
+//-----------------------------------------------------------------------------
+// Reset a channel's filters
+//
+static void Pipeline_Reset(uint8_t channel)
+{
+    pipeline_state_t *state = &pipeline_state[channel];
+    uint8_t i;
+
+    state->sum = 0;
+    for (i = 0; i < (1 << PIPELINE_AVERAGE_MAX); ++i)
+    {
+        state->history[i] = 0;
+    }
+    state->history_sum = 0;
+    state->history_index = 0;
+    state->iir_primed = false;
+}
+
+//-----------------------------------------------------------------------------
+// Initialise with every channel passed straight through
+//
+// The oversampling is 4^oversample_bits scans per result. Pass Pipeline_Scan
+// to ADC_InitScan as the callback.
+//
+void Pipeline_Init(uint8_t oversample_bits)
+{
+    uint8_t channel;
+
+    pipeline_oversample_bits = (oversample_bits > PIPELINE_OVERSAMPLE_MAX) ? PIPELINE_OVERSAMPLE_MAX : oversample_bits;
+    pipeline_scans = 0;
+    pipeline_front = 0;
+    pipeline_sequence = 0;
+    for (channel = 0; channel < ADC1_BUFFER_CHANNELS; ++channel)
+    {
+        pipeline_channels[channel].offset = 0;
+        pipeline_channels[channel].gain = PIPELINE_GAIN_ONE;
+        pipeline_channels[channel].average_bits = 0;
+        pipeline_channels[channel].iir_shift = 0;
+        Pipeline_Reset(channel);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Set a channel's calibration and filters
+//
+// offset is in 16 bit full scale units, i.e. ADC counts * 64. Returns false
+// if the channel isn't one of the ADC's buffered channels.
+//
+bool Pipeline_ConfigChannel(uint8_t channel, uint16_t offset, uint16_t gain, uint8_t average_bits, uint8_t iir_shift) CRITICAL
+{
+    pipeline_channel_t *config = &pipeline_channels[channel];
+
+    if (channel >= ADC1_BUFFER_CHANNELS)
+    {
+        return false;
+    }
+    config->offset = offset;
+    config->gain = gain;
+    config->average_bits = (average_bits > PIPELINE_AVERAGE_MAX) ? PIPELINE_AVERAGE_MAX : average_bits;
+    config->iir_shift = (iir_shift > 15) ? 15 : iir_shift;
+    Pipeline_Reset(channel);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Run one decimated value for a channel through its stages
+//
+static uint16_t Pipeline_Filter(uint8_t channel, uint16_t value)
+{
+    pipeline_channel_t *config = &pipeline_channels[channel];
+    pipeline_state_t *state = &pipeline_state[channel];
+    uint32_t average;
+    uint8_t shift;
+
+    value = (value > config->offset) ? value - config->offset : 0;
+    if (config->gain != PIPELINE_GAIN_ONE)
+    {
+        value = Pipeline_Scale(value, config->gain);
+    }
+
+    if (config->average_bits)
+    {
+        state->history_sum -= state->history[state->history_index];
+        state->history_sum += value;
+        state->history[state->history_index] = value;
+        state->history_index = (state->history_index + 1) & ((1 << config->average_bits) - 1);
+        average = state->history_sum;
+        for (shift = config->average_bits; shift; --shift)
+        {
+            average >>= 1;
+        }
+        value = (uint16_t)average;
+    }
+
+    if (config->iir_shift)
+    {
+        if (!state->iir_primed)
+        {
+            state->iir = value;
+            state->iir_primed = true;
+        }
+        // Each direction on its own so the difference can't overflow
+        if (value >= state->iir)
+        {
+            state->iir += (value - state->iir) >> config->iir_shift;
+        }
+        else
+        {
+            state->iir -= (state->iir - value) >> config->iir_shift;
+        }
+        value = state->iir;
+    }
+    return value;
+}
+
+//-----------------------------------------------------------------------------
+// ADC scan callback
+//
+// Called from the ADC interrupt with each scan.
+//
+void Pipeline_Scan(const uint16_t *values, uint8_t count)
+{
+    pipeline_snapshot_t *back = &pipeline_snapshots[pipeline_front ^ 1];
+    uint8_t shift = 6 - (pipeline_oversample_bits << 1);
+    uint8_t channel;
+    uint16_t value;
+
+    for (channel = 0; channel < count; ++channel)
+    {
+        pipeline_state[channel].sum += values[channel];
+    }
+    if (++pipeline_scans < (uint8_t)(1 << (pipeline_oversample_bits << 1)))
+    {
+        return;
+    }
+    pipeline_scans = 0;
+
+    // 4^n sums of 10 bits are 10 + 2n bits, scale to 16
+    for (channel = 0; channel < count; ++channel)
+    {
+        value = pipeline_state[channel].sum << shift;
+        pipeline_state[channel].sum = 0;
+        back->values[channel] = Pipeline_Filter(channel, value);
+    }
+
+    pipeline_front ^= 1;
+    ++pipeline_sequence;
+}
+
+//-----------------------------------------------------------------------------
+// Copy the latest results
+//
+// values needs room for every channel in the scan. Returns the sequence
+// number of the results, which changes each time there are new ones.
+//
+uint16_t Pipeline_Read(uint16_t *values)
+{
+    uint16_t sequence;
+    uint8_t channel;
+    pipeline_snapshot_t *front;
+
+    do
+    {
+        sequence = pipeline_sequence;
+        front = &pipeline_snapshots[pipeline_front];
+        for (channel = 0; channel < adc_channels; ++channel)
+        {
+            values[channel] = front->values[channel];
+        }
+    } while (sequence != pipeline_sequence);
+
+    return sequence;
+}
+#endif // PIPELINE
+
+#ifdef SPIMASTER
+//=============================================================================
+// SPI functions
+//
+// The STM8S105 has the SPI on PC5 (SCK), PC6 (MOSI), PC7 (MISO) and PE5
+// (NSS). The pins are taken over by the peripheral when it's enabled.
+//
+// As master, chip selects are ordinary GPIOs managed per device, and each
+// device carries its own mode, bit order and clock so devices with different
+// needs can share the bus. The clock is the fastest that doesn't exceed the
+// device's maximum, from the system clock divided by 2 to 256, so 8MHz is the
+// fastest with a 16MHz clock.
+//
+// There are two ways of transferring data:
+//
+//  SPI_Transfer        - Polled, keeps the transmit buffer full so bytes go
+//                        back to back. Use for short transfers and when the
+//                        throughput matters, e.g. a display or flash.
+//  SPI_TransferAsync   - Interrupt driven, returns straight away and calls a
+//                        function from the interrupt when done. The next byte
+//                        is sent when the last has been received, so there's
+//                        a gap between bytes of the interrupt latency but the
+//                        receiver can't overrun.
+//
+// The polled functions wait on the status flags with Wait_Flag, so a stuck
+// peripheral makes them return false rather than hang.
+//
+// As a slave, the NSS pin or software selects the device and transfers are
+// armed with SPI_TransferAsync. The transmit data is loaded ahead using the
+// TXE interrupt. The master needs to leave enough time between bytes for the
+// interrupt to read each one.
+//
+
+#define SPI_DUMMY                   0xFF        // Sent when there's only data to read
+
+typedef enum
+{
+    SPI_MODE_0 = SPI_CR1_CPOL_LOW | SPI_CR1_CPHA_FIRST,     // Idle low, sample on rising edge
+    SPI_MODE_1 = SPI_CR1_CPOL_LOW | SPI_CR1_CPHA_SECOND,    // Idle low, sample on falling edge
+    SPI_MODE_2 = SPI_CR1_CPOL_HIGH | SPI_CR1_CPHA_FIRST,    // Idle high, sample on falling edge
+    SPI_MODE_3 = SPI_CR1_CPOL_HIGH | SPI_CR1_CPHA_SECOND    // Idle high, sample on rising edge
+} spi_mode_t;
+
+typedef struct
+{
+    stm8_gpio_t *cs_port;
+    uint8_t cs_pin;                 // Chip select pin mask, active low
+    uint8_t cr1;                    // Mode, bit order and clock for the device
+} spi_device_t;
+
+typedef void (*spi_done_cb_t)(void);
+
+const uint8_t *spi_tx;
+uint8_t *spi_rx;
+uint16_t spi_tx_count;
+__IO uint16_t spi_rx_count;
+spi_done_cb_t spi_done;
+__IO uint8_t spi_errors;            // SPI_SR_OVR_MASK / SPI_SR_MODF_MASK seen
+
+//-----------------------------------------------------------------------------
+// Work out the CR1 value for a clock, mode and bit order
+//
+// The actual clock frequency is returned in hz.
+//
+static uint32_t SPI_MakeCR1(uint8_t *cr1, uint32_t max_hz, spi_mode_t mode, bool lsb_first)
+{
+    uint32_t clock = SysClock_GetClockFreq();
+    uint8_t br = 0;
+
+    while ((br < 7) && ((clock >> (br + 1)) > max_hz))
+    {
+        ++br;
+    }
+    *cr1 = SPI_CR1_SPE_ENABLE | SPI_CR1_MSTR_MASTER | (br << SPI_CR1_BR_SHIFT) | mode |
+           (lsb_first ? SPI_CR1_LSBFIRST_LSB : SPI_CR1_LSBFIRST_MSB);
+    return clock >> (br + 1);
+}
+
+//-----------------------------------------------------------------------------
+// Initialise as a master
+//
+// NSS is managed in software so the PE5 pin is free. The clock and mode set
+// here are used until a device is selected. Returns the clock frequency.
+//
+uint32_t SPI_InitMaster(uint32_t max_hz, spi_mode_t mode)
+{
+    uint8_t cr1;
+    uint32_t hz = SPI_MakeCR1(&cr1, max_hz, mode, false);
+
+    CLK->PCKENR1 |= CLK_PCKENR1_SPI;
+    SPI->CR1 = SPI_CR1_SPE_DISABLE;
+    SPI->ICR = 0;
+    SPI->CR2 = SPI_CR2_SSM_ENABLE | SPI_CR2_SSI_MASTER;
+    SPI->CR1 = cr1;
+    spi_rx_count = 0;
+    spi_errors = 0;
+    return hz;
+}
+
+//-----------------------------------------------------------------------------
+// Initialise as a slave
+//
+// With hardware NSS the slave is only selected while PE5 is low, otherwise it
+// is always selected.
+//
+void SPI_InitSlave(spi_mode_t mode, bool lsb_first, bool hardware_nss)
+{
+    CLK->PCKENR1 |= CLK_PCKENR1_SPI;
+    SPI->CR1 = SPI_CR1_SPE_DISABLE;
+    SPI->ICR = 0;
+    SPI->CR2 = hardware_nss ? SPI_CR2_SSM_DISABLE : (SPI_CR2_SSM_ENABLE | SPI_CR2_SSI_SLAVE);
+    SPI->CR1 = SPI_CR1_SPE_ENABLE | SPI_CR1_MSTR_SLAVE | mode |
+               (lsb_first ? SPI_CR1_LSBFIRST_LSB : SPI_CR1_LSBFIRST_MSB);
+    spi_rx_count = 0;
+    spi_errors = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Check if an interrupt driven transfer is in progress
+//
+bool SPI_Busy(void)
+{
+    return spi_rx_count != 0;
+}
+
+//-----------------------------------------------------------------------------
+// Wait for the last byte to be clocked out
+//
+static bool SPI_WaitIdle(void)
+{
+    return (Wait_Flag(&SPI->SR, SPI_SR_TXE_MASK, SPI_SR_TXE_MASK, WAIT_BUDGET_SPI, WAIT_SOURCE_SPI) == WAIT_OK) &&
+           (Wait_Flag(&SPI->SR, SPI_SR_BSY_MASK, 0, WAIT_BUDGET_SPI, WAIT_SOURCE_SPI) == WAIT_OK);
+}
+
+//-----------------------------------------------------------------------------
+// Return and clear the errors seen by the interrupt handler
+//
+uint8_t SPI_TakeErrors(void) CRITICAL
+{
+    uint8_t errors = spi_errors;
+    spi_errors = 0;
+    return errors;
+}
+
+//-----------------------------------------------------------------------------
+// Set up a device on the bus
+//
+// The chip select pin is made a fast push-pull output and deselected. Returns
+// the clock frequency the device will be run at.
+//
+uint32_t SPI_DeviceInit(spi_device_t *dev, stm8_gpio_t *cs_port, uint8_t cs_pin, uint32_t max_hz, spi_mode_t mode, bool lsb_first)
+{
+    dev->cs_port = cs_port;
+    dev->cs_pin = cs_pin;
+    cs_port->ODR |= cs_pin;
+    cs_port->DDR |= cs_pin;
+    cs_port->CR1 |= cs_pin;
+    cs_port->CR2 |= cs_pin;
+    return SPI_MakeCR1(&dev->cr1, max_hz, mode, lsb_first);
+}
+
+//-----------------------------------------------------------------------------
+// Select a device
+//
+// The device's settings are loaded if they're different to the last device,
+// which is only allowed while the bus is idle. Returns false, without
+// selecting it, if the bus didn't go idle.
+//
+bool SPI_Select(const spi_device_t *dev)
+{
+    if (SPI->CR1 != dev->cr1)
+    {
+        if (!SPI_WaitIdle())
+        {
+            return false;
+        }
+        SPI->CR1 = dev->cr1;
+    }
+    dev->cs_port->ODR &= (uint8_t)~dev->cs_pin;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Deselect a device once the last byte has gone
+//
+// The device is deselected even if the bus didn't go idle, which returns
+// false.
+//
+bool SPI_Deselect(const spi_device_t *dev)
+{
+    bool ok = SPI_WaitIdle();
+
+    dev->cs_port->ODR |= dev->cs_pin;
+    return ok;
+}
+
+//-----------------------------------------------------------------------------
+// Deselect a device straight away
+//
+// For the done function of SPI_TransferAsync, where the last byte has been
+// received so the bus is already idle and waiting isn't wanted.
+//
+void SPI_DeselectNow(const spi_device_t *dev)
+{
+    dev->cs_port->ODR |= dev->cs_pin;
+}
+
+//-----------------------------------------------------------------------------
+// Polled full duplex transfer as master
+//
+// Either buffer can be NULL, SPI_DUMMY is sent if there's no transmit data.
+// The next byte is written as soon as the transmit buffer is free and the
+// received byte read while that's being shifted, which leaves a whole byte
+// time to read it before an overrun. Returns false if a flag timed out.
+//
+// At fMASTER/2 a byte is only 16 cycles, so the flags are polled inline
+// rather than with Wait_Flag and only a timeout costs a call.
+//
+bool SPI_Transfer(const uint8_t *tx, uint8_t *rx, uint16_t length)
+{
+    uint16_t budget;
+    uint8_t data;
+
+    if (length == 0)
+    {
+        return true;
+    }
+
+    SPI->DR = tx ? *tx++ : SPI_DUMMY;
+    while (length)
+    {
+        if (--length)
+        {
+            budget = WAIT_BUDGET_SPI;
+            while (!(SPI->SR & SPI_SR_TXE_MASK) && --budget)
+            {
+            }
+            if (budget == 0)
+            {
+                Wait_Expired(WAIT_SOURCE_SPI);
+                return false;
+            }
+            SPI->DR = tx ? *tx++ : SPI_DUMMY;
+        }
+        budget = WAIT_BUDGET_SPI;
+        while (!(SPI->SR & SPI_SR_RXNE_MASK) && --budget)
+        {
+        }
+        if (budget == 0)
+        {
+            Wait_Expired(WAIT_SOURCE_SPI);
+            return false;
+        }
+        data = SPI->DR;
+        if (rx)
+        {
+            *rx++ = data;
+        }
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Polled transmit only as master
+//
+// Nothing is read so this is the fastest way of sending. The overrun this
+// causes is cleared at the end by reading DR then SR. Returns false if a flag
+// timed out. TXE is polled inline, as in SPI_Transfer.
+//
+bool SPI_Write(const uint8_t *tx, uint16_t length)
+{
+    uint16_t budget;
+    bool ok = true;
+
+    while (ok && length--)
+    {
+        budget = WAIT_BUDGET_SPI;
+        while (!(SPI->SR & SPI_SR_TXE_MASK) && --budget)
+        {
+        }
+        if (budget == 0)
+        {
+            Wait_Expired(WAIT_SOURCE_SPI);
+            ok = false;
+        }
+        else
+        {
+            SPI->DR = *tx++;
+        }
+    }
+    ok = SPI_WaitIdle() && ok;
+    (void)SPI->DR;
+    (void)SPI->SR;
+    return ok;
+}
+
+//-----------------------------------------------------------------------------
+// Exchange a single byte as master
+//
+// Returns SPI_DUMMY if the transfer timed out.
+//
+uint8_t SPI_Exchange(uint8_t data)
+{
+    if (!SPI_Transfer(&data, &data, 1))
+    {
+        return SPI_DUMMY;
+    }
+    return data;
+}
+
+//-----------------------------------------------------------------------------
+// Start an interrupt driven full duplex transfer
+//
+// Either buffer can be NULL. The buffers must stay valid until done is
+// called, from the interrupt, which can be NULL if SPI_Busy is polled
+// instead. Returns false if a transfer is already in progress.
+//
+bool SPI_TransferAsync(const uint8_t *tx, uint8_t *rx, uint16_t length, spi_done_cb_t done) CRITICAL
+{
+    if (spi_rx_count || (length == 0))
+    {
+        return false;
+    }
+
+    spi_tx = tx;
+    spi_rx = rx;
+    spi_tx_count = length - 1;
+    spi_rx_count = length;
+    spi_done = done;
+
+    // Clear anything left over from a polled SPI_Write
+    (void)SPI->DR;
+    (void)SPI->SR;
+
+    // The first byte starts a master, or is loaded ready for a slave
+    SPI->DR = spi_tx ? *spi_tx++ : SPI_DUMMY;
+    SPI->ICR = SPI_ICR_RXIE_MASK | SPI_ICR_ERRIE_MASK;
+    if (((SPI->CR1 & SPI_CR1_MSTR_MASK) == SPI_CR1_MSTR_SLAVE) && spi_tx_count)
+    {
+        SPI->ICR |= SPI_ICR_TXIE_MASK;
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Interrupt handler
+//
+// As master the next byte is sent once the last is received. As slave the
+// transmit data is loaded whenever the buffer is empty.
+//
+#if defined __IAR_SYSTEMS_ICC__
+#pragma vector=10
+#endif
+INTERRUPT(SPI_IRQHandler, 10)
+{
+    uint8_t sr = SPI->SR;
+    uint8_t data;
+
+    if (sr & (SPI_SR_OVR_MASK | SPI_SR_MODF_MASK))
+    {
+        spi_errors |= sr & (SPI_SR_OVR_MASK | SPI_SR_MODF_MASK);
+        if (sr & SPI_SR_MODF_MASK)
+        {
+            // Another master took the bus, which has disabled the SPI.
+            // Cleared by writing CR1 after reading SR
+            SPI->CR1 = SPI->CR1;
+            SPI->ICR = 0;
+            spi_rx_count = 0;
+            return;
+        }
+    }
+
+    if (sr & SPI_SR_RXNE_MASK)
+    {
+        data = SPI->DR;
+        if (spi_rx)
+        {
+            *spi_rx++ = data;
+        }
+        if (--spi_rx_count == 0)
+        {
+            SPI->ICR = 0;
+            if (spi_done)
+            {
+                spi_done();
+            }
+            return;
+        }
+        if (((SPI->CR1 & SPI_CR1_MSTR_MASK) == SPI_CR1_MSTR_MASTER) && spi_tx_count)
+        {
+            SPI->DR = spi_tx ? *spi_tx++ : SPI_DUMMY;
+            --spi_tx_count;
+        }
+    }
+
+    if ((SPI->ICR & SPI_ICR_TXIE_MASK) && (SPI->SR & SPI_SR_TXE_MASK))
+    {
+        SPI->DR = spi_tx ? *spi_tx++ : SPI_DUMMY;
+        if (--spi_tx_count == 0)
+        {
+            SPI->ICR &= (uint8_t)~SPI_ICR_TXIE_MASK;
+        }
+    }
+}
+#endif // SPIMASTER
+
+#ifdef NORFLASH
+//=============================================================================
+// SPI NOR flash functions
+//
+// For W25Q and similar serial NOR flash. Pages are 256 bytes and the
+// smallest erase is a 4K sector.
+//
+// Programs and erases only start the operation. The flash then sets its
+// write in progress (WIP) bit until it's done, which NorFlash_Busy checks
+// with a short status read each time it's called rather than waiting. A page
+// program's data is sent by interrupt, so the caller can get on with other
+// work, e.g. sampling, from the start.
+//
+// Starting an operation or reading waits for the last one to finish, for at
+// most NOR_TIMEOUT_MS by the system tick, so a flash that stops answering
+// makes them return false rather than hang. The system tick must be running.
+//
+
+#define NOR_CMD_WRITE_ENABLE        0x06
+#define NOR_CMD_READ_STATUS         0x05
+#define NOR_CMD_PAGE_PROGRAM        0x02
+#define NOR_CMD_SECTOR_ERASE        0x20        // 4K
+#define NOR_CMD_FAST_READ           0x0B
+#define NOR_CMD_JEDEC_ID            0x9F
+#define NOR_STATUS_WIP              0x01        // Write in progress
+
+#define NOR_MAX_HZ                  8000000
+#define NOR_PAGE_SIZE               256
+#define NOR_TIMEOUT_MS              500         // Longest sector erase is 400ms
+
+spi_device_t nor_device;
+uint32_t nor_size;                  // Bytes, from the JEDEC ID
+bool nor_wip;                       // Program or erase may still be going on
+uint16_t nor_started;               // System tick the program or erase started
+uint8_t nor_command[5];
+
+//-----------------------------------------------------------------------------
+// Send a command, with an address if it's a read, program or erase
+//
+static bool NorFlash_Command(uint8_t command, uint32_t address, uint8_t length)
+{
+    nor_command[0] = command;
+    nor_command[1] = (uint8_t)(address >> 16);
+    nor_command[2] = (uint8_t)(address >> 8);
+    nor_command[3] = (uint8_t)(address >> 0);
+    nor_command[4] = 0xFF;                      // Dummy byte for fast read
+    return SPI_Write(nor_command, length);
+}
+
+//-----------------------------------------------------------------------------
+// Allow the next program or erase
+//
+static bool NorFlash_WriteEnable(void)
+{
+    bool ok = SPI_Select(&nor_device) && NorFlash_Command(NOR_CMD_WRITE_ENABLE, 0, 1);
+
+    return SPI_Deselect(&nor_device) && ok;
+}
+
+//-----------------------------------------------------------------------------
+// Initialise and identify the flash
+//
+// The chip select is any GPIO. The JEDEC ID is read into id, which must have
+// room for 3 bytes: manufacturer, memory type and capacity. Returns false if
+// there's no flash answering or the capacity doesn't make sense.
+//
+bool NorFlash_Init(stm8_gpio_t *cs_port, uint8_t cs_pin, uint8_t *id)
+{
+    bool ok;
+
+    SPI_DeviceInit(&nor_device, cs_port, cs_pin, NOR_MAX_HZ, SPI_MODE_0, false);
+    nor_wip = false;
+    nor_size = 0;
+
+    ok = SPI_Select(&nor_device) && NorFlash_Command(NOR_CMD_JEDEC_ID, 0, 1) && SPI_Transfer(NULL, id, 3);
+    ok = SPI_Deselect(&nor_device) && ok;
+
+    if (!ok || (id[0] == 0x00) || (id[0] == 0xFF) || (id[2] >= 32))
+    {
+        return false;
+    }
+
+    // Capacity is given as a power of 2
+    nor_size = (uint32_t)1 << id[2];
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Return the size of the flash in bytes
+//
+uint32_t NorFlash_Size(void)
+{
+    return nor_size;
+}
+
+//-----------------------------------------------------------------------------
+// Check if a program or erase is still going on
+//
+bool NorFlash_Busy(void)
+{
+    uint8_t status;
+
+    if (SPI_Busy())
+    {
+        return true;
+    }
+    if (nor_wip)
+    {
+        // A failed read leaves WIP set, so a flash that's stopped answering
+        // stays busy
+        status = SPI_DUMMY;
+        if (SPI_Select(&nor_device) && NorFlash_Command(NOR_CMD_READ_STATUS, 0, 1))
+        {
+            status = SPI_Exchange(SPI_DUMMY);
+        }
+        SPI_Deselect(&nor_device);
+        nor_wip = (status & NOR_STATUS_WIP) != 0;
+    }
+    return nor_wip;
+}
+
+//-----------------------------------------------------------------------------
+// Wait for a program or erase to finish, up to NOR_TIMEOUT_MS
+//
+static bool NorFlash_WaitReady(void)
+{
+    uint16_t start = systick;
+
+    while (NorFlash_Busy())
+    {
+        if (Systick_Timeout(&start, NOR_TIMEOUT_MS))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Check if a program or erase has been busy for longer than it can take
+//
+// A flash that's stopped answering reads WIP as set, so NorFlash_Busy alone
+// never gives up on it. Uses the WIP seen by the last NorFlash_Busy.
+//
+bool NorFlash_Stuck(void)
+{
+    return nor_wip && ((uint16_t)(systick - nor_started) >= NOR_TIMEOUT_MS);
+}
+
+//-----------------------------------------------------------------------------
+// Called from the SPI interrupt when a page's data has been sent
+//
+static void NorFlash_ProgramDone(void)
+{
+    SPI_DeselectNow(&nor_device);
+}
+
+//-----------------------------------------------------------------------------
+// Start programming part of a page
+//
+// Only bits that are 1 can be programmed to 0. The data must stay valid
+// until NorFlash_Busy returns false and must not run past the end of the
+// page, as the flash wraps round to the start of it. Returns false if it
+// couldn't be started.
+//
+bool NorFlash_Program(uint32_t address, const uint8_t *data, uint16_t length)
+{
+    if (!NorFlash_WaitReady() || !NorFlash_WriteEnable())
+    {
+        return false;
+    }
+    if (!SPI_Select(&nor_device) || !NorFlash_Command(NOR_CMD_PAGE_PROGRAM, address, 4) ||
+        !SPI_TransferAsync(data, NULL, length, NorFlash_ProgramDone))
+    {
+        SPI_Deselect(&nor_device);
+        return false;
+    }
+    nor_wip = true;
+    nor_started = systick;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Start erasing the 4K sector an address is in
+//
+// Returns false if it couldn't be started.
+//
+bool NorFlash_EraseSector(uint32_t address)
+{
+    bool ok;
+
+    if (!NorFlash_WaitReady() || !NorFlash_WriteEnable())
+    {
+        return false;
+    }
+    ok = SPI_Select(&nor_device) && NorFlash_Command(NOR_CMD_SECTOR_ERASE, address, 4);
+    ok = SPI_Deselect(&nor_device) && ok;
+    nor_wip = ok;
+    nor_started = systick;
+    return ok;
+}
+
+//-----------------------------------------------------------------------------
+// Read into a buffer using fast read
+//
+// Waits for any program or erase to finish first, which for an erase can be
+// hundreds of ms. The data is clocked in by the polled transfer, so at the
+// full SPI clock. Returns false if the flash didn't answer.
+//
+bool NorFlash_Read(uint32_t address, uint8_t *data, uint16_t length)
+{
+    bool ok;
+
+    if (!NorFlash_WaitReady())
+    {
+        return false;
+    }
+    ok = SPI_Select(&nor_device) && NorFlash_Command(NOR_CMD_FAST_READ, address, 5) &&
+         SPI_Transfer(NULL, data, length);
+    return SPI_Deselect(&nor_device) && ok;
+}
+
+//=============================================================================
+// Flash log functions
+//
+// The log format is kept in flashlog.h so that it can also be built on a PC
+// against the NOR flash model in flash_model.c, which "make test" does. Here
+// it's given the SPI flash and the table driven CRC.
+//
+
+#define FLASH_LOG_CRC               CRC16_Update
+#include "flashlog.h"
+
+//-----------------------------------------------------------------------------
+// Busy check for the log, which fails it if the flash is stuck busy
+//
+static flash_log_media_busy_t FlashLog_NorBusy(void)
+{
+    if (!NorFlash_Busy())
+    {
+        return FLASH_LOG_MEDIA_READY;
+    }
+    return NorFlash_Stuck() ? FLASH_LOG_MEDIA_STUCK : FLASH_LOG_MEDIA_BUSY;
+}
+
+const flash_log_media_t nor_flash_media =
+{
+    NorFlash_Read,
+    NorFlash_Program,
+    NorFlash_EraseSector,
+    FlashLog_NorBusy
+};
+#endif // NORFLASH
+
+#ifdef FLASHPROG
+//=============================================================================
+// Flash programming functions
+//
+// Programs the program flash and the data EEPROM. Each area has to be
+// unlocked with its pair of keys first; a wrong key locks it until reset.
+//
+// Bytes and words (4 bytes, aligned) are written by storing to the address.
+// Blocks (128 bytes, aligned) are written by a routine that's copied into
+// RAM by Flash_Init, as code can't be fetched from the program flash while
+// it's being written.
+//
+// The data EEPROM can be read while it's being written, so its writes are
+// started and left to finish on their own, taking about 6ms for a byte, word
+// or block. The end of programming (EOP) interrupt marks the end and calls
+// the done callback. A program flash block write has to wait in RAM with
+// interrupts disabled, since the vectors are in flash, and the callback is
+// called before it returns. A program flash byte or word write stalls the CPU
+// until it's done.
+//
+// Only one write can be in progress at a time.
+//
+
+#define FLASH_RAM_ROUTINE_SIZE      48          // Routine is 45 bytes
+
+typedef enum
+{
+    FLASH_AREA_PROGRAM,
+    FLASH_AREA_DATA
+} flash_area_t;
+
+typedef void (*flash_done_cb_t)(bool ok);
+
+uint8_t flash_ram_routine[FLASH_RAM_ROUTINE_SIZE];
+bool flash_ram_ready;
+uint8_t *flash_block_dst;           // Used by the RAM routine
+const uint8_t *flash_block_src;
+uint8_t flash_block_wait;
+uint8_t flash_block_status;
+__IO bool flash_busy;
+__IO bool flash_ok;                 // Result of the last write
+flash_done_cb_t flash_done_cb;
+
+//-----------------------------------------------------------------------------
+// Block write routine, run from RAM
+//
+// Writes FLASH_BLOCK_SIZE bytes from flash_block_src to flash_block_dst in
+// standard block mode. If flash_block_wait is set it then waits for the end
+// of programming and leaves IAPSR in flash_block_status.
+//
+// It only uses relative jumps so it can be run from anywhere.
+// Flash_BlockRoutineEnd must follow it so its size is known.
+//
+#if defined __SDCC__
+void Flash_BlockRoutine(void) __naked
+{
+    __asm
+        ldw x, _flash_block_dst
+        ldw y, _flash_block_src
+        mov 0x505B, #0x01
+        mov 0x505C, #0xFE
+        ld a, #128
+    00001$:
+        push a
+        ld a, (y)
+        ld (x), a
+        incw x
+        incw y
+        pop a
+        dec a
+        jrne 00001$
+        tnz _flash_block_wait
+        jreq 00003$
+    00002$:
+        ld a, 0x505F
+        and a, #0x05
+        jreq 00002$
+        ld _flash_block_status, a
+    00003$:
+        ret
+    __endasm;
+}
+
+void Flash_BlockRoutineEnd(void) __naked
+{
+    __asm
+        ret
+    __endasm;
+}
+#endif // __SDCC__
+
+//-----------------------------------------------------------------------------
+// Initialise
+//
+// Copies the block routine to RAM and enables the EOP interrupt. Returns false
+// if the routine doesn't fit, in which case only data EEPROM blocks can be
+// written.
+//
+bool Flash_Init(void)
+{
+#if defined __SDCC__
+    const uint8_t *code = (const uint8_t *)Flash_BlockRoutine;
+    uint8_t size = (const uint8_t *)Flash_BlockRoutineEnd - code;
+    uint8_t i;
+
+    flash_ram_ready = size <= FLASH_RAM_ROUTINE_SIZE;
+    for (i = 0; flash_ram_ready && (i < size); ++i)
+    {
+        flash_ram_routine[i] = code[i];
+    }
+#else
+    // Other compilers have their own way of putting code in RAM
+    flash_ram_ready = false;
+#endif
+
+    flash_busy = false;
+    flash_ok = true;
+    flash_done_cb = NULL;
+    FLASH->CR1 = (FLASH->CR1 & ~FLASH_CR1_IE_MASK) | FLASH_CR1_IE_ENABLE;
+    return flash_ram_ready;
+}
+
+//-----------------------------------------------------------------------------
+// Set the function called when a write finishes
+//
+// It's usually called from the interrupt and is passed whether the write
+// worked, it fails if the address is write protected.
+//
+void Flash_SetDoneCallback(flash_done_cb_t cb)
+{
+    flash_done_cb = cb;
+}
+
+//-----------------------------------------------------------------------------
+// Unlock an area for writing
+//
+bool Flash_Unlock(flash_area_t area)
+{
+    if (area == FLASH_AREA_PROGRAM)
+    {
+        FLASH->PUKR = FLASH_PUKR_KEY1;
+        FLASH->PUKR = FLASH_PUKR_KEY2;
+        return (FLASH->IAPSR & FLASH_IAPSR_PUL_MASK) != 0;
+    }
+    FLASH->DUKR = FLASH_DUKR_KEY1;
+    FLASH->DUKR = FLASH_DUKR_KEY2;
+    return (FLASH->IAPSR & FLASH_IAPSR_DUL_MASK) != 0;
+}
+
+//-----------------------------------------------------------------------------
+// Lock an area again
+//
+// Reading IAPSR clears EOP, so only lock when no write is in progress.
+//
+void Flash_Lock(flash_area_t area)
+{
+    FLASH->IAPSR &= ~((area == FLASH_AREA_PROGRAM) ? FLASH_IAPSR_PUL_MASK : FLASH_IAPSR_DUL_MASK);
+}
+
+//-----------------------------------------------------------------------------
+// Check if a write is in progress
+//
+bool Flash_Busy(void)
+{
+    return flash_busy;
+}
+
+//-----------------------------------------------------------------------------
+// Check an address range is all in one area and return which
+//
+static bool Flash_CheckRange(uint16_t address, uint16_t length, flash_area_t *area)
+{
+    uint16_t last = address + length - 1;
+
+    if ((address >= FLASH_DATA_START) && (last <= FLASH_DATA_END) && (last >= address))
+    {
+        *area = FLASH_AREA_DATA;
+        return true;
+    }
+    if ((address >= FLASH_PROGRAM_START) && (last <= FLASH_PROGRAM_END) && (last >= address))
+    {
+        *area = FLASH_AREA_PROGRAM;
+        return true;
+    }
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+// Finish a write that was waited for rather than left to the interrupt
+//
+static void Flash_Done(uint8_t iapsr)
+{
+    flash_ok = (iapsr & FLASH_IAPSR_WR_PG_DIS_MASK) == 0;
+    flash_busy = false;
+    if (flash_done_cb)
+    {
+        flash_done_cb(flash_ok);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Start writing a byte
+//
+// Returns false if a write is in progress or the address isn't flash.
+//
+bool Flash_WriteByte(uint16_t address, uint8_t data)
+{
+    flash_area_t area;
+
+    if (flash_busy || !Flash_CheckRange(address, 1, &area))
+    {
+        return false;
+    }
+    flash_busy = true;
+    *(__IO uint8_t *)address = data;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Start writing a word of 4 bytes
+//
+// The address must be a multiple of 4. Returns false if a write is in
+// progress or the address isn't suitable.
+//
+bool Flash_WriteWord(uint16_t address, const uint8_t *data)
+{
+    __IO uint8_t *dst = (__IO uint8_t *)address;
+    flash_area_t area;
+
+    if (flash_busy || (address & (FLASH_WORD_SIZE - 1)) || !Flash_CheckRange(address, FLASH_WORD_SIZE, &area))
+    {
+        return false;
+    }
+    flash_busy = true;
+    FLASH->CR2 = FLASH_CR2_WPRG_MASK;
+    FLASH->NCR2 = (uint8_t)~FLASH_CR2_WPRG_MASK;
+    dst[0] = data[0];
+    dst[1] = data[1];
+    dst[2] = data[2];
+    dst[3] = data[3];
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Write a block of 128 bytes
+//
+// The address must be a multiple of 128. The data must stay valid until the
+// write is done. A data EEPROM block is started and left to the interrupt,
+// a program flash block is finished before returning. Returns false if a
+// write is in progress, the address isn't suitable or it's program flash and
+// the routine isn't in RAM.
+//
+bool Flash_WriteBlock(uint16_t address, const uint8_t *data) CRITICAL
+{
+    __IO uint8_t *dst = (__IO uint8_t *)address;
+    flash_area_t area;
+    uint8_t i;
+
+    if (flash_busy || (address & (FLASH_BLOCK_SIZE - 1)) || !Flash_CheckRange(address, FLASH_BLOCK_SIZE, &area) ||
+        (!flash_ram_ready && (area == FLASH_AREA_PROGRAM)))
+    {
+        return false;
+    }
+
+    flash_busy = true;
+    flash_block_wait = area == FLASH_AREA_PROGRAM;
+    if (flash_ram_ready)
+    {
+        flash_block_dst = (uint8_t *)address;
+        flash_block_src = data;
+        ((void (*)(void))flash_ram_routine)();
+    }
+    else
+    {
+        // Data EEPROM can be written from code in flash
+        FLASH->CR2 = FLASH_CR2_PRG_MASK;
+        FLASH->NCR2 = (uint8_t)~FLASH_CR2_PRG_MASK;
+        for (i = 0; i < FLASH_BLOCK_SIZE; ++i)
+        {
+            dst[i] = data[i];
+        }
+    }
+
+    if (flash_block_wait)
+    {
+        Flash_Done(flash_block_status);
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Interrupt handler for end of programming
+//
+// Reading IAPSR clears EOP and WR_PG_DIS.
+//
+#if defined __IAR_SYSTEMS_ICC__
+#pragma vector=24
+#endif
+INTERRUPT(FLASH_IRQHandler, 24)
+{
+    uint8_t iapsr = FLASH->IAPSR;
+
+    if (iapsr & (FLASH_IAPSR_EOP_MASK | FLASH_IAPSR_WR_PG_DIS_MASK))
+    {
+        Flash_Done(iapsr);
+    }
+}
+#endif // FLASHPROG
+
+#ifdef EEQUEUE
+//=============================================================================
+// EEPROM write queue functions
+//
+// Writes to the data EEPROM are posted to a queue and the caller carries on
+// straight away. The queue writes them in the background one at a time,
+// starting the next from the end of programming interrupt, so nothing waits
+// the few ms each write takes.
+//
+// Entries are whole words with a mask of the bytes to write. A write to a
+// word that's already queued is merged into it. When the oldest entry shares
+// its block with other queued words they're all written together as one
+// block, which takes the same time as writing one word.
+//
+// A block write rewrites the whole block, so if the power fails during it
+// the rest of the block can be lost too. Words posted with EEQ_WriteWord,
+// e.g. by the key-value store, are never merged with anything for that
+// reason, and are written in the order they were posted.
+//
+// The top KV_AREA_SIZE bytes are kept for the key-value store. EEQ_Write
+// won't write there, so neither the application nor a block write can
+// overwrite its records. The size is a trade off between the wear levelling
+// of the store, which only spreads over its own area, and what's left for
+// the application. It must be whole blocks, from one block up to all 1K,
+// which leaves nothing for EEQ_Write. Define it before here to change it.
+//
+// A write the flash refuses fails its entry rather than leaving it at the
+// front of the queue, and if the flash was busy with something else when a
+// write was due the queue carries on from that write's done interrupt.
+//
+// The queue takes over the flash done callback.
+//
+
+#ifndef KV_AREA_SIZE
+#define KV_AREA_SIZE                512     // Whole blocks, 128 to 1024
+#endif
+#define KV_AREA_START               (FLASH_DATA_END + 1 - KV_AREA_SIZE)
+
+#define EEQ_ENTRIES                 16
+#define EEQ_NONE                    0xFF
+#define EEQ_ORDERED                 0x80    // Mask flag for words from EEQ_WriteWord
+
+typedef void (*eeq_done_cb_t)(bool ok);
+
+typedef struct
+{
+    uint16_t address;               // Word aligned
+    uint8_t data[FLASH_WORD_SIZE];
+    uint8_t mask;                   // Bytes of the word to write, and EEQ_ORDERED
+    eeq_done_cb_t done;             // Called once written, or NULL
+} eeq_entry_t;
+
+eeq_entry_t eeq_entries[EEQ_ENTRIES];   // Oldest first
+__IO uint8_t eeq_count;
+uint8_t eeq_in_flight;              // Entries at the front being written
+uint8_t eeq_block[FLASH_BLOCK_SIZE];
+__IO bool eeq_failed;
+
+//-----------------------------------------------------------------------------
+// Find the queued entry for a word that can still be changed
+//
+static uint8_t EEQ_Find(uint16_t address)
+{
+    uint8_t i;
+
+    for (i = eeq_in_flight; i < eeq_count; ++i)
+    {
+        if ((eeq_entries[i].address == address) && !(eeq_entries[i].mask & EEQ_ORDERED))
+        {
+            return i;
+        }
+    }
+    return EEQ_NONE;
+}
+
+//-----------------------------------------------------------------------------
+// Fill in the bytes of an entry that weren't posted from the EEPROM
+//
+static void EEQ_Fill(eeq_entry_t *entry, uint8_t *data)
+{
+    const uint8_t *current = (const uint8_t *)entry->address;
+    uint8_t i;
+
+    for (i = 0; i < FLASH_WORD_SIZE; ++i)
+    {
+        data[i] = (entry->mask & (1 << i)) ? entry->data[i] : current[i];
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Remove the entries that were being written
+//
+// Only the first can have a done function, as ordered words are never
+// written with others. It's called after the entry is removed, so it can
+// queue more.
+//
+static void EEQ_Remove(bool ok)
+{
+    uint8_t removed = eeq_in_flight;
+    eeq_done_cb_t done = eeq_entries[0].done;
+    uint8_t i;
+
+    if (!ok)
+    {
+        eeq_failed = true;
+    }
+    for (i = removed; i < eeq_count; ++i)
+    {
+        eeq_entries[i - removed] = eeq_entries[i];
+    }
+    eeq_count -= removed;
+    eeq_in_flight = 0;
+
+    if (done)
+    {
+        done(ok);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Start writing the oldest entry, with others in its block if possible
+//
+// Does nothing if a write is in flight or the flash is busy with something
+// else, in which case it's called again from the flash done callback.
+//
+static void EEQ_Start(void)
+{
+    eeq_entry_t *oldest = &eeq_entries[0];
+    uint16_t block;
+    uint8_t others;
+    uint8_t i;
+    uint8_t j;
+    eeq_entry_t swap;
+    const uint8_t *current;
+    bool started;
+
+    while (eeq_count && !eeq_in_flight && !Flash_Busy())
+    {
+        block = oldest->address & ~(FLASH_BLOCK_SIZE - 1);
+        others = 0;
+
+        // Bring the other plain words in the block up behind the oldest,
+        // stopping at an ordered word in the block so nothing overtakes it
+        if (!(oldest->mask & EEQ_ORDERED))
+        {
+            for (i = 1; i < eeq_count; ++i)
+            {
+                if ((eeq_entries[i].address & ~(FLASH_BLOCK_SIZE - 1)) != block)
+                {
+                    continue;
+                }
+                if (eeq_entries[i].mask & EEQ_ORDERED)
+                {
+                    break;
+                }
+                swap = eeq_entries[i];
+                for (j = i; j > others + 1; --j)
+                {
+                    eeq_entries[j] = eeq_entries[j - 1];
+                }
+                eeq_entries[++others] = swap;
+            }
+        }
+
+        eeq_in_flight = others + 1;
+        if (others)
+        {
+            current = (const uint8_t *)block;
+            for (i = 0; i < FLASH_BLOCK_SIZE; ++i)
+            {
+                eeq_block[i] = current[i];
+            }
+            for (i = 0; i <= others; ++i)
+            {
+                EEQ_Fill(&eeq_entries[i], &eeq_block[eeq_entries[i].address - block]);
+            }
+            started = Flash_WriteBlock(block, eeq_block);
+        }
+        else
+        {
+            EEQ_Fill(oldest, eeq_block);
+            started = Flash_WriteWord(oldest->address, eeq_block);
+        }
+        if (started)
+        {
+            return;
+        }
+
+        // Refused, e.g. the EEPROM is locked, so fail them and try the next
+        EEQ_Remove(false);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Flash done callback
+//
+// Removes the entries that have been written and starts on the next. With
+// nothing in flight it was some other write, so a stalled queue is started.
+//
+static void EEQ_FlashDone(bool ok)
+{
+    if (eeq_in_flight)
+    {
+        EEQ_Remove(ok);
+    }
+    EEQ_Start();
+}
+
+//-----------------------------------------------------------------------------
+// Initialise
+//
+// Flash_Init must have been called. Returns false if the data EEPROM couldn't
+// be unlocked.
+//
+bool EEQ_Init(void)
+{
+    eeq_count = 0;
+    eeq_in_flight = 0;
+    eeq_failed = false;
+    Flash_SetDoneCallback(EEQ_FlashDone);
+    return Flash_Unlock(FLASH_AREA_DATA);
+}
+
+//-----------------------------------------------------------------------------
+// Return how many more words can be queued
+//
+uint8_t EEQ_Free(void)
+{
+    return EEQ_ENTRIES - eeq_count;
+}
+
+//-----------------------------------------------------------------------------
+// Queue bytes to be written
+//
+// The data is copied so the caller's buffer is free straight away. Returns
+// false, having queued nothing, if the range isn't all data EEPROM below the
+// key-value store's area or there isn't room in the queue.
+//
+bool EEQ_Write(uint16_t address, const uint8_t *data, uint8_t length) CRITICAL
+{
+    uint16_t word = address & ~(FLASH_WORD_SIZE - 1);
+    uint16_t last = address + length - 1;
+    uint8_t needed = 0;
+    uint8_t index;
+    uint8_t offset;
+
+    if ((length == 0) || (address < FLASH_DATA_START) || (last >= KV_AREA_START) || (last < address))
+    {
+        return false;
+    }
+
+    // Check there's room before queueing any of it
+    for (; word <= last; word += FLASH_WORD_SIZE)
+    {
+        if (EEQ_Find(word) == EEQ_NONE)
+        {
+            ++needed;
+        }
+    }
+    if (needed > EEQ_ENTRIES - eeq_count)
+    {
+        return false;
+    }
+
+    while (length--)
+    {
+        word = address & ~(FLASH_WORD_SIZE - 1);
+        offset = address & (FLASH_WORD_SIZE - 1);
+        index = EEQ_Find(word);
+        if (index == EEQ_NONE)
+        {
+            index = eeq_count++;
+            eeq_entries[index].address = word;
+            eeq_entries[index].mask = 0;
+            eeq_entries[index].done = NULL;
+        }
+        eeq_entries[index].data[offset] = *data++;
+        eeq_entries[index].mask |= 1 << offset;
+        ++address;
+    }
+
+    EEQ_Start();
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Queue a whole word to be written in order
+//
+// The word is never merged with other writes and done, if not NULL, is
+// called from the interrupt once it's written. Returns false if the address
+// isn't a word in data EEPROM or the queue is full.
+//
+bool EEQ_WriteWord(uint16_t address, const uint8_t *data, eeq_done_cb_t done) CRITICAL
+{
+    eeq_entry_t *entry;
+    uint8_t i;
+
+    if ((address & (FLASH_WORD_SIZE - 1)) || (address < FLASH_DATA_START) || (address > FLASH_DATA_END) ||
+        (eeq_count == EEQ_ENTRIES))
+    {
+        return false;
+    }
+
+    entry = &eeq_entries[eeq_count++];
+    entry->address = address;
+    for (i = 0; i < FLASH_WORD_SIZE; ++i)
+    {
+        entry->data[i] = data[i];
+    }
+    entry->mask = ((1 << FLASH_WORD_SIZE) - 1) | EEQ_ORDERED;
+    entry->done = done;
+
+    EEQ_Start();
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Check if there are writes still to be done
+//
+bool EEQ_Busy(void)
+{
+    return eeq_count != 0;
+}
+
+//-----------------------------------------------------------------------------
+// Wait for all the queued writes to be done, e.g. before shutting down
+//
+// Interrupts must be enabled. Returns false if the queue didn't empty within
+// the timeout in ms, or a write has failed since the last flush.
+//
+bool EEQ_Flush(uint16_t timeout)
+{
+    uint16_t start = systick;
+    bool ok;
+
+    while (eeq_count && !Systick_Timeout(&start, timeout))
+    {
+    }
+    ok = (eeq_count == 0) && !eeq_failed;
+    eeq_failed = false;
+    return ok;
+}
+#endif // EEQUEUE
+
+#ifdef KVSTORE
+//=============================================================================
+// Key-value store functions
+//
+// Small settings are kept in the data EEPROM as a log of 8 byte records:
+//
+//  0   key         0 to KV_KEYS - 1
+//  1   length      0 to KV_VALUE_MAX, 0 when the key has been deleted
+//  2   value       KV_VALUE_MAX bytes
+//  6   sequence    Incremented for every record, wraps
+//  7   crc         CRC-8 of the other 7 bytes
+//
+// Records are written to the slots in turn round the store's area, the top
+// KV_AREA_SIZE bytes of the EEPROM, whichever key they're for, so a counter
+// that changes often wears all of that area evenly rather than one place.
+// The rest of the EEPROM isn't used by the store and gets none of the wear,
+// so a store that has to last longer needs a bigger KV_AREA_SIZE. Each
+// record is two word writes, as the EEPROM writes a word at a time anyway.
+//
+// The latest record for each key is the live one and its slot is kept in a
+// RAM index, so a lookup is just a read of the EEPROM. The index is built at
+// boot by checking every slot's CRC, using a nibble table to keep it to a
+// couple of ms, and going through them oldest to newest. The newest is the
+// one with the highest sequence number, which is unambiguous as there are
+// fewer slots than half the sequence numbers.
+//
+// Garbage collection makes sure the two slots ahead of the next write don't
+// hold live records. A live record there is copied to the next slot first,
+// so there's always an older copy until the new one is complete. A write
+// that's cut short fails its CRC and the older record is used.
+//
+// Writes are queued by KV_Set on the EEPROM write queue, so they don't hold
+// up the caller.
+//
+
+#define KV_SLOT_SIZE                8
+#define KV_SLOTS                    (KV_AREA_SIZE / KV_SLOT_SIZE)
+#define KV_KEYS                     32
+#define KV_VALUE_MAX                4
+#define KV_NONE                     0xFF
+
+typedef struct
+{
+    uint8_t key;
+    uint8_t length;
+    uint8_t value[KV_VALUE_MAX];
+    uint8_t sequence;
+    uint8_t crc;
+} kv_record_t;
+
+static const uint8_t kv_crc_table[16] =
+{
+    0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15,
+    0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D
+};
+
+uint8_t kv_index[KV_KEYS];          // Slot of each key's live record
+uint8_t kv_head;                    // Next slot to write
+uint8_t kv_sequence;                // Sequence number of the next record
+kv_record_t kv_record;              // Record being written
+kv_record_t kv_pending;             // Record waiting to be written
+bool kv_pending_valid;
+__IO bool kv_busy;
+__IO bool kv_failed;                // A write couldn't be done
+bool kv_word_ok;                    // First word of the record was written
+
+//-----------------------------------------------------------------------------
+// CRC-8, polynomial 0x07, a nibble at a time
+//
+static uint8_t KV_CRC(const uint8_t *data, uint8_t length)
+{
+    uint8_t crc = 0xFF;
+
+    while (length--)
+    {
+        crc ^= *data++;
+        crc = (crc << 4) ^ kv_crc_table[crc >> 4];
+        crc = (crc << 4) ^ kv_crc_table[crc >> 4];
+    }
+    return crc;
+}
+
+//-----------------------------------------------------------------------------
+// Return a slot's record in the EEPROM
+//
+inline const kv_record_t *KV_Slot(uint8_t slot)
+{
+    return (const kv_record_t *)(KV_AREA_START + (uint16_t)slot * KV_SLOT_SIZE);
+}
+
+//-----------------------------------------------------------------------------
+// Check a slot holds a good record
+//
+static bool KV_Valid(const kv_record_t *record)
+{
+    return (record->key < KV_KEYS) && (record->length <= KV_VALUE_MAX) &&
+           (KV_CRC((const uint8_t *)record, KV_SLOT_SIZE - 1) == record->crc);
+}
+
+//-----------------------------------------------------------------------------
+// Check if a slot holds the live record for its key
+//
+static bool KV_Live(uint8_t slot)
+{
+    const kv_record_t *record = KV_Slot(slot);
+    return (record->key < KV_KEYS) && (kv_index[record->key] == slot);
+}
+
+static void KV_WordDone(bool ok);
+static void KV_RecordDone(bool ok);
+
+//-----------------------------------------------------------------------------
+// Start writing the next record, if there is one
+//
+// A live record in the slot after the head is moved out of the way first.
+// Both words of the record are queued together and written in order.
+//
+static void KV_Next(void)
+{
+    uint8_t next = (kv_head + 1) % KV_SLOTS;
+    const kv_record_t *record;
+    uint16_t address;
+    uint8_t i;
+
+    if (KV_Live(next))
+    {
+        record = KV_Slot(next);
+    }
+    else if (kv_pending_valid)
+    {
+        record = &kv_pending;
+        kv_pending_valid = false;
+    }
+    else
+    {
+        kv_busy = false;
+        return;
+    }
+
+    kv_record.key = record->key;
+    kv_record.length = record->length;
+    for (i = 0; i < KV_VALUE_MAX; ++i)
+    {
+        kv_record.value[i] = record->value[i];
+    }
+
+    kv_record.sequence = kv_sequence;
+    kv_record.crc = KV_CRC((const uint8_t *)&kv_record, KV_SLOT_SIZE - 1);
+    address = (uint16_t)KV_Slot(kv_head);
+    if ((EEQ_Free() < 2) ||
+        !EEQ_WriteWord(address, (const uint8_t *)&kv_record, KV_WordDone) ||
+        !EEQ_WriteWord(address + FLASH_WORD_SIZE, (const uint8_t *)&kv_record + FLASH_WORD_SIZE, KV_RecordDone))
+    {
+        kv_failed = true;
+        kv_pending_valid = false;
+        kv_busy = false;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Write queue callbacks
+//
+// Called from the interrupt once each word of a record is written.
+//
+static void KV_WordDone(bool ok)
+{
+    kv_word_ok = ok;
+}
+
+static void KV_RecordDone(bool ok)
+{
+    if (!ok || !kv_word_ok)
+    {
+        kv_failed = true;
+        kv_pending_valid = false;
+        kv_busy = false;
+        return;
+    }
+
+    // Record complete, it's now the live one
+    kv_index[kv_record.key] = kv_head;
+    kv_head = (kv_head + 1) % KV_SLOTS;
+    ++kv_sequence;
+    KV_Next();
+}
+
+//-----------------------------------------------------------------------------
+// Initialise and build the index
+//
+// The records are written through the EEPROM write queue, so EEQ_Init must
+// have been called.
+//
+void KV_Init(void)
+{
+    uint8_t valid[KV_SLOTS / 8];
+    const kv_record_t *record;
+    uint8_t newest = KV_NONE;
+    uint8_t slot;
+    uint8_t i;
+
+    for (i = 0; i < KV_KEYS; ++i)
+    {
+        kv_index[i] = KV_NONE;
+    }
+
+    // Find the good records and the newest of them
+    for (slot = 0; slot < KV_SLOTS; ++slot)
+    {
+        record = KV_Slot(slot);
+        if (KV_Valid(record))
+        {
+            valid[slot >> 3] |= 1 << (slot & 7);
+            if ((newest == KV_NONE) || ((int8_t)(record->sequence - KV_Slot(newest)->sequence) > 0))
+            {
+                newest = slot;
+            }
+        }
+        else
+        {
+            valid[slot >> 3] &= ~(1 << (slot & 7));
+        }
+    }
+
+    if (newest == KV_NONE)
+    {
+        kv_head = 0;
+        kv_sequence = 0;
+    }
+    else
+    {
+        kv_head = (newest + 1) % KV_SLOTS;
+        kv_sequence = KV_Slot(newest)->sequence + 1;
+    }
+
+    // Oldest first so the newest record for a key ends up in the index
+    slot = kv_head;
+    for (i = 0; i < KV_SLOTS; ++i)
+    {
+        if (valid[slot >> 3] & (1 << (slot & 7)))
+        {
+            kv_index[KV_Slot(slot)->key] = slot;
+        }
+        slot = (slot + 1) % KV_SLOTS;
+    }
+
+    kv_pending_valid = false;
+    kv_busy = false;
+    kv_failed = false;
+}
+
+//-----------------------------------------------------------------------------
+// Read a value
+//
+// Returns the length of the value, 0 if the key hasn't been set or has been
+// deleted. At most size bytes are copied.
+//
+uint8_t KV_Get(uint8_t key, uint8_t *value, uint8_t size)
+{
+    const kv_record_t *record;
+    uint8_t i;
+
+    if ((key >= KV_KEYS) || (kv_index[key] == KV_NONE))
+    {
+        return 0;
+    }
+    record = KV_Slot(kv_index[key]);
+    for (i = 0; (i < record->length) && (i < size); ++i)
+    {
+        value[i] = record->value[i];
+    }
+    return record->length;
+}
+
+//-----------------------------------------------------------------------------
+// Start writing a value
+//
+// A length of 0 deletes the key. The value is copied so the caller's buffer
+// is free straight away. KV_Get returns the old value until the write is
+// done. Returns false if a write is still in progress or the key or length
+// is out of range.
+//
+bool KV_Set(uint8_t key, const uint8_t *value, uint8_t length) CRITICAL
+{
+    uint8_t i;
+
+    if (kv_busy || (key >= KV_KEYS) || (length > KV_VALUE_MAX))
+    {
+        return false;
+    }
+
+    kv_pending.key = key;
+    kv_pending.length = length;
+    for (i = 0; i < KV_VALUE_MAX; ++i)
+    {
+        kv_pending.value[i] = (i < length) ? value[i] : 0;
+    }
+    kv_pending_valid = true;
+    kv_busy = true;
+    KV_Next();
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Check if a write is in progress
+//
+bool KV_Busy(void)
+{
+    return kv_busy;
+}
+
+//-----------------------------------------------------------------------------
+// Return and clear whether a write has failed
+//
+bool KV_TakeFailed(void) CRITICAL
+{
+    bool failed = kv_failed;
+    kv_failed = false;
+    return failed;
+}
+#endif // KVSTORE
+
+//=============================================================================
+// I2C functions
+//
+//
+
+// Use when clock is 10Mhz
+// MSbit is the duty cycle, rest is the CCR value
+/*typedef enum
+{
+    I2C_SPEED_400KHZ    = 0x8001,
+    I2C_SPEED_370KHZ    = 0x0009,
+    I2C_SPEED_350KHZ    = 0x0009,
+    I2C_SPEED_320KHZ    = 0x000A,
+    I2C_SPEED_300KHZ    = 0x000B,
+    I2C_SPEED_270KHZ    = 0x000C,
+    I2C_SPEED_250KHZ    = 0x000D,
+    I2C_SPEED_220KHZ    = 0x000F,
+    I2C_SPEED_200KHZ    = 0x8002,
+    I2C_SPEED_170KHZ    = 0x0013,
+    I2C_SPEED_150KHZ    = 0x0016,
+    I2C_SPEED_120KHZ    = 0x001B,
+    I2C_SPEED_100KHZ    = 0x0032,
+    I2C_SPEED_50KHZ     = 0x0064,
+    I2C_SPEED_30KHZ     = 0x00A6,
+    I2C_SPEED_20KHZ     = 0x00FA
+} i2c_speed_t;
+*/
+
+typedef enum
+{
+    I2C_SPEED_STANDARD,
+    I2C_SPEED_FULL
+} i2c_speed_t;
+
+// Use when clock is 16Mhz
+// MSbit is the duty cycle, rest is the CCR value
+typedef enum
+{
+    I2C_FREQUENCY_400KHZ    = 0x000D,
+    I2C_FREQUENCY_370KHZ    = 0x000E,
+    I2C_FREQUENCY_350KHZ    = 0x000F,
+    I2C_FREQUENCY_320KHZ    = 0x8002,
+    I2C_FREQUENCY_300KHZ    = 0x0011,
+    I2C_FREQUENCY_270KHZ    = 0x0013,
+    I2C_FREQUENCY_250KHZ    = 0x0015,
+    I2C_FREQUENCY_220KHZ    = 0x0018,
+    I2C_FREQUENCY_200KHZ    = 0x001A,
+    I2C_FREQUENCY_170KHZ    = 0x001F,
+    I2C_FREQUENCY_150KHZ    = 0x0023,
+    I2C_FREQUENCY_120KHZ    = 0x002C,
+    I2C_FREQUENCY_100KHZ    = 0x0050,
+    I2C_FREQUENCY_50KHZ     = 0x00A0,
+    I2C_FREQUENCY_30KHZ     = 0x010A,
+    I2C_FREQUENCY_20KHZ     = 0x0190
+} i2c_frequency_t;
+
+typedef enum
+{
+    I2C_DIRECTION_WRITE = 0,
+    I2C_DIRECTION_READ  = 1
+} i2c_direction_t;
+
+/**
+  * @brief  I2C Flags
+  * @brief Elements values convention: 0xXXYY
+  *  X = SRx registers index
+  *      X = 1 : SR1
+  *      X = 2 : SR2
+  *      X = 3 : SR3
+  *  Y = Flag mask in the register
+  */
+typedef enum
+{
+  /* SR1 register flags */
+  I2C_FLAG_TXEMPTY             = (uint16_t)0x0180,  /*!< Transmit Data Register Empty flag */
+  I2C_FLAG_RXNOTEMPTY          = (uint16_t)0x0140,  /*!< Read Data Register Not Empty flag */
+  I2C_FLAG_STOPDETECTION       = (uint16_t)0x0110,  /*!< Stop detected flag */
+  I2C_FLAG_HEADERSENT          = (uint16_t)0x0108,  /*!< 10-bit Header sent flag */
+  I2C_FLAG_TRANSFERFINISHED    = (uint16_t)0x0104,  /*!< Data Byte Transfer Finished flag */
+  I2C_FLAG_ADDRESSSENTMATCHED  = (uint16_t)0x0102,  /*!< Address Sent/Matched (master/slave) flag */
+  I2C_FLAG_STARTDETECTION      = (uint16_t)0x0101,  /*!< Start bit sent flag */
+
+  /* SR2 register flags */
+  I2C_FLAG_WAKEUPFROMHALT      = (uint16_t)0x0220,  /*!< Wake Up From Halt Flag */
+  I2C_FLAG_OVERRUNUNDERRUN     = (uint16_t)0x0208,  /*!< Overrun/Underrun flag */
+  I2C_FLAG_ACKNOWLEDGEFAILURE  = (uint16_t)0x0204,  /*!< Acknowledge Failure Flag */
+  I2C_FLAG_ARBITRATIONLOSS     = (uint16_t)0x0202,  /*!< Arbitration Loss Flag */
+  I2C_FLAG_BUSERROR            = (uint16_t)0x0201,  /*!< Misplaced Start or Stop condition */
+
+  /* SR3 register flags */
+  I2C_FLAG_GENERALCALL         = (uint16_t)0x0310,  /*!< General Call header received Flag */
+  I2C_FLAG_TRANSMITTERRECEIVER = (uint16_t)0x0304,  /*!< Transmitter Receiver Flag */
+  I2C_FLAG_BUSBUSY             = (uint16_t)0x0302,  /*!< Bus Busy Flag */
+  I2C_FLAG_MASTERSLAVE         = (uint16_t)0x0301   /*!< Master Slave Flag */
+} I2C_Flag_TypeDef;
+
+/**
+  * @brief I2C Pending bits
+  * Elements values convention: 0xXYZZ
+  *  X = SRx registers index
+  *      X = 1 : SR1
+  *      X = 2 : SR2
+  *  Y = Position of the corresponding Interrupt
+  *  ZZ = flag mask in the dedicated register(X register)
+  */
+
+typedef enum
+{
+    /* SR1 register flags */
+    I2C_ITPENDINGBIT_TXEMPTY             = (uint16_t)0x1680,    /*!< Transmit Data Register Empty  */
+    I2C_ITPENDINGBIT_RXNOTEMPTY          = (uint16_t)0x1640,    /*!< Read Data Register Not Empty  */
+    I2C_ITPENDINGBIT_STOPDETECTION       = (uint16_t)0x1210,    /*!< Stop detected  */
+    I2C_ITPENDINGBIT_HEADERSENT          = (uint16_t)0x1208,    /*!< 10-bit Header sent */
+    I2C_ITPENDINGBIT_TRANSFERFINISHED    = (uint16_t)0x1204,    /*!< Data Byte Transfer Finished  */
+    I2C_ITPENDINGBIT_ADDRESSSENTMATCHED  = (uint16_t)0x1202,    /*!< Address Sent/Matched (master/slave)  */
+    I2C_ITPENDINGBIT_STARTDETECTION      = (uint16_t)0x1201,    /*!< Start bit sent  */
+
+    /* SR2 register flags */
+    I2C_ITPENDINGBIT_WAKEUPFROMHALT      = (uint16_t)0x2220,    /*!< Wake Up From Halt  */
+    I2C_ITPENDINGBIT_OVERRUNUNDERRUN     = (uint16_t)0x2108,    /*!< Overrun/Underrun  */
+    I2C_ITPENDINGBIT_ACKNOWLEDGEFAILURE  = (uint16_t)0x2104,    /*!< Acknowledge Failure  */
+    I2C_ITPENDINGBIT_ARBITRATIONLOSS     = (uint16_t)0x2102,    /*!< Arbitration Loss  */
+    I2C_ITPENDINGBIT_BUSERROR            = (uint16_t)0x2101     /*!< Misplaced Start or Stop condition */
+} I2C_ITPendingBit_TypeDef;
+
+/**
+  * @brief I2C possible events
+  * Values convention: 0xXXYY
+  * XX = Event SR3 corresponding value
+  * YY = Event SR1 corresponding value
+  * @note if Event = EV3_2 the rule above does not apply
+  * YY = Event SR2 corresponding value
+  */
+
+typedef enum
+{
+  /*========================================
+                       I2C Master Events (Events grouped in order of communication)
+                                                          ==========================================*/
+  /**
+    * @brief  Communication start
+    *
+    * After sending the START condition (I2C_GenerateSTART() function) the master
+    * has to wait for this event. It means that the Start condition has been correctly
+    * released on the I2C bus (the bus is free, no other devices is communicating).
+    *
+    */
+  /* --EV5 */
+  I2C_EVENT_MASTER_MODE_SELECT               = (uint16_t)0x0301,  /*!< BUSY, MSL and SB flag */
+
+  /**
+    * @brief  Address Acknowledge
+    *
+    * After checking on EV5 (start condition correctly released on the bus), the
+    * master sends the address of the slave(s) with which it will communicate
+    * (I2C_Send7bitAddress() function, it also determines the direction of the communication:
+    * Master transmitter or Receiver).
+    * Then the master has to wait that a slave acknowledges his address.
+    * If an acknowledge is sent on the bus, one of the following events will
+    * be set:
+    *
+    *  1) In case of Master Receiver (7-bit addressing):
+    *  the I2C_EVENT_MASTER_RECEIVER_MODE_SELECTED event is set.
+    *
+    *  2) In case of Master Transmitter (7-bit addressing):
+    *  the I2C_EVENT_MASTER_TRANSMITTER_MODE_SELECTED is set
+    *
+    *  3) In case of 10-Bit addressing mode, the master (just after generating the START
+    *  and checking on EV5) has to send the header of 10-bit addressing mode (I2C_SendData()
+    *  function).
+    *  Then master should wait on EV9. It means that the 10-bit addressing
+    *  header has been correctly sent on the bus.
+    *  Then master should send the second part of the 10-bit address (LSB) using
+    *  the function I2C_Send7bitAddress(). Then master should wait for event EV6.
+    *
+    */
+  /* --EV6 */
+  I2C_EVENT_MASTER_TRANSMITTER_MODE_SELECTED = (uint16_t)0x0782,  /*!< BUSY, MSL, ADDR, TXE and TRA flags */
+  I2C_EVENT_MASTER_RECEIVER_MODE_SELECTED    = (uint16_t)0x0302,  /*!< BUSY, MSL and ADDR flags */
+  /* --EV9 */
+  I2C_EVENT_MASTER_MODE_ADDRESS10            = (uint16_t)0x0308,  /*!< BUSY, MSL and ADD10 flags */
+
+  /**
+    * @brief Communication events
+    *
+    * If a communication is established (START condition generated and slave address
+    * acknowledged) then the master has to check on one of the following events for
+    * communication procedures:
+    *
+    * 1) Master Receiver mode: The master has to wait on the event EV7 then to read
+    *    the data received from the slave (I2C_ReceiveData() function).
+    *
+    * 2) Master Transmitter mode: The master has to send data (I2C_SendData()
+    *    function) then to wait on event EV8 or EV8_2.
+    *    These two events are similar:
+    *     - EV8 means that the data has been written in the data register and is
+    *       being shifted out.
+    *     - EV8_2 means that the data has been physically shifted out and output
+    *       on the bus.
+    *     In most cases, using EV8 is sufficient for the application.
+    *     Using EV8_2 leads to a slower communication but ensures more reliable test.
+    *     EV8_2 is also more suitable than EV8 for testing on the last data transmission
+    *     (before Stop condition generation).
+    *
+    *  @note In case the user software does not guarantee that this event EV7 is
+    *  managed before the current byte end of transfer, then user may check on EV7
+    *  and BTF flag at the same time (ie. (I2C_EVENT_MASTER_BYTE_RECEIVED | I2C_FLAG_BTF)).
+    *  In this case the communication may be slower.
+    *
+    */
+  /* Master RECEIVER mode -----------------------------*/
+  /* --EV7 */
+  I2C_EVENT_MASTER_BYTE_RECEIVED             = (uint16_t)0x0340,  /*!< BUSY, MSL and RXNE flags */
+
+  /* Master TRANSMITTER mode --------------------------*/
+  /* --EV8 */
+  I2C_EVENT_MASTER_BYTE_TRANSMITTING         = (uint16_t)0x0780,  /*!< TRA, BUSY, MSL, TXE flags */
+  /* --EV8_2 */
+
+  I2C_EVENT_MASTER_BYTE_TRANSMITTED          = (uint16_t)0x0784,  /*!< EV8_2: TRA, BUSY, MSL, TXE and BTF flags */
+
+
+  /*========================================
+                       I2C Slave Events (Events grouped in order of communication)
+                                                          ==========================================*/
+
+  /**
+    * @brief  Communication start events
+    *
+    * Wait on one of these events at the start of the communication. It means that
+    * the I2C peripheral detected a Start condition on the bus (generated by master
+    * device) followed by the peripheral address.
+    * The peripheral generates an ACK condition on the bus (if the acknowledge
+    * feature is enabled through function I2C_AcknowledgeConfig()) and the events
+    * listed above are set :
+    *
+    * 1) In normal case (only one address managed by the slave), when the address
+    *   sent by the master matches the own address of the peripheral (configured by
+    *   I2C_OwnAddress1 field) the I2C_EVENT_SLAVE_XXX_ADDRESS_MATCHED event is set
+    *   (where XXX could be TRANSMITTER or RECEIVER).
+    *
+    * 2) In case the address sent by the master is General Call (address 0x00) and
+    *   if the General Call is enabled for the peripheral (using function I2C_GeneralCallCmd())
+    *   the following event is set I2C_EVENT_SLAVE_GENERALCALLADDRESS_MATCHED.
+    *
+    */
+
+  /* --EV1  (all the events below are variants of EV1) */
+  /* 1) Case of One Single Address managed by the slave */
+  I2C_EVENT_SLAVE_RECEIVER_ADDRESS_MATCHED    = (uint16_t)0x0202,  /*!< BUSY and ADDR flags */
+  I2C_EVENT_SLAVE_TRANSMITTER_ADDRESS_MATCHED = (uint16_t)0x0682,  /*!< TRA, BUSY, TXE and ADDR flags */
+
+  /* 2) Case of General Call enabled for the slave */
+  I2C_EVENT_SLAVE_GENERALCALLADDRESS_MATCHED  = (uint16_t)0x1200,  /*!< EV2: GENCALL and BUSY flags */
+
+  /**
+    * @brief  Communication events
+    *
+    * Wait on one of these events when EV1 has already been checked :
+    *
+    * - Slave RECEIVER mode:
+    *     - EV2: When the application is expecting a data byte to be received.
+    *     - EV4: When the application is expecting the end of the communication:
+    *       master sends a stop condition and data transmission is stopped.
+    *
+    * - Slave Transmitter mode:
+    *    - EV3: When a byte has been transmitted by the slave and the application
+    *      is expecting the end of the byte transmission.
+    *      The two events I2C_EVENT_SLAVE_BYTE_TRANSMITTED and I2C_EVENT_SLAVE_BYTE_TRANSMITTING
+    *      are similar. The second one can optionally be used when the user software
+    *      doesn't guarantee the EV3 is managed before the current byte end of transfer.
+    *    - EV3_2: When the master sends a NACK in order to tell slave that data transmission
+    *      shall end (before sending the STOP condition).
+    *      In this case slave has to stop sending data bytes and expect a Stop
+    *      condition on the bus.
+    *
+    *  @note In case the  user software does not guarantee that the event EV2 is
+    *  managed before the current byte end of transfer, then user may check on EV2
+    *  and BTF flag at the same time (ie. (I2C_EVENT_SLAVE_BYTE_RECEIVED | I2C_FLAG_BTF)).
+    *  In this case the communication may be slower.
+    *
+    */
+  /* Slave RECEIVER mode --------------------------*/
+  /* --EV2 */
+  I2C_EVENT_SLAVE_BYTE_RECEIVED              = (uint16_t)0x0240,  /*!< BUSY and RXNE flags */
+  /* --EV4  */
+  I2C_EVENT_SLAVE_STOP_DETECTED              = (uint16_t)0x0010,  /*!< STOPF flag */
+
+  /* Slave TRANSMITTER mode -----------------------*/
+  /* --EV3 */
+  I2C_EVENT_SLAVE_BYTE_TRANSMITTED           = (uint16_t)0x0684,  /*!< TRA, BUSY, TXE and BTF flags */
+  I2C_EVENT_SLAVE_BYTE_TRANSMITTING          = (uint16_t)0x0680,  /*!< TRA, BUSY and TXE flags */
+  /* --EV3_2 */
+  I2C_EVENT_SLAVE_ACK_FAILURE                = (uint16_t)0x0004  /*!< AF flag */
+} I2C_Event_TypeDef;
+
+//=============================================================================
+// Calculate CCR values
+//
+// This function will calculate the CCR and DUTY values for a given peripheral
+// clock frequency and requested I2C data rate. The function works by iteratively
+// going through all potential CCR/DUTY values and finding the one which is the
+// closest to the requested speed.
+//
+// The system clock in Mhz is passed in freq and the requested speed is passed
+// in speed. The CCR & DUTY values that produce an actual speed with the smallest
+// margin of error are returned.
+
+// Calculation to deduce CCR from a requested frequency is:
+// 1/((CCR/freq)) * [2|3|25]
+//
+// Examples:
+// 1/((1/10Mhz) * 25)
+// 1/(0.0000001 * 25)
+// 1/0.0000025 => 400000
+//
+// 1/((9/10Mhz) * 3)
+// 1/(0.0000009 * 3)
+// 1/0.0000027 => 370370.3703
+//
+// 1/((13/16Mhz) * 3)
+// 1/(0.000000812 * 3)
+// 1/0.000002438 => 410256.4102
+// Error is 410256-400000 => 10256/400000 = 2.56%
+//
+// 1/((14/freq) * 3)
+// 1/((14/16000000) * 3)
+// 1/(0.000000875 * 3)
+// 1/0.000002625 => 380952.3809
+// Error is 380952-370000  => 10952/370000 = 2.96%
+//
+// Using integers only:
+// 1000000000 / (((CCR * 1000) / Mhz) * DUTY)
+//
+// Example calculations:
+// 1000000000 / ((1000/10) * 25) => 400000 => 400Khz
+// 1000000000 / ((9000/10) * 30) => 370370 => 370Khz
+// 1000000000 / ((14000/16) * 30) => 380952 => 370Khz
+// 1000000000 / ((20000/16) * 25) => 320000 => 320Khz
+// 1000000000 / ((250000/10) * 2) => 20000 => 20Khz
+//
+
+// Calculate actual speed for a given clock frequency and ccr/duty values
+static uint32_t CalcSpeed(uint8_t freq, uint32_t ccr, uint8_t duty)
+{
+    return 1000000000UL / (((ccr * 1000UL) / freq) * (uint32_t)(duty));
+}
+
+// Calculate margin of error for actual speed against requested speed
+// Returns value accurate to two decimal places but as integer so needs dividing by 100.
+static uint32_t CalcError(uint32_t req, uint32_t act)
+{
+    if (req > act)
+    {
+        return ((req - act) * 10000) / req;
+    }
+    return ((act - req) * 10000) / req;
+}
+
+void I2C_CalculateCCR(uint8_t freq, uint32_t speed, uint16_t *ccr, uint8_t *duty, uint32_t *actual, uint32_t *error)
+{
+    uint32_t prev_speed_0 = 0;
+    uint32_t calc_speed_0;
+    uint32_t calc_speed_1;
+    uint32_t i;
+
+    if (speed > 100000)
+    {
+        // Fast mode speeds, duty used in this mode so two calculations need to be carried out
+        for (i = 1; i < 4096; ++i)
+        {
+            calc_speed_0 = CalcSpeed(freq, i, 3);       // Duty 0 (2:1)
+            calc_speed_1 = CalcSpeed(freq, i, 25);      // Duty 1 (16:9)
+            if (calc_speed_0 == speed)
+            {
+                *duty = 0;
+                *ccr = i;
+                *actual = calc_speed_0;
+                *error = 0;
+                return;
+            }
+            if (calc_speed_1 == speed)
+            {
+                *duty = 1;
+                *ccr = i;
+                *actual = calc_speed_1;
+                *error = 0;
+                return;
+            }
+            if (calc_speed_0 < speed)
+            {
+                // Calculated speed lower than requested, find which is closer,
+                // the current speed or the previously calculated speed.
+                //
+                // Duty is nearly always 0 in this case, so assume 0.
+                // TODO: Find out if this is case with duty=0 at all clock frequencies.
+                *duty = 0;
+                if ((prev_speed_0 - speed) > (speed - calc_speed_0))
+                {
+                    // Currently calculated speed is closer
+                    *error = CalcError(speed, calc_speed_0);
+                    *actual = calc_speed_0;
+                    *ccr = i;
+                }
+                else
+                {
+                    // Previously calculated speed is closer
+                    *error = CalcError(speed, prev_speed_0);
+                    *actual = prev_speed_0;
+                    *ccr = i - 1;
+                }
+                return;
+            }
+            prev_speed_0 = calc_speed_0;
+        }
+    }
+    else
+    {
+        // Standard mode speeds, duty is ignored in this mode
+        for (i = 1; i < 4096; ++i)
+        {
+            calc_speed_0 = CalcSpeed(freq, i, 2);       // 1:1 duty cycle
+            if (calc_speed_0 == speed)
+            {
+                *duty = 0;
+                *ccr = i;
+                *actual = calc_speed_0;
+                *error = 0;
+                return;
+            }
+            if (calc_speed_0 < speed)
+            {
+                *duty = 0;
+                if ((prev_speed_0 - speed) > (speed - calc_speed_0))
+                {
+                    // Currently calculated speed is closer
+                    *error = CalcError(speed, calc_speed_0);
+                    *actual = calc_speed_0;
+                    *ccr = i;
+                }
+                else
+                {
+                    // Previously calculated speed is closer
+                    *error = CalcError(speed, prev_speed_0);
+                    *actual = prev_speed_0;
+                    *ccr = i - 1;
+                }
+                return;
+            }
+            prev_speed_0 = calc_speed_0;
+        }
+    }
+
+    // No matching settings found, probably due to clock frequency being too low
+    // for the requested speed.
+    *ccr = 0;
+    *duty = 0;
+    *actual = 0;
+    *error = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Disable the I2C peripheral
+//
+void I2C_Disable(void)
+{
+    I2C->CR1 = (I2C->CR1 & ~I2C_CR1_PE_MASK) | I2C_CR1_PE_DISABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Enable the I2C peripheral
+//
+void I2C_Enable(void)
+{
+    I2C->CR1 = (I2C->CR1 & ~I2C_CR1_PE_MASK) | I2C_CR1_PE_ENABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Disable start condition
+//
+void I2C_DisbleStart(void)
+{
+    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_START_MASK) | I2C_CR2_START_DISABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Enable start condition
+//
+void I2C_EnableStart(void)
+{
+    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_START_MASK) | I2C_CR2_START_ENABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Disable stop condition
+//
+void I2C_DisableStop(void)
+{
+    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_STOP_MASK) | I2C_CR2_STOP_DISABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Enable stop condition
+//
+void I2C_EnableStop(void)
+{
+    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_STOP_MASK) | I2C_CR2_STOP_ENABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Disable sending ACK
+//
+void I2C_DisableACK(void)
+{
+    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_ACK_MASK) | I2C_CR2_ACK_DISABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Enable sending ACK condition
+//
+void I2C_EnableACK(void)
+{
+    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_ACK_MASK) | I2C_CR2_ACK_ENABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Perform a software reset of the peripheral
+//
+// This is used if the peripheral gets stuck in the busy state due to
+// a misbehaving slave device or problems on the line.
+//
+void I2C_SoftwareReset(void)
+{
+    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_SWRST_MASK) | I2C_CR2_SWRST_RESET;
+    // TODO: Any delay required?
+    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_SWRST_MASK) | I2C_CR2_SWRST_RUNNING;
+}
+
+//-----------------------------------------------------------------------------
+// Disable clock stretching
+//
+void I2C_DisableClockStretch(void)
+{
+    I2C->CR1 = (I2C->CR1 & ~I2C_CR1_NOSTRETCH_MASK) | I2C_CR1_NOSTRETCH_DISABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Enable clock stretching
+//
+void I2C_EnableClockStretch(void)
+{
+    I2C->CR1 = (I2C->CR1 & ~I2C_CR1_NOSTRETCH_MASK) | I2C_CR1_NOSTRETCH_ENABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Check bus busy state
+//
+// Note that this reads SR3 and reading this register after SR1 has been read
+// clears the ADDR flag in SR1. Therefore only call this function before any
+// communications is started, do not use in the middle of any transaction.
+//
+bool I2C_BusBusy(void)
+{
+    return (I2C->SR3 & I2C_SR3_BUSY_MASK) == I2C_SR3_BUSY_ONGOING;
+}
+
+//-----------------------------------------------------------------------------
+// Initialise the I2C peripheral
+//
+// Note that a system clock frequency multiple of 10Mhz is needed as this
+// satisfies the requirement for fast mode at 400Khz.
+//
+void I2C_Init(i2c_speed_t speed, uint8_t freq, uint16_t ccr, uint8_t duty)
+{
+    I2C_Disable();
+    I2C->FREQR = freq;
+    I2C->CCRL = (ccr >> 0) & I2C_CCRL_CCR_MASK;
+    I2C->CCRH = (ccr >> 8) & I2C_CCRH_CCR_MASK;
+    I2C->CCRH = (I2C->CCRH & ~I2C_CCRH_FS_MASK) | speed;
+    I2C->CCRH = (I2C->CCRH & ~I2C_CCRH_DUTY_MASK) | duty;
+    I2C->OARH = (I2C->OARH & ~(I2C_OARH_ADDMODE_MASK | I2C_OARH_ADDCONF_MASK)) | I2C_OARH_ADDMODE_7BIT | I2C_OARH_ADDCONF;
+    if (speed == I2C_SPEED_STANDARD)
+    {
+        I2C->TRISER = I2C->FREQR + 1;
+    }
+    else
+    {
+        I2C->TRISER = ((I2C->FREQR * 3) / 10) + 1;;
+    }
+    I2C_Enable();
+}
+
+//-----------------------------------------------------------------------------
+// Configure for standard mode I2C comms master
+//
+// Assumes 7-bit addressing, default acknowledgement
+//
+void I2C_ConfigStdModeMaster(void)
+{
+    I2C_EnableACK();
+    I2C_EnableStart();
+
+    // Errors are picked up by the interrupt handler
+    I2C->ITR = (I2C->ITR & ~I2C_ITR_ERREN_MASK) | I2C_ITR_ERREN_ENABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Bus recovery
+//
+// A slave that was interrupted part way through a read (eg. by a reset of the
+// master) can hold SDA low waiting for more clocks. The cure is to take the
+// pins as GPIO and clock SCL until the slave lets go of SDA, at most 9 clocks
+// for 8 data bits and an ACK, then generate a STOP.
+//
+// The SCL and SDA pins are PB4 and PB5 on the STM8S105 and are already set as
+// open drain outputs by Gpio_Config.
+//
+
+#define I2C_SCL                     PIN(B,4)
+#define I2C_SDA                     PIN(B,5)
+#define I2C_RECOVERY_CLOCKS         9
+
+//-----------------------------------------------------------------------------
+// Delay for half a bit period at 100Khz
+//
+// About 5us at 16Mhz, a volatile count down takes around 8 cycles a loop.
+//
+static void I2C_HalfBitDelay(void)
+{
+    __IO uint8_t i = 10;
+    while (--i)
+    {
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Release SCL and wait for it to go high in case a slave is stretching it
+//
+static void I2C_ReleaseSCL(void)
+{
+    uint8_t wait = 100;
+
+    Pin_Set(I2C_SCL);
+    while (!Pin_Read(I2C_SCL) && --wait)
+    {
+    }
+    I2C_HalfBitDelay();
+}
+
+//-----------------------------------------------------------------------------
+// Free a stuck bus by clocking out a slave and generating a STOP
+//
+// The peripheral's registers are saved and restored round a software reset
+// so the caller doesn't need to initialise it again. Takes about 100us.
+//
+// Returns true if SDA is released at the end.
+//
+bool I2C_BusRecover(void)
+{
+    uint8_t freqr = I2C->FREQR;
+    uint8_t ccrl = I2C->CCRL;
+    uint8_t ccrh = I2C->CCRH;
+    uint8_t triser = I2C->TRISER;
+    uint8_t oarl = I2C->OARL;
+    uint8_t oarh = I2C->OARH;
+    uint8_t itr = I2C->ITR;
+    uint8_t cr1 = I2C->CR1;
+    uint8_t ack = I2C->CR2 & I2C_CR2_ACK_MASK;
+    uint8_t clocks = I2C_RECOVERY_CLOCKS;
+
+    // Pins are driven by ODR once the peripheral is disabled
+    I2C_Disable();
+    Pin_Set(I2C_SDA);
+    I2C_ReleaseSCL();
+
+    while (!Pin_Read(I2C_SDA) && clocks)
+    {
+        Pin_Clear(I2C_SCL);
+        I2C_HalfBitDelay();
+        I2C_ReleaseSCL();
+        --clocks;
+    }
+
+    // STOP is SDA going high while SCL is high
+    Pin_Clear(I2C_SCL);
+    I2C_HalfBitDelay();
+    Pin_Clear(I2C_SDA);
+    I2C_HalfBitDelay();
+    I2C_ReleaseSCL();
+    Pin_Set(I2C_SDA);
+    I2C_HalfBitDelay();
+
+    // Clear the peripheral's idea of the bus being busy and put the settings back
+    I2C_SoftwareReset();
+    I2C->FREQR = freqr;
+    I2C->CCRL = ccrl;
+    I2C->CCRH = ccrh;
+    I2C->TRISER = triser;
+    I2C->OARL = oarl;
+    I2C->OARH = oarh | I2C_OARH_ADDCONF;
+    I2C->CR1 = cr1;
+    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_ACK_MASK) | ack;
+    I2C->ITR = itr;
+
+    return Pin_Read(I2C_SDA);
+}
+
+//-----------------------------------------------------------------------------
+// Error handling
+//
+// The error flags in SR2 raise the ITERR interrupt when ERREN is set. The
+// interrupt handler clears them and saves them in i2c_error_flags so the
+// polled master functions can see what went wrong, even if the flag was
+// cleared before they looked at SR2.
+//
+
+typedef enum
+{
+    I2C_ERROR_NONE,
+    I2C_ERROR_BUS,              // Misplaced start or stop
+    I2C_ERROR_ARBITRATION,      // Another master won the bus
+    I2C_ERROR_ADDRESS_NACK,     // No device at the address, or device busy
+    I2C_ERROR_DATA_NACK,        // Device refused a data byte
+    I2C_ERROR_OVERRUN,          // Data not serviced in time
+    I2C_ERROR_TIMEOUT,          // Expected event never happened
+    I2C_ERROR_COUNT
+} i2c_error_t;
+
+// Order is the priority of the classification when several flags are set
+static const struct
+{
+    I2C_Flag_TypeDef flag;
+    i2c_error_t error;
+} i2c_error_map[] =
+{
+    { I2C_FLAG_BUSERROR,            I2C_ERROR_BUS },
+    { I2C_FLAG_ARBITRATIONLOSS,     I2C_ERROR_ARBITRATION },
+    { I2C_FLAG_OVERRUNUNDERRUN,     I2C_ERROR_OVERRUN },
+    { I2C_FLAG_ACKNOWLEDGEFAILURE,  I2C_ERROR_ADDRESS_NACK }
+};
+
+__IO uint8_t i2c_error_flags;
+i2c_error_t i2c_last_error;
+
+//-----------------------------------------------------------------------------
+// Return the state of a flag in one of the status registers
+//
+// The register is encoded in the high byte of the flag as 1-3 for SR1-SR3.
+// Be aware that reading SR3 after SR1 clears ADDR.
+//
+bool I2C_GetFlagStatus(I2C_Flag_TypeDef flag)
+{
+    return ((&I2C->SR1)[(flag >> 8) - 1] & (flag & 0xFF)) != 0;
+}
+
+//-----------------------------------------------------------------------------
+// Classify a set of SR2 error flags
+//
+i2c_error_t I2C_ClassifyError(uint8_t sr2)
+{
+    uint8_t i;
+
+    for (i = 0; i < sizeof(i2c_error_map) / sizeof(i2c_error_map[0]); ++i)
+    {
+        if (sr2 & (i2c_error_map[i].flag & 0xFF))
+        {
+            return i2c_error_map[i].error;
+        }
+    }
+    return I2C_ERROR_NONE;
+}
+
+//-----------------------------------------------------------------------------
+// Collect and clear the error flags, whether or not the interrupt saw them
+//
+static uint8_t I2C_TakeErrors(void) CRITICAL
+{
+    uint8_t sr2 = i2c_error_flags | (I2C->SR2 & I2C_SR2_ERRORS_MASK);
+
+    I2C->SR2 = (I2C->SR2 & ~I2C_SR2_ERRORS_MASK);
+    i2c_error_flags = 0;
+    return sr2;
+}
+
+//-----------------------------------------------------------------------------
+// Wait for a status flag, for at most WAIT_BUDGET_I2C polls
+//
+static bool I2C_WaitFlag(__IO uint8_t *reg, uint8_t mask, uint8_t value)
+{
+    return Wait_Flag(reg, mask, value, WAIT_BUDGET_I2C, WAIT_SOURCE_I2C) == WAIT_OK;
+}
+
+//-----------------------------------------------------------------------------
+// Wait for an event in SR1, stopping if an error occurs or it times out
+//
+// The error flags are checked on every poll so this can't use Wait_Flag. It
+// has the same budget and counts its timeouts with Wait_Expired.
+//
+static i2c_error_t I2C_WaitEvent(uint8_t mask)
+{
+    uint16_t budget = WAIT_BUDGET_I2C;
+
+    while ((I2C->SR1 & mask) == 0)
+    {
+        if (i2c_error_flags || (I2C->SR2 & I2C_SR2_ERRORS_MASK))
+        {
+            return I2C_ClassifyError(I2C_TakeErrors());
+        }
+        if (--budget == 0)
+        {
+            Wait_Expired(WAIT_SOURCE_I2C);
+            return I2C_ERROR_TIMEOUT;
+        }
+    }
+    return I2C_ERROR_NONE;
+}
+
+//-----------------------------------------------------------------------------
+// Return the error from the last master transfer
+//
+i2c_error_t I2C_GetLastError(void)
+{
+    return i2c_last_error;
+}
+
+//-----------------------------------------------------------------------------
+// Read a byte from the data register
+//
+bool I2C_ReceiveData(uint8_t *data)
+{
+    I2C->CR2 = (I2C->CR2 & ~ I2C_CR2_ACK_MASK) | I2C_CR2_ACK_ENABLE;
+    if (!I2C_WaitFlag(&I2C->SR1, I2C_SR1_RXNE_MASK, I2C_SR1_RXNE_NOT_EMPTY))
+    {
+        return false;
+    }
+    *data = I2C->DR;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Write a byte to the data register
+//
+bool I2C_SendData(uint8_t data)
+{
+    I2C->DR = data;
+    return I2C_WaitFlag(&I2C->SR1, I2C_SR1_TXE_MASK, I2C_SR1_TXE_EMPTY);
+}
+
+//-----------------------------------------------------------------------------
+// Send address to slave device
+//
+// This is for 7-bit addressing in the range 0-7F. The address is shifted
+// internally to make space for the r/w flag.
+//
+bool I2C_SendAddress(uint8_t addr, i2c_direction_t dir)
+{
+    I2C->DR = (addr << 1) | dir;
+    if (!I2C_WaitFlag(&I2C->SR1, I2C_SR1_ADDR_MASK, I2C_SR1_ADDR_END_OF_TX))
+    {
+        return false;
+    }
+    (void)I2C->SR3; // Clear EV6
+    //I2C->CR2 = (I2C->CR2 & ~I2C_CR2_ACK_MASK) | I2C_CR2_ACK_ENABLE;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Send a 10-bit address to slave device
+//
+// The address goes out as a header byte, 11110 followed by address bits 9:8
+// and the r/w flag, then the low 8 bits. The header is acknowledged by every
+// slave sharing bits 9:8 so ADD10 (EV9) is set rather than ADDR. Reads need
+// the full address sent for a write, then a repeated start and the header
+// again with the read flag.
+//
+// Addresses for the other functions are 7-bit unless I2C_ADDRESS_10BIT is
+// ORed in, which keeps the 7-bit path as it was.
+//
+
+#define I2C_ADDRESS_10BIT           ((uint16_t)0x8000)
+#define I2C_ADDRESS_10BIT_MASK      ((uint16_t)0x03FF)
+#define I2C_HEADER_10BIT(addr)      ((uint8_t)(0xF0 | (((addr) >> 7) & 0x06)))
+
+bool I2C_SendAddress10(uint16_t addr, i2c_direction_t dir)
+{
+    I2C->DR = I2C_HEADER_10BIT(addr) | I2C_DIRECTION_WRITE;
+    if (!I2C_WaitFlag(&I2C->SR1, I2C_SR1_ADD10_MASK, I2C_SR1_ADD10_SENT))
+    {
+        return false;
+    }
+    I2C->DR = (uint8_t)addr;    // Clear EV9
+    if (!I2C_WaitFlag(&I2C->SR1, I2C_SR1_ADDR_MASK, I2C_SR1_ADDR_END_OF_TX))
+    {
+        return false;
+    }
+    (void)I2C->SR3; // Clear EV6
+    if (dir == I2C_DIRECTION_READ)
+    {
+        I2C->CR2 = (I2C->CR2 & ~I2C_CR2_START_MASK) | I2C_CR2_START_ENABLE;
+        if (!I2C_WaitFlag(&I2C->SR1, I2C_SR1_SB_MASK, I2C_SR1_SB_DONE))
+        {
+            return false;
+        }
+        I2C->DR = I2C_HEADER_10BIT(addr) | I2C_DIRECTION_READ;
+        if (!I2C_WaitFlag(&I2C->SR1, I2C_SR1_ADDR_MASK, I2C_SR1_ADDR_END_OF_TX))
+        {
+            return false;
+        }
+        (void)I2C->SR3; // Clear EV6
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Set the start condition
+//
+// If a slave is holding SDA low the bus is recovered first, rather than
+// waiting for the start to time out. If the start still fails the bus is
+// recovered so the next attempt has a chance of working.
+//
+bool I2C_Start(void)
+{
+    if (!Pin_Read(I2C_SDA))
+    {
+        I2C_BusRecover();
+    }
+
+    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_START_MASK) | I2C_CR2_START_ENABLE;
+    if (!I2C_WaitFlag(&I2C->SR1, I2C_SR1_SB_MASK, I2C_SR1_SB_DONE))
+    {
+        I2C_BusRecover();
+        return false;
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Set the stop condition
+//
+bool I2C_Stop(void)
+{
+    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_STOP_MASK) | I2C_CR2_STOP_ENABLE;
+    return I2C_WaitFlag(&I2C->SR3, I2C_SR3_MSL_MASK, I2C_SR3_MSL_SLAVE);
+}
 
-// Calculation to deduce CCR from a requested frequency is:
-// 1/((CCR/freq)) * [2|3|25]
+#ifdef I2CDEVICE
+//-----------------------------------------------------------------------------
+// Check if a slave device responds to an address
 //
-// Examples:
-// 1/((1/10Mhz) * 25)
-// 1/(0.0000001 * 25)
-// 1/0.0000025 => 400000
+// Unlike I2C_SendAddress this watches for the acknowledge failure as well as
+// the address being sent, so an absent device costs one address frame rather
+// than a timeout.
 //
-// 1/((9/10Mhz) * 3)
-// 1/(0.0000009 * 3)
-// 1/0.0000027 => 370370.3703
+// Returns I2C_ERROR_NONE if the device acknowledged, I2C_ERROR_ADDRESS_NACK
+// if nothing did, or the error if the bus itself failed, which for a start
+// that never happened is I2C_ERROR_TIMEOUT.
 //
-// 1/((13/16Mhz) * 3)
-// 1/(0.000000812 * 3)
-// 1/0.000002438 => 410256.4102
-// Error is 410256-400000 => 10256/400000 = 2.56%
+i2c_error_t I2C_Probe(uint8_t addr)
+{
+    i2c_error_t error;
+
+    if (!I2C_Start())
+    {
+        return I2C_ERROR_TIMEOUT;
+    }
+    I2C->DR = (addr << 1) | I2C_DIRECTION_WRITE;
+    error = I2C_WaitEvent(I2C_SR1_ADDR_MASK);
+    if (error == I2C_ERROR_NONE)
+    {
+        (void)I2C->SR3; // Clear EV6
+    }
+    I2C_Stop();
+    return error;
+}
+
+//-----------------------------------------------------------------------------
+// Scan the bus for slave devices
 //
-// 1/((14/freq) * 3)
-// 1/((14/16000000) * 3)
-// 1/(0.000000875 * 3)
-// 1/0.000002625 => 380952.3809
-// Error is 380952-370000  => 10952/370000 = 2.96%
+// The reserved addresses at each end of the 7-bit range are not probed.
+// Responding addresses are set in the found bitmap, which must be 16 bytes.
+// The time taken in ms is returned in time if it's not NULL.
 //
-// Using integers only:
-// 1000000000 / (((CCR * 1000) / Mhz) * DUTY)
+// The scan stops at the first error other than a NACK, eg. a start that
+// times out on a stuck bus, which I2C_Start has already tried to recover.
+// Carrying on would cost a timeout and a recovery for every address. The
+// error is kept for I2C_GetLastError.
 //
-// Example calculations:
-// 1000000000 / ((1000/10) * 25) => 400000 => 400Khz
-// 1000000000 / ((9000/10) * 30) => 370370 => 370Khz
-// 1000000000 / ((14000/16) * 30) => 380952 => 370Khz
-// 1000000000 / ((20000/16) * 25) => 320000 => 320Khz
-// 1000000000 / ((250000/10) * 2) => 20000 => 20Khz
+// Returns the number of devices found, or I2C_SCAN_FAILED.
 //
 
-// Calculate actual speed for a given clock frequency and ccr/duty values
-static uint32_t CalcSpeed(uint8_t freq, uint32_t ccr, uint8_t duty)
+#define I2C_SCAN_FIRST              0x08
+#define I2C_SCAN_LAST               0x77
+#define I2C_SCAN_FAILED             0xFF
+
+uint8_t I2C_Scan(uint8_t *found, uint16_t *time)
 {
-    return 1000000000UL / (((ccr * 1000UL) / freq) * (uint32_t)(duty));
+    uint16_t start = systick;
+    uint8_t count = 0;
+    uint8_t addr;
+    i2c_error_t error;
+
+    for (addr = 0; addr < 16; ++addr)
+    {
+        found[addr] = 0;
+    }
+    for (addr = I2C_SCAN_FIRST; addr <= I2C_SCAN_LAST; ++addr)
+    {
+        error = I2C_Probe(addr);
+        if (error == I2C_ERROR_NONE)
+        {
+            found[addr >> 3] |= 1 << (addr & 0x07);
+            ++count;
+        }
+        else if (error != I2C_ERROR_ADDRESS_NACK)
+        {
+            i2c_last_error = error;
+            count = I2C_SCAN_FAILED;
+            break;
+        }
+    }
+    if (time)
+    {
+        *time = systick - start;
+    }
+    return count;
 }
+#endif // I2CDEVICE
 
-// Calculate margin of error for actual speed against requested speed
-// Returns value accurate to two decimal places but as integer so needs dividing by 100.
-static uint32_t CalcError(uint32_t req, uint32_t act)
+//-----------------------------------------------------------------------------
+// Tidy up the bus after a failed master transfer
+//
+// A NACK leaves us as master so a stop is needed. Losing arbitration drops
+// the peripheral back to slave so there's nothing to do. Anything else means
+// the bus is in an unknown state so it's recovered.
+//
+static void I2C_Abort(i2c_error_t error)
 {
-    if (req > act)
+    switch (error)
     {
-        return ((req - act) * 10000) / req;
+        case I2C_ERROR_ADDRESS_NACK:
+        case I2C_ERROR_DATA_NACK:
+        {
+            I2C_Stop();
+            break;
+        }
+        case I2C_ERROR_ARBITRATION:
+        {
+            break;
+        }
+        default:
+        {
+            I2C_BusRecover();
+            break;
+        }
     }
-    return ((act - req) * 10000) / req;
+    I2C->CR2 = (I2C->CR2 & ~(I2C_CR2_POS_MASK | I2C_CR2_ACK_MASK)) | I2C_CR2_POS_CURRENT | I2C_CR2_ACK_ENABLE;
 }
 
-void I2C_CalculateCCR(uint8_t freq, uint32_t speed, uint16_t *ccr, uint8_t *duty, uint32_t *actual, uint32_t *error)
+//-----------------------------------------------------------------------------
+// Send the start condition and address, leaving ADDR set
+//
+// For a 10-bit read the write phase is completed and followed by a repeated
+// start, so ADDR is left set for the read header as for 7-bit.
+//
+static i2c_error_t I2C_MasterAddress(uint16_t addr, i2c_direction_t dir)
 {
-    uint32_t prev_speed_0 = 0;
-    uint32_t calc_speed_0;
-    uint32_t calc_speed_1;
-    uint32_t i;
+    i2c_error_t error;
 
-    if (speed > 100000)
+    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_START_MASK) | I2C_CR2_START_ENABLE;
+    error = I2C_WaitEvent(I2C_SR1_SB_MASK);
+    if (error != I2C_ERROR_NONE)
     {
-        // Fast mode speeds, duty used in this mode so two calculations need to be carried out
-        for (i = 1; i < 4096; ++i)
-        {
-            calc_speed_0 = CalcSpeed(freq, i, 3);       // Duty 0 (2:1)
-            calc_speed_1 = CalcSpeed(freq, i, 25);      // Duty 1 (16:9)
-            if (calc_speed_0 == speed)
-            {
-                *duty = 0;
-                *ccr = i;
-                *actual = calc_speed_0;
-                *error = 0;
-                return;
-            }
-            if (calc_speed_1 == speed)
-            {
-                *duty = 1;
-                *ccr = i;
-                *actual = calc_speed_1;
-                *error = 0;
-                return;
-            }
-            if (calc_speed_0 < speed)
-            {
-                // Calculated speed lower than requested, find which is closer,
-                // the current speed or the previously calculated speed.
-                //
-                // Duty is nearly always 0 in this case, so assume 0.
-                // TODO: Find out if this is case with duty=0 at all clock frequencies.
-                *duty = 0;
-                if ((prev_speed_0 - speed) > (speed - calc_speed_0))
-                {
-                    // Currently calculated speed is closer
-                    *error = CalcError(speed, calc_speed_0);
-                    *actual = calc_speed_0;
-                    *ccr = i;
-                }
-                else
-                {
-                    // Previously calculated speed is closer
-                    *error = CalcError(speed, prev_speed_0);
-                    *actual = prev_speed_0;
-                    *ccr = i - 1;
-                }
-                return;
-            }
-            prev_speed_0 = calc_speed_0;
-        }
+        return error;
     }
-    else
+    if ((addr & I2C_ADDRESS_10BIT) == 0)
     {
-        // Standard mode speeds, duty is ignored in this mode
-        for (i = 1; i < 4096; ++i)
-        {
-            calc_speed_0 = CalcSpeed(freq, i, 2);       // 1:1 duty cycle
-            if (calc_speed_0 == speed)
-            {
-                *duty = 0;
-                *ccr = i;
-                *actual = calc_speed_0;
-                *error = 0;
-                return;
-            }
-            if (calc_speed_0 < speed)
-            {
-                *duty = 0;
-                if ((prev_speed_0 - speed) > (speed - calc_speed_0))
-                {
-                    // Currently calculated speed is closer
-                    *error = CalcError(speed, calc_speed_0);
-                    *actual = calc_speed_0;
-                    *ccr = i;
-                }
-                else
-                {
-                    // Previously calculated speed is closer
-                    *error = CalcError(speed, prev_speed_0);
-                    *actual = prev_speed_0;
-                    *ccr = i - 1;
-                }
-                return;
-            }
-            prev_speed_0 = calc_speed_0;
-        }
+        I2C->DR = ((uint8_t)addr << 1) | dir;
+        return I2C_WaitEvent(I2C_SR1_ADDR_MASK);
     }
 
-    // No matching settings found, probably due to clock frequency being too low
-    // for the requested speed.
-    *ccr = 0;
-    *duty = 0;
-    *actual = 0;
-    *error = 0;
+    I2C->DR = I2C_HEADER_10BIT(addr) | I2C_DIRECTION_WRITE;
+    error = I2C_WaitEvent(I2C_SR1_ADD10_MASK);
+    if (error != I2C_ERROR_NONE)
+    {
+        return error;
+    }
+    I2C->DR = (uint8_t)addr;    // Clear EV9
+    error = I2C_WaitEvent(I2C_SR1_ADDR_MASK);
+    if ((error != I2C_ERROR_NONE) || (dir == I2C_DIRECTION_WRITE))
+    {
+        return error;
+    }
+    (void)I2C->SR3; // Clear EV6
+    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_START_MASK) | I2C_CR2_START_ENABLE;
+    error = I2C_WaitEvent(I2C_SR1_SB_MASK);
+    if (error != I2C_ERROR_NONE)
+    {
+        return error;
+    }
+    I2C->DR = I2C_HEADER_10BIT(addr) | I2C_DIRECTION_READ;
+    return I2C_WaitEvent(I2C_SR1_ADDR_MASK);
 }
 
 //-----------------------------------------------------------------------------
-// Disable the I2C peripheral
+// Write a block of data to a slave device
 //
-void I2C_Disable(void)
+static i2c_error_t I2C_MasterWrite(uint16_t addr, const uint8_t *data, uint8_t len)
 {
-    I2C->CR1 = (I2C->CR1 & ~I2C_CR1_PE_MASK) | I2C_CR1_PE_DISABLE;
+    i2c_error_t error = I2C_MasterAddress(addr, I2C_DIRECTION_WRITE);
+
+    if (error != I2C_ERROR_NONE)
+    {
+        return error;
+    }
+    (void)I2C->SR3; // Clear EV6
+
+    while (len--)
+    {
+        error = I2C_WaitEvent(I2C_SR1_TXE_MASK);
+        if (error != I2C_ERROR_NONE)
+        {
+            return (error == I2C_ERROR_ADDRESS_NACK) ? I2C_ERROR_DATA_NACK : error;
+        }
+        I2C->DR = *data++;
+    }
+
+    // EV8_2: Wait for the last byte to be shifted out
+    error = I2C_WaitEvent(I2C_SR1_BTF_MASK);
+    if (error != I2C_ERROR_NONE)
+    {
+        return (error == I2C_ERROR_ADDRESS_NACK) ? I2C_ERROR_DATA_NACK : error;
+    }
+    I2C_Stop();
+    return I2C_ERROR_NONE;
 }
 
 //-----------------------------------------------------------------------------
-// Enable the I2C peripheral
+// Read a block of data from a slave device
 //
-void I2C_Enable(void)
+// The ACK, POS and STOP handling for the last bytes is different depending
+// on the number of bytes, see the reference manual (RM0016) for the details.
+//
+static i2c_error_t I2C_MasterRead(uint16_t addr, uint8_t *data, uint8_t len)
 {
-    I2C->CR1 = (I2C->CR1 & ~I2C_CR1_PE_MASK) | I2C_CR1_PE_ENABLE;
+    i2c_error_t error;
+
+    if (len == 2)
+    {
+        // NACK the byte after next
+        I2C->CR2 = (I2C->CR2 & ~(I2C_CR2_POS_MASK | I2C_CR2_ACK_MASK)) | I2C_CR2_POS_NEXT | I2C_CR2_ACK_ENABLE;
+    }
+    else
+    {
+        I2C->CR2 = (I2C->CR2 & ~I2C_CR2_ACK_MASK) | I2C_CR2_ACK_ENABLE;
+    }
+
+    error = I2C_MasterAddress(addr, I2C_DIRECTION_READ);
+    if (error != I2C_ERROR_NONE)
+    {
+        return error;
+    }
+
+    if (len <= 1)
+    {
+        I2C->CR2 = (I2C->CR2 & ~I2C_CR2_ACK_MASK) | I2C_CR2_ACK_DISABLE;
+        (void)I2C->SR3; // Clear EV6
+        I2C->CR2 = (I2C->CR2 & ~I2C_CR2_STOP_MASK) | I2C_CR2_STOP_ENABLE;
+        if (len == 0)
+        {
+            return I2C_ERROR_NONE;
+        }
+        error = I2C_WaitEvent(I2C_SR1_RXNE_MASK);
+        if (error == I2C_ERROR_NONE)
+        {
+            *data = I2C->DR;
+        }
+        return error;
+    }
+
+    (void)I2C->SR3; // Clear EV6
+    if (len == 2)
+    {
+        I2C->CR2 = (I2C->CR2 & ~I2C_CR2_ACK_MASK) | I2C_CR2_ACK_DISABLE;
+        error = I2C_WaitEvent(I2C_SR1_BTF_MASK);
+        if (error == I2C_ERROR_NONE)
+        {
+            I2C->CR2 = (I2C->CR2 & ~I2C_CR2_STOP_MASK) | I2C_CR2_STOP_ENABLE;
+            *data++ = I2C->DR;
+            *data = I2C->DR;
+            I2C->CR2 = (I2C->CR2 & ~I2C_CR2_POS_MASK) | I2C_CR2_POS_CURRENT;
+        }
+        return error;
+    }
+
+    while (len > 3)
+    {
+        error = I2C_WaitEvent(I2C_SR1_RXNE_MASK);
+        if (error != I2C_ERROR_NONE)
+        {
+            return error;
+        }
+        *data++ = I2C->DR;
+        --len;
+    }
+
+    // Three bytes left, N-2 in DR and N-1 in the shift register
+    error = I2C_WaitEvent(I2C_SR1_BTF_MASK);
+    if (error != I2C_ERROR_NONE)
+    {
+        return error;
+    }
+    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_ACK_MASK) | I2C_CR2_ACK_DISABLE;
+    *data++ = I2C->DR;
+    error = I2C_WaitEvent(I2C_SR1_BTF_MASK);
+    if (error != I2C_ERROR_NONE)
+    {
+        return error;
+    }
+    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_STOP_MASK) | I2C_CR2_STOP_ENABLE;
+    *data++ = I2C->DR;
+    error = I2C_WaitEvent(I2C_SR1_RXNE_MASK);
+    if (error == I2C_ERROR_NONE)
+    {
+        *data = I2C->DR;
+    }
+    return error;
 }
 
 //-----------------------------------------------------------------------------
-// Disable start condition
+// Transmit a block of data to the slave device
 //
-void I2C_DisbleStart(void)
+// Returns false on failure, I2C_GetLastError says why.
+//
+bool I2C_Transmit(uint16_t address, const uint8_t *data, uint8_t len)
 {
-    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_START_MASK) | I2C_CR2_START_DISABLE;
+    i2c_last_error = I2C_MasterWrite(address, data, len);
+    if (i2c_last_error != I2C_ERROR_NONE)
+    {
+        I2C_Abort(i2c_last_error);
+        return false;
+    }
+    return true;
 }
 
 //-----------------------------------------------------------------------------
-// Enable start condition
+// Receive a block of data from the slave device
 //
-void I2C_EnableStart(void)
+// Returns the number of bytes received, which is 0 on failure.
+//
+uint8_t I2C_Receive(uint16_t address, uint8_t *data, uint8_t len)
 {
-    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_START_MASK) | I2C_CR2_START_ENABLE;
+    i2c_last_error = I2C_MasterRead(address, data, len);
+    if (i2c_last_error != I2C_ERROR_NONE)
+    {
+        I2C_Abort(i2c_last_error);
+        return 0;
+    }
+    return len;
 }
 
-//-----------------------------------------------------------------------------
-// Disable stop condition
+#ifdef I2CDEVICE
+//=============================================================================
+// I2C devices
+//
+// A device has a retry policy, which depends on how it behaves, and keeps
+// statistics so a device that is starting to fail can be spotted.
+//
+//  I2C_RETRY_NONE      - Fail straight away, eg. sensors where stale data is
+//                        worse than no data.
+//  I2C_RETRY_NACK_POLL - Retry while the address is NACKed, eg. EEPROMs that
+//                        ignore their address during a write cycle. Also
+//                        retries a lost arbitration.
+//  I2C_RETRY_ALL       - Retry any error, recovering the bus in between.
+//
+// Retries go on for up to the device's retry time in ms from the first
+// attempt, as it's how long the device can be busy for that matters, eg. an
+// EEPROM write cycle of up to 5ms, not how many attempts fit in it.
+//
+// Latency is the time in ms from the first attempt to success, including any
+// retries.
 //
-void I2C_DisableStop(void)
+
+typedef enum
 {
-    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_STOP_MASK) | I2C_CR2_STOP_DISABLE;
-}
+    I2C_RETRY_NONE,
+    I2C_RETRY_NACK_POLL,
+    I2C_RETRY_ALL
+} i2c_retry_t;
 
-//-----------------------------------------------------------------------------
-// Enable stop condition
-//
-void I2C_EnableStop(void)
+typedef struct
 {
-    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_STOP_MASK) | I2C_CR2_STOP_ENABLE;
-}
+    uint16_t address;                   // 7-bit, or 10-bit with I2C_ADDRESS_10BIT
+    i2c_retry_t retry;
+    uint16_t retry_ms;                  // How long to keep retrying for
+    uint16_t success;                   // Transfers that succeeded
+    uint16_t retries;                   // Attempts that were retried
+    uint16_t errors[I2C_ERROR_COUNT];   // Transfers that failed, by final error
+    uint16_t latency;                   // Latency of the last successful transfer
+    uint16_t max_latency;               // Worst latency seen
+} i2c_device_t;
 
 //-----------------------------------------------------------------------------
-// Disable sending ACK
+// Initialise a device and clear its statistics
 //
-void I2C_DisableACK(void)
+// The system tick must be running for a retry time other than 0.
+//
+void I2C_DeviceInit(i2c_device_t *dev, uint16_t address, i2c_retry_t retry, uint16_t retry_ms)
 {
-    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_ACK_MASK) | I2C_CR2_ACK_DISABLE;
+    uint8_t i;
+
+    dev->address = address;
+    dev->retry = retry;
+    dev->retry_ms = retry_ms;
+    dev->success = 0;
+    dev->retries = 0;
+    for (i = 0; i < I2C_ERROR_COUNT; ++i)
+    {
+        dev->errors[i] = 0;
+    }
+    dev->latency = 0;
+    dev->max_latency = 0;
 }
 
 //-----------------------------------------------------------------------------
-// Enable sending ACK condition
+// Check whether the device's policy allows an error to be retried
 //
-void I2C_EnableACK(void)
+static bool I2C_DeviceCanRetry(i2c_device_t *dev, i2c_error_t error)
 {
-    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_ACK_MASK) | I2C_CR2_ACK_ENABLE;
+    switch (dev->retry)
+    {
+        case I2C_RETRY_NACK_POLL:
+        {
+            return (error == I2C_ERROR_ADDRESS_NACK) || (error == I2C_ERROR_ARBITRATION);
+        }
+        case I2C_RETRY_ALL:
+        {
+            return true;
+        }
+        case I2C_RETRY_NONE:
+        default:
+        {
+            break;
+        }
+    }
+    return false;
 }
 
 //-----------------------------------------------------------------------------
-// Perform a software reset of the peripheral
-//
-// This is used if the peripheral gets stuck in the busy state due to
-// a misbehaving slave device or problems on the line.
+// Carry out a transfer with a device, applying its retry policy
 //
-void I2C_SoftwareReset(void)
+static bool I2C_DeviceTransfer(i2c_device_t *dev, i2c_direction_t dir, uint8_t *data, uint8_t len)
 {
-    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_SWRST_MASK) | I2C_CR2_SWRST_RESET;
-    // TODO: Any delay required?
-    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_SWRST_MASK) | I2C_CR2_SWRST_RUNNING;
+    uint16_t start = systick;
+    i2c_error_t error;
+
+    for (;;)
+    {
+        if (dir == I2C_DIRECTION_WRITE)
+        {
+            error = I2C_MasterWrite(dev->address, data, len);
+        }
+        else
+        {
+            error = I2C_MasterRead(dev->address, data, len);
+        }
+        if (error == I2C_ERROR_NONE)
+        {
+            break;
+        }
+        I2C_Abort(error);
+        if (!I2C_DeviceCanRetry(dev, error) || ((uint16_t)(systick - start) >= dev->retry_ms))
+        {
+            break;
+        }
+        ++dev->retries;
+    }
+
+    i2c_last_error = error;
+    if (error != I2C_ERROR_NONE)
+    {
+        ++dev->errors[error];
+        return false;
+    }
+    ++dev->success;
+    dev->latency = systick - start;
+    if (dev->latency > dev->max_latency)
+    {
+        dev->max_latency = dev->latency;
+    }
+    return true;
 }
 
 //-----------------------------------------------------------------------------
-// Disable clock stretching
+// Write a block of data to a device
 //
-void I2C_DisableClockStretch(void)
+bool I2C_DeviceWrite(i2c_device_t *dev, const uint8_t *data, uint8_t len)
 {
-    I2C->CR1 = (I2C->CR1 & ~I2C_CR1_NOSTRETCH_MASK) | I2C_CR1_NOSTRETCH_DISABLE;
+    return I2C_DeviceTransfer(dev, I2C_DIRECTION_WRITE, (uint8_t *)data, len);
 }
 
 //-----------------------------------------------------------------------------
-// Enable clock stretching
+// Read a block of data from a device
 //
-void I2C_EnableClockStretch(void)
+bool I2C_DeviceRead(i2c_device_t *dev, uint8_t *data, uint8_t len)
 {
-    I2C->CR1 = (I2C->CR1 & ~I2C_CR1_NOSTRETCH_MASK) | I2C_CR1_NOSTRETCH_ENABLE;
+    return I2C_DeviceTransfer(dev, I2C_DIRECTION_READ, data, len);
 }
+#endif // I2CDEVICE
 
-//-----------------------------------------------------------------------------
-// Check bus busy state
+#ifdef I2CSLAVE
+//=============================================================================
+// I2C slave functions
 //
-// Note that this reads SR3 and reading this register after SR1 has been read
-// clears the ADDR flag in SR1. Therefore only call this function before any
-// communications is started, do not use in the middle of any transaction.
+// The peripheral acts as a device on the bus and exposes a block of RAM as a
+// register file, in the same way as most I2C sensors and EEPROMs do:
 //
-bool I2C_BusBusy(void)
+//  Write: S addr+W ptr [data data ...] P   - sets pointer then writes registers
+//  Read:  S addr+R [data data ...] P       - reads registers from the pointer
+//
+// The pointer auto-increments after each byte and wraps at the end of the
+// register file. Everything is done in the interrupt handler and the data for
+// a read is written to DR straight from the handler so the clock is only
+// stretched for the time it takes to service the ADDR event.
+//
+
+typedef void (*i2c_slave_write_t)(uint8_t reg, uint8_t value);
+typedef void (*i2c_slave_read_t)(uint8_t reg);
+
+typedef enum
 {
-    return (I2C->SR3 & I2C_SR3_BUSY_MASK) == I2C_SR3_BUSY_ONGOING;
-}
+    I2C_SLAVE_IDLE,
+    I2C_SLAVE_POINTER,      // Next received byte is the register pointer
+    I2C_SLAVE_RECEIVING,    // Received bytes are written to the register file
+    I2C_SLAVE_TRANSMITTING  // Register file is being read by the master
+} i2c_slave_state_t;
+
+uint8_t *i2c_slave_regs;
+uint8_t i2c_slave_size;
+__IO uint8_t i2c_slave_ptr;
+__IO i2c_slave_state_t i2c_slave_state;
+i2c_slave_write_t i2c_slave_write_cb;
+i2c_slave_read_t i2c_slave_read_cb;
 
 //-----------------------------------------------------------------------------
-// Initialise the I2C peripheral
+// Configure the peripheral as a slave with a RAM register file
 //
-// Note that a system clock frequency multiple of 10Mhz is needed as this
-// satisfies the requirement for fast mode at 400Khz.
+// The write callback is called for every byte the master writes into the
+// register file. The read callback is called after a register has been loaded
+// into DR for the master, eg. for clear-on-read registers. Either can be NULL.
 //
-void I2C_Init(i2c_speed_t speed, uint8_t freq, uint16_t ccr, uint8_t duty)
+// OR I2C_ADDRESS_10BIT into addr to respond to a 10-bit address instead.
+//
+// I2C_Init must have been called first to set up the clock registers.
+//
+void I2C_SlaveInit(uint16_t addr, uint8_t *regs, uint8_t size, i2c_slave_write_t write_cb, i2c_slave_read_t read_cb)
 {
+    i2c_slave_regs = regs;
+    i2c_slave_size = size;
+    i2c_slave_ptr = 0;
+    i2c_slave_state = I2C_SLAVE_IDLE;
+    i2c_slave_write_cb = write_cb;
+    i2c_slave_read_cb = read_cb;
+
     I2C_Disable();
-    I2C->FREQR = freq;
-    I2C->CCRL = (ccr >> 0) & I2C_CCRL_CCR_MASK;
-    I2C->CCRH = (ccr >> 8) & I2C_CCRH_CCR_MASK;
-    I2C->CCRH = (I2C->CCRH & ~I2C_CCRH_FS_MASK) | speed;
-    I2C->CCRH = (I2C->CCRH & ~I2C_CCRH_DUTY_MASK) | duty;
-    I2C->OARH = (I2C->OARH & ~(I2C_OARH_ADDMODE_MASK | I2C_OARH_ADDCONF_MASK)) | I2C_OARH_ADDMODE_7BIT | I2C_OARH_ADDCONF;
-    if (speed == I2C_SPEED_STANDARD)
+    if (addr & I2C_ADDRESS_10BIT)
     {
-        I2C->TRISER = I2C->FREQR + 1;
+        I2C->OARL = (uint8_t)addr;
+        I2C->OARH = (I2C->OARH & ~(I2C_OARH_ADDMODE_MASK | I2C_OARH_ADDCONF_MASK | I2C_OARH_ADD_MASK))
+                  | I2C_OARH_ADDMODE_10BIT | I2C_OARH_ADDCONF | ((addr >> 7) & I2C_OARH_ADD_MASK);
     }
     else
     {
-        I2C->TRISER = ((I2C->FREQR * 3) / 10) + 1;;
+        I2C->OARL = ((uint8_t)addr << 1) & I2C_OARL_ADD_MASK;
+        I2C->OARH = (I2C->OARH & ~(I2C_OARH_ADDMODE_MASK | I2C_OARH_ADDCONF_MASK)) | I2C_OARH_ADDMODE_7BIT | I2C_OARH_ADDCONF;
     }
+    I2C_EnableClockStretch();
     I2C_Enable();
+
+    // ACK can only be set once the peripheral is enabled
+    I2C_EnableACK();
+    I2C->ITR = I2C_ITR_BUFEN_ENABLE | I2C_ITR_EVTEN_ENABLE | I2C_ITR_ERREN_ENABLE;
 }
 
 //-----------------------------------------------------------------------------
-// Configure for standard mode I2C comms master
-//
-// Assumes 7-bit addressing, default acknowledgement
+// Return the current value of the register pointer
 //
-void I2C_ConfigStdModeMaster(void)
+uint8_t I2C_SlaveGetPointer(void)
 {
-    I2C_EnableACK();
-    I2C_EnableStart();
+    return i2c_slave_ptr;
 }
 
 //-----------------------------------------------------------------------------
-// Read a byte from the data register
+// Load the next register into the data register and advance the pointer
 //
-bool I2C_ReceiveData(uint8_t *data)
+static void I2C_SlaveTransmitNext(void)
 {
-    uint16_t timeout;
+    uint8_t reg = i2c_slave_ptr;
 
-    I2C->CR2 = (I2C->CR2 & ~ I2C_CR2_ACK_MASK) | I2C_CR2_ACK_ENABLE;
-    while ((I2C->SR1 & I2C_SR1_RXNE_MASK) == I2C_SR1_RXNE_EMPTY)
+    I2C->DR = i2c_slave_regs[reg];
+    i2c_slave_ptr = (reg + 1 < i2c_slave_size) ? reg + 1 : 0;
+    if (i2c_slave_read_cb)
     {
-        if (Systick_Timeout(&timeout, 100))
-        {
-            return false;
-        }
+        i2c_slave_read_cb(reg);
     }
-    *data = I2C->DR;
-    return true;
 }
 
 //-----------------------------------------------------------------------------
-// Write a byte to the data register
+// Handle the slave events
 //
-bool I2C_SendData(uint8_t data)
+// The order of the checks matters: SR1 must be read before SR3 to clear ADDR
+// and before CR2 is written to clear STOPF.
+//
+static void I2C_SlaveHandler(void)
 {
-    uint16_t timeout;
+    uint8_t sr1 = I2C->SR1;
 
-    I2C->DR = data;
-    while ((I2C->SR1 & I2C_SR1_TXE_MASK) == I2C_SR1_TXE_NOT_EMPTY)
+    if ((sr1 & I2C_SR1_ADDR_MASK) == I2C_SR1_ADDR_MATCH)
     {
-        if (Systick_Timeout(&timeout, 100))
+        // EV1: Reading SR3 after SR1 clears ADDR
+        if ((I2C->SR3 & I2C_SR3_TRA_MASK) == I2C_SR3_TRA_TRANSMITTED)
         {
-            return false;
+            i2c_slave_state = I2C_SLAVE_TRANSMITTING;
+            I2C_SlaveTransmitNext();
         }
+        else
+        {
+            i2c_slave_state = I2C_SLAVE_POINTER;
+        }
+        return;
     }
-    return true;
-}
-
-//-----------------------------------------------------------------------------
-// Send address to slave device
-//
-// This is for 7-bit addressing in the range 0-7F. The address is shifted
-// internally to make space for the r/w flag.
-//
-bool I2C_SendAddress(uint8_t addr, i2c_direction_t dir)
-{
-    uint16_t timeout;
 
-    I2C->DR = (addr << 1) | dir;
-    while ((I2C->SR1 & I2C_SR1_ADDR_MASK) == I2C_SR1_ADDR_NOT_END_OF_TX)
+    if ((sr1 & I2C_SR1_RXNE_MASK) == I2C_SR1_RXNE_NOT_EMPTY)
     {
-        if (Systick_Timeout(&timeout, 100))
+        // EV2: Reading DR clears RXNE
+        uint8_t byte = I2C->DR;
+        uint8_t reg = i2c_slave_ptr;
+
+        if (i2c_slave_state == I2C_SLAVE_POINTER)
         {
-            return false;
+            i2c_slave_ptr = (byte < i2c_slave_size) ? byte : 0;
+            i2c_slave_state = I2C_SLAVE_RECEIVING;
+        }
+        else
+        {
+            i2c_slave_regs[reg] = byte;
+            i2c_slave_ptr = (reg + 1 < i2c_slave_size) ? reg + 1 : 0;
+            if (i2c_slave_write_cb)
+            {
+                i2c_slave_write_cb(reg, byte);
+            }
         }
+        return;
     }
-    (void)I2C->SR3; // Clear EV6
-    //I2C->CR2 = (I2C->CR2 & ~I2C_CR2_ACK_MASK) | I2C_CR2_ACK_ENABLE;
-    return true;
-}
-
-//-----------------------------------------------------------------------------
-// Set the start condition
-//
-bool I2C_Start(void)
-{
-    uint16_t timeout;
 
-    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_START_MASK) | I2C_CR2_START_ENABLE;
-    while ((I2C->SR1 & I2C_SR1_SB_MASK) == I2C_SR1_SB_NOT_DONE)
+    if ((sr1 & I2C_SR1_TXE_MASK) == I2C_SR1_TXE_EMPTY)
     {
-        if (Systick_Timeout(&timeout, 100))
+        // EV3: Writing DR clears TXE
+        if (i2c_slave_state == I2C_SLAVE_TRANSMITTING)
         {
-            return false;
+            I2C_SlaveTransmitNext();
         }
+        return;
+    }
+
+    if ((sr1 & I2C_SR1_STOPF_MASK) == I2C_SR1_STOPF_DETECTED)
+    {
+        // EV4: Writing CR2 after reading SR1 clears STOPF
+        I2C->CR2 = I2C->CR2;
+        i2c_slave_state = I2C_SLAVE_IDLE;
     }
-    return true;
 }
 
 //-----------------------------------------------------------------------------
-// Set the stop condition
+// Handle the slave error events
 //
-bool I2C_Stop(void)
+// EV3_2: The master NACKs the last byte it wants to read. The byte already
+// loaded into DR will never be sent, so the pointer is stepped back to it.
+//
+static void I2C_SlaveErrorHandler(uint8_t sr2)
 {
-    uint16_t timeout;
-
-    I2C->CR2 = (I2C->CR2 & ~I2C_CR2_STOP_MASK) | I2C_CR2_STOP_ENABLE;
-    while ((I2C->SR3 & I2C_SR3_MSL_MASK) == I2C_SR3_MSL_MASTER)
+    if (sr2 & I2C_SR2_AF_MASK)
     {
-        if (Systick_Timeout(&timeout, 100))
+        // The master NACKed the last byte sent so it wasn't really consumed
+        if (i2c_slave_state == I2C_SLAVE_TRANSMITTING)
         {
-            return false;
+            i2c_slave_ptr = (i2c_slave_ptr == 0) ? i2c_slave_size - 1 : i2c_slave_ptr - 1;
         }
     }
-    return true;
+    // Bus error, overrun, etc. Wait for the next start
+    i2c_slave_state = I2C_SLAVE_IDLE;
 }
+#endif // I2CSLAVE
 
 //-----------------------------------------------------------------------------
-// Transmit a block of data to the slave device
+// Interrupt handler for the I2C peripheral
 //
-void I2C_Transmit(uint8_t address, const uint8_t *data, uint8_t len)
-{
-
-}
-
-//-----------------------------------------------------------------------------
-// Receive a block of data to the slave device
+// Errors are cleared here so they don't keep the interrupt pending. As a
+// slave they're dealt with straight away, as a master they're latched for
+// I2C_WaitEvent to pick up.
 //
-uint8_t I2C_Receive(uint8_t address, const uint8_t *data, uint8_t len)
+#if defined __IAR_SYSTEMS_ICC__
+#pragma vector=19
+#endif
+INTERRUPT(I2C_IRQHandler, 19)
 {
-    return 0;
+    uint8_t sr2 = I2C->SR2 & I2C_SR2_ERRORS_MASK;
+
+    if (sr2)
+    {
+        I2C->SR2 = (I2C->SR2 & ~I2C_SR2_ERRORS_MASK);
+#ifdef I2CSLAVE
+        if (i2c_slave_regs)
+        {
+            I2C_SlaveErrorHandler(sr2);
+        }
+        else
+#endif // I2CSLAVE
+        {
+            i2c_error_flags |= sr2;
+        }
+    }
+#ifdef I2CSLAVE
+    else if (i2c_slave_regs)
+    {
+        I2C_SlaveHandler();
+    }
+#endif // I2CSLAVE
 }
 
 //=============================================================================
 // GPIO functions
 //
 
+#define LED_PIN                     PIN(D,7)
+#define BEEP_PIN                    PIN(D,4)
+
 //-----------------------------------------------------------------------------
 // Configure the GPIOs
 //
 void Gpio_Config(void)
 {
     // LED
-    GPIOD->DDR |= GPIO_DDR_7_OUTPUT;
-    GPIOD->CR1 |= GPIO_CR1_7_OUTPUT_PUSHPULL;
-    GPIOD->CR2 |= GPIO_CR2_7_OUTPUT_2MHZ;
+    Pin_ConfigOutput(LED_PIN);
+    Pin_ConfigSlow(LED_PIN);
 
     // BEEPER
-    GPIOD->DDR |= GPIO_DDR_4_OUTPUT;
-    GPIOD->CR1 |= GPIO_CR1_4_OUTPUT_PUSHPULL;
-    GPIOD->CR2 |= GPIO_CR2_4_OUTPUT_2MHZ;
+    Pin_ConfigOutput(BEEP_PIN);
+    Pin_ConfigSlow(BEEP_PIN);
 
     // I2C
-    GPIOB->DDR |= GPIO_DDR_4_OUTPUT;
-    GPIOB->CR1 |= GPIO_CR1_4_OUTPUT_OPENDRAIN;
-    GPIOB->CR2 |= GPIO_CR2_4_OUTPUT_2MHZ;
-    GPIOB->ODR |= GPIO_ODR_4_HIGH;
+    Pin_ConfigOpenDrain(I2C_SCL);
+    Pin_ConfigSlow(I2C_SCL);
+    Pin_Set(I2C_SCL);
 
-    GPIOB->DDR |= GPIO_DDR_5_OUTPUT;
-    GPIOB->CR1 |= GPIO_CR1_5_OUTPUT_OPENDRAIN;
-    GPIOB->CR2 |= GPIO_CR2_5_OUTPUT_2MHZ;
-    GPIOB->ODR |= GPIO_ODR_5_HIGH;
+    Pin_ConfigOpenDrain(I2C_SDA);
+    Pin_ConfigSlow(I2C_SDA);
+    Pin_Set(I2C_SDA);
 }
 
 //-----------------------------------------------------------------------------
@@ -4525,7 +10326,7 @@ void Gpio_Config(void)
 //
 void Gpio_TurnOnLED(void)
 {
-    GPIOD->ODR = (GPIOD->ODR & ~GPIO_ODR_7_MASK) | GPIO_ODR_7_HIGH;
+    Pin_Set(LED_PIN);
 }
 
 //-----------------------------------------------------------------------------
@@ -4533,7 +10334,7 @@ void Gpio_TurnOnLED(void)
 //
 void Gpio_TurnOffLED(void)
 {
-    GPIOD->ODR = (GPIOD->ODR & ~GPIO_ODR_7_MASK) | GPIO_ODR_7_LOW;
+    Pin_Clear(LED_PIN);
 }
 
 //@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
@@ -4575,6 +10376,10 @@ void TestI2CSpeeds(uint8_t clock)
     }
 }
 
+#ifdef I2CSLAVE
+uint8_t i2c_regs[16];
+#endif
+
 uint8_t txbuffer[32];
 circular_buffer_t txbuf;
 uint8_t rxbuffer[64];
@@ -4583,14 +10388,8 @@ circular_buffer_t rxbuf;
 void main(void)
 {
 #ifdef FADER
-    uint16_t fade = 0;
-    uint16_t fader = 0;
     uint8_t up = 0;
 #endif
-#ifdef FLASHER
-    uint16_t flasher = 0;
-    uint8_t flash = 0;
-#endif
 #ifdef SERIALIZER
     uint16_t transmitter = 0;
 #endif
@@ -4601,12 +10400,20 @@ void main(void)
 #endif
 #ifdef SQUARER
     uint16_t squarer = 0;
+    i2c_device_t i2c_device;
 #endif
     uint32_t lsi_freq = 0;
     uint16_t ccr;
     uint8_t duty;
+    uint16_t delay_overhead;
+#ifdef FLASHCHECK
+    flash_check_t flash_check;
+    uint16_t checker = 0;
+    uint16_t flash_check_ms;
+#endif
 
     SysClock_HSI();
+    delay_overhead = Delay_Calibrate();
     Systick_Init();
     //lsi_freq = AWU_MeasureLSI();
     Tim1_ConfigPWM();
@@ -4620,6 +10427,26 @@ void main(void)
 
     enableInterrupts();
 
+#ifdef FLASHCHECK
+    // Check the program flash, timed by the system tick
+    flash_check_ms = systick;
+    flash_check = FlashCheck_Run();
+    flash_check_ms = systick - flash_check_ms;
+    OutputText("Flash CRC %s in %ums\r\n", (flash_check == FLASH_CHECK_OK) ? "ok" :
+                                           (flash_check == FLASH_CHECK_BAD) ? "bad" : "missing", flash_check_ms);
+#endif // FLASHCHECK
+    OutputText("Delay overhead %u cycles\r\n", delay_overhead);
+
+    // Blink a heartbeat on the LED if PD2 is connected
+#ifdef FLASHER
+    Status_Init();
+    Status_Show(&status_heartbeat, 1);
+#endif
+
+#ifdef FADER
+    Fade_Init(TIM1_PERIOD, SysClock_GetClockFreq() / TIM1_PERIOD);
+#endif
+
 #ifdef BEEPER
     Beep_SetPrescaler(BEEP_PRESCALE_2);
     Beep_SetFrequency(BEEP_8KHZ);
@@ -4635,109 +10462,79 @@ void main(void)
 
     I2C_Init(I2C_SPEED_STANDARD, 16, 160, 0);   //160=50Khz
     I2C_ConfigStdModeMaster();
+    {
+        uint8_t found[16];
+        uint16_t time;
+        uint8_t addr;
+        uint8_t count = I2C_Scan(found, &time);
+
+        if (count == I2C_SCAN_FAILED)
+        {
+            OutputText("I2C scan failed in %ums, error %d", time, I2C_GetLastError());
+        }
+        else
+        {
+            OutputText("I2C scan found %bu in %ums:", count, time);
+        }
+        for (addr = I2C_SCAN_FIRST; addr <= I2C_SCAN_LAST; ++addr)
+        {
+            if (found[addr >> 3] & (1 << (addr & 0x07)))
+            {
+                OutputText(" %02bx", addr);
+            }
+        }
+        OutputText("\r\n");
+    }
+    I2C_DeviceInit(&i2c_device, 0x40, I2C_RETRY_NACK_POLL, 10);
+#endif
+
+#ifdef I2CSLAVE
+    I2C_Init(I2C_SPEED_STANDARD, 16, 160, 0);
+    I2C_SlaveInit(0x42, i2c_regs, sizeof(i2c_regs), NULL, NULL);
 #endif
 
     OutputChar('\r');
     for (;;)
     {
+#ifdef FLASHCHECK
+        // Keep checking the flash in the background, a piece at a time
+        if (Systick_Timeout(&checker, 10))
+        {
+            if (FlashCheck_Step(FLASH_CHECK_STEP) == FLASH_CHECK_BAD)
+            {
+                OutputText("Flash CRC bad\r\n");
+            }
+        }
+#endif // FLASHCHECK
+
         // Do I2C stuff
 #ifdef SQUARER
         if (Systick_Timeout(&squarer, 500))
         {
             static int counter;
-            if (!I2C_BusBusy())
-            {
-                bool fail = false;
-                OutputText("I2C kicked %d\r\n", ++counter);
-                if (!I2C_Start())
-                {
-                    fail = true;
-                    OutputText("Start failed SR1=%x SR2=%x SR3=%x\r\n", I2C->SR1, I2C->SR2, I2C->SR3);
-                }
-                if (!fail)
-                {
-                    if (!I2C_SendAddress(0x40, I2C_DIRECTION_WRITE))
-                    {
-                        fail = true;
-                        OutputText("Address failed\r\n");
-                    }
-                }
-                if (!fail)
-                {
-                    if (!I2C_SendData(0xAA))
-                    {
-                        fail = true;
-                        OutputText("Data failed\r\n");
-                    }
-                }
-                if (!fail)
-                {
-                    if (!I2C_Stop())
-                    {
-                        fail = true;
-                        OutputText("Stop failed\r\n");
-                    }
-                }
-                if (fail)
-                {
-                    I2C_SoftwareReset();
-                    OutputText("I2C reset\r\n");
-                }
-            }
-            else
+            static const uint8_t pattern[] = { 0xAA };
+            OutputText("I2C kicked %d\r\n", ++counter);
+            if (!I2C_DeviceWrite(&i2c_device, pattern, sizeof(pattern)))
             {
-                I2C_SoftwareReset();
-                OutputText("I2C busy %d\r\n", ++counter);
+                OutputText("I2C failed, error %d, ok %u retries %u max %ums\r\n",
+                           I2C_GetLastError(), i2c_device.success, i2c_device.retries, i2c_device.max_latency);
             }
         }
 #endif // SQUARER
 
-        // Flash the LED if PD7 is connected
-#ifdef FLASHER
-        if (flash)
-        {
-            if (Systick_Timeout(&flasher, 100))
-            {
-                Gpio_TurnOnLED();
-                flash = 0;
-            }
-        }
-        else
-        {
-            if (Systick_Timeout(&flasher, 400))
-            {
-                Gpio_TurnOffLED();
-                flash = 1;
-            }
-        }
-#endif // FLASHER
+        // Expose the system tick to the I2C master in registers 0 & 1
+#ifdef I2CSLAVE
+        i2c_regs[0] = (systick >> 0) & 0xFF;
+        i2c_regs[1] = (systick >> 8) & 0xFF;
+#endif // I2CSLAVE
 
         // Fade the LED in and out if PC3 is connected
 #ifdef FADER
-        if (Systick_Timeout(&fader, 10))
+        if (!Fade_Busy(TIM1_CHANNEL_3))
         {
-            Tim1_SetCounter(fade);
-            if (up)
-            {
-                fade += 10;
-                if (fade > TIM1_PERIOD)
-                {
-                    up = 0;
-                }
-                GPIOB->ODR = (GPIOB->ODR & ~GPIO_ODR_4_MASK) | GPIO_ODR_4_LOW;
-            }
-            else
-            {
-                if (fade > 0)
-                {
-                    fade -= 10;
-                }
-                else
-                {
-                    up = 1;
-                }
-                GPIOB->ODR = (GPIOB->ODR & ~GPIO_ODR_4_MASK) | GPIO_ODR_4_HIGH;
-            }
+            up = !up;
+            Fade_To(TIM1_CHANNEL_3, up ? 255 : 0, 1000);
+            Pin_Write(PIN(B,4), !up);
         }
 #endif // FADER
 